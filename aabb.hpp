@@ -0,0 +1,103 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "common.hpp"
+#include "interval.hpp"
+#include "ray.hpp"
+
+// Axis-aligned bounding box
+class Aabb {
+    public:
+        Interval x, y, z;
+
+        // The default box is empty
+        Aabb() {
+        }
+
+        Aabb(const Interval &x, const Interval &y, const Interval &z)
+            : x(x), y(y), z(z) {
+            pad_to_minimums();
+        }
+
+        // Treats a and b as opposite corners of the box
+        Aabb(const Point3 &a, const Point3 &b) {
+            x = Interval(std::fmin(a[0], b[0]), std::fmax(a[0], b[0]));
+            y = Interval(std::fmin(a[1], b[1]), std::fmax(a[1], b[1]));
+            z = Interval(std::fmin(a[2], b[2]), std::fmax(a[2], b[2]));
+            pad_to_minimums();
+        }
+
+        // Tightest box enclosing both boxes
+        Aabb(const Aabb &box0, const Aabb &box1) {
+            x = Interval(box0.x, box1.x);
+            y = Interval(box0.y, box1.y);
+            z = Interval(box0.z, box1.z);
+        }
+
+        const Interval &axis_interval(int n) const {
+            if (n == 1) return y;
+            if (n == 2) return z;
+            return x;
+        }
+
+        bool empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
+        Point3 centroid() const {
+            return Point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max),
+                          0.5 * (z.min + z.max));
+        }
+
+        int longest_axis() const {
+            if (x.size() > y.size()) {
+                return x.size() > z.size() ? 0 : 2;
+            }
+            return y.size() > z.size() ? 1 : 2;
+        }
+
+        double surface_area() const {
+            if (empty()) return 0;
+            auto dx = x.size(), dy = y.size(), dz = z.size();
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        /**
+         * Slab test: clips ray_t against each pair of axis planes and
+         * reports whether anything of the interval survives.
+         */
+        bool hit(const Ray &r, Interval ray_t) const {
+            const Point3 &ray_orig = r.origin();
+            const Vec3 &ray_dir = r.direction();
+
+            for (int axis = 0; axis < 3; axis++) {
+                const Interval &ax = axis_interval(axis);
+                const Real adinv = 1 / ray_dir[axis];
+
+                auto t0 = (ax.min - ray_orig[axis]) * adinv;
+                auto t1 = (ax.max - ray_orig[axis]) * adinv;
+
+                if (t0 < t1) {
+                    if (t0 > ray_t.min) ray_t.min = t0;
+                    if (t1 < ray_t.max) ray_t.max = t1;
+                } else {
+                    if (t1 > ray_t.min) ray_t.min = t1;
+                    if (t0 < ray_t.max) ray_t.max = t0;
+                }
+
+                if (ray_t.max <= ray_t.min) return false;
+            }
+            return true;
+        }
+
+    private:
+        // Keeps flat boxes from having zero width on any axis
+        void pad_to_minimums() {
+            double delta = 0.0001;
+            if (x.size() < delta) x = x.expand(delta);
+            if (y.size() < delta) y = y.expand(delta);
+            if (z.size() < delta) z = z.expand(delta);
+        }
+};
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "common.hpp"
+#include "aabb.hpp"
+#include "camera.hpp"
+#include "flat_bvh.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+// How AnimatedSpheres brings its tree up to date for a new frame
+enum class BvhUpdate { automatic, refit, rebuild };
+
+/**
+ * Spheres whose centers move with scene time. A sphere either moves in a
+ * straight line, center + time * velocity, or follows keyframes: linear
+ * between keys, held before the first and after the last. A ray hits the
+ * spheres where they are at its time().
+ *
+ * The FlatBvh bounds each sphere's sweep over one shutter interval, so
+ * rays must carry times inside the interval last given to set_shutter.
+ * Moving the interval to the next frame refits the tree in place; once
+ * refitting has made its SAH cost rebuild_threshold times what it was
+ * after the last build, the tree is rebuilt instead. `update` can force
+ * either choice, for comparison.
+ */
+class AnimatedSpheres : public Hittable {
+    public:
+        BvhUpdate update = BvhUpdate::automatic;
+        double rebuild_threshold = 1.5;
+
+        void add_moving(const Point3 &center, const Vec3 &velocity,
+                        double radius, shared_ptr<Material> mat) {
+            motions.push_back({center, velocity, Real(std::fmax(0, radius)),
+                               0, 0, material_slot(mat)});
+            built = false;
+        }
+
+        // times must increase; centers[k] is the center at times[k]
+        void add_keyframed(const std::vector<double> &times,
+                           const std::vector<Point3> &centers, double radius,
+                           shared_ptr<Material> mat) {
+            if (times.empty() || times.size() != centers.size()) {
+                throw std::invalid_argument(
+                    "AnimatedSpheres: need one center per key time");
+            }
+            for (size_t k = 1; k < times.size(); k++) {
+                if (!(times[k] > times[k - 1])) {
+                    throw std::invalid_argument(
+                        "AnimatedSpheres: key times must increase");
+                }
+            }
+
+            auto first = std::uint32_t(key_times.size());
+            key_times.insert(key_times.end(), times.begin(), times.end());
+            key_centers.insert(key_centers.end(), centers.begin(),
+                               centers.end());
+            motions.push_back({centers[0], Vec3(0, 0, 0),
+                               Real(std::fmax(0, radius)), first,
+                               std::uint32_t(times.size()),
+                               material_slot(mat)});
+            built = false;
+        }
+
+        void reserve(size_t count) {
+            motions.reserve(count);
+        }
+
+        /**
+         * Bounds the spheres over scene times [open, close] for the next
+         * frame. Refits the tree, or rebuilds it if refitting has degraded
+         * it too far or spheres were added; returns true on a rebuild.
+         */
+        bool set_shutter(double open, double close) {
+            shutter_open = open;
+            shutter_close = close;
+            if (!built || update == BvhUpdate::rebuild) {
+                rebuild();
+                return true;
+            }
+
+            bvh.refit(swept_boxes());
+            if (update == BvhUpdate::automatic &&
+                bvh.sah_cost() > rebuild_threshold * built_cost) {
+                rebuild();
+                return true;
+            }
+            return false;
+        }
+
+        // SAH cost of the tree now and right after its last build
+        double sah_cost() const {
+            return bvh.sah_cost();
+        }
+
+        double built_sah_cost() const {
+            return built_cost;
+        }
+
+        size_t size() const {
+            return motions.size();
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            const Motion *closest = nullptr;
+            Point3 closest_center;
+            Real closest_t = 0;
+
+            bvh.intersect(r, ray_t,
+                          [&](std::uint32_t first, std::uint32_t count,
+                              Interval &t) {
+                              bool hit_anything = false;
+                              for (auto k = first; k < first + count; k++) {
+                                  const auto &motion = motions[k];
+                                  auto center = center_at(motion, r.time());
+                                  Real root;
+                                  if (sphere_hit_distance(r, center,
+                                                          motion.radius, t,
+                                                          root)) {
+                                      hit_anything = true;
+                                      closest = &motion;
+                                      closest_center = center;
+                                      closest_t = root;
+                                      t.max = root;
+                                  }
+                              }
+                              return hit_anything;
+                          });
+            if (!closest) return false;
+
+            rec.t = closest_t;
+            rec.p = r.at(closest_t);
+            rec.set_face_normal(r, (rec.p - closest_center) / closest->radius);
+            rec.mat = &materials[closest->material];
+            return true;
+        }
+
+        Aabb bounding_box() const override {
+            return bvh.bounding_box();
+        }
+
+        unsigned material_kinds() const override {
+            unsigned kinds = 0;
+            for (const auto &material : materials) {
+                kinds |= material_bit(material.kind());
+            }
+            return kinds;
+        }
+
+    private:
+        struct Motion {
+                Point3 center; // at time 0, if not keyframed
+                Vec3 velocity;
+                Real radius;
+                std::uint32_t first_key;
+                std::uint32_t key_count; // 0 for linear motion
+                std::uint32_t material;
+        };
+
+        std::vector<Motion> motions; // in leaf order once built
+        std::vector<double> key_times;
+        std::vector<Point3> key_centers;
+        std::vector<Material> materials; // copies, one per distinct source
+        // Holds on to the sources so their addresses are not reused
+        std::unordered_map<shared_ptr<Material>, std::uint32_t> material_slots;
+
+        FlatBvh bvh;
+        bool built = false;
+        double built_cost = 0;
+        double shutter_open = 0, shutter_close = 0;
+
+        // Builds a new tree and stores the spheres in its leaf order
+        void rebuild() {
+            bvh.build(swept_boxes());
+
+            std::vector<Motion> ordered;
+            ordered.reserve(motions.size());
+            for (auto k : bvh.primitive_order()) {
+                ordered.push_back(motions[k]);
+            }
+            motions = std::move(ordered);
+            built_cost = bvh.sah_cost();
+            built = true;
+        }
+
+        std::uint32_t material_slot(const shared_ptr<Material> &mat) {
+            auto [slot, inserted] = material_slots.try_emplace(
+                mat, std::uint32_t(materials.size()));
+            if (inserted) {
+                materials.push_back(*mat);
+            }
+            return slot->second;
+        }
+
+        Point3 center_at(const Motion &motion, double time) const {
+            if (motion.key_count == 0) {
+                return motion.center + Real(time) * motion.velocity;
+            }
+
+            const double *times = &key_times[motion.first_key];
+            const Point3 *centers = &key_centers[motion.first_key];
+            auto last = motion.key_count - 1;
+            if (time <= times[0]) return centers[0];
+            if (time >= times[last]) return centers[last];
+
+            auto k = std::upper_bound(times, times + last, time) - times;
+            auto f = Real((time - times[k - 1]) / (times[k] - times[k - 1]));
+            return (1 - f) * centers[k - 1] + f * centers[k];
+        }
+
+        // Box of every position of each sphere during the shutter. Motion
+        // is linear between keys, so the ends of the interval and the keys
+        // inside it are enough.
+        std::vector<Aabb> swept_boxes() const {
+            std::vector<Aabb> boxes;
+            boxes.reserve(motions.size());
+            for (const auto &motion : motions) {
+                auto r = Vec3(motion.radius, motion.radius, motion.radius);
+                auto sphere_box = [&](const Point3 &center) {
+                    return Aabb(center - r, center + r);
+                };
+
+                Aabb box(sphere_box(center_at(motion, shutter_open)),
+                         sphere_box(center_at(motion, shutter_close)));
+                for (auto k = motion.first_key;
+                     k < motion.first_key + motion.key_count; k++) {
+                    if (key_times[k] > shutter_open &&
+                        key_times[k] < shutter_close) {
+                        box = Aabb(box, sphere_box(key_centers[k]));
+                    }
+                }
+                boxes.push_back(box);
+            }
+            return boxes;
+        }
+};
+
+/**
+ * Renders an animation of AnimatedSpheres frame by frame. Frame f starts
+ * at scene time f / frame_rate, and its shutter stays open for the given
+ * share of the frame, over which the camera spreads its rays for motion
+ * blur. Between frames the scene's tree is refitted rather than rebuilt,
+ * as AnimatedSpheres::set_shutter decides.
+ */
+class AnimationRenderer {
+    public:
+        int frame_count = 24;
+        double frame_rate = 24; // frames per unit of scene time
+        double shutter = 0.5;   // 0.5 is a 180 degree shutter
+
+        struct FrameStats {
+                double update_seconds = 0;
+                double render_seconds = 0;
+                bool rebuilt = false;
+                double sah_cost = 0;
+        };
+
+        // Calls on_frame(frame, image) after rendering each frame
+        template <typename FrameFn>
+        void render(Camera &cam, AnimatedSpheres &world, FrameFn &&on_frame) {
+            stats.clear();
+            for (int frame = 0; frame < frame_count; frame++) {
+                double open = frame / frame_rate;
+                double close = open + shutter / frame_rate;
+
+                FrameStats frame_stats;
+                auto start = Clock::now();
+                frame_stats.rebuilt = world.set_shutter(open, close);
+                frame_stats.update_seconds = seconds_since(start);
+                frame_stats.sah_cost = world.sah_cost();
+
+                cam.shutter_open = open;
+                cam.shutter_close = close;
+                start = Clock::now();
+                auto image = cam.render_image(world);
+                frame_stats.render_seconds = seconds_since(start);
+
+                stats.push_back(frame_stats);
+                on_frame(frame, image);
+            }
+        }
+
+        const std::vector<FrameStats> &frame_stats() const {
+            return stats;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        std::vector<FrameStats> stats;
+
+        static double seconds_since(Clock::time_point start) {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "vec3.hpp"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * What a camera sample saw of the scene besides its radiance: the albedo
+ * and normal of the first surface that is not a perfect mirror or glass,
+ * tinted by any such surfaces in front of it, and the distance to the
+ * first surface of all. Samples that escape see the sky as albedo, their
+ * reversed direction as normal and depth 0. The squared luminance of the
+ * radiance is kept too, to estimate the noise of the pixel.
+ */
+struct SampleFeatures {
+        Color albedo;
+        Vec3 normal;
+        double depth = 0;
+        double luminance_squared = 0;
+};
+
+/**
+ * Arbitrary output variables of a render: SampleFeatures averaged over
+ * each pixel's samples, which guide the denoiser around edges that noise
+ * alone would blur, and the variance of each pixel's luminance, which
+ * tells it how much of a difference is noise. Laid out like Framebuffer.
+ */
+class AovBuffers {
+    public:
+        Framebuffer albedo;
+        Framebuffer normal;
+
+        AovBuffers() {
+        }
+
+        AovBuffers(int width, int height)
+            : albedo(width, height), normal(width, height),
+              depths(size_t(width) * height, 0.0f),
+              variances(size_t(width) * height, 0.0f) {
+        }
+
+        int width() const {
+            return albedo.width();
+        }
+        int height() const {
+            return albedo.height();
+        }
+
+        bool empty() const {
+            return depths.empty();
+        }
+
+        float depth(int i, int j) const {
+            return depths[size_t(j) * width() + i];
+        }
+
+        // Variance of the pixel's luminance as rendered, the mean of its
+        // samples
+        float variance(int i, int j) const {
+            return variances[size_t(j) * width() + i];
+        }
+
+        // Stores the mean features of `count` samples from the sums of
+        // their radiance and features
+        void set_pixel(int i, int j, const Color &radiance,
+                       const SampleFeatures &sum, int count) {
+            if (count < 1) return;
+            double scale = 1.0 / count;
+            auto k = size_t(j) * width() + i;
+            albedo.set_pixel(i, j, scale * sum.albedo);
+            normal.set_pixel(i, j, scale * sum.normal);
+            depths[k] = float(scale * sum.depth);
+
+            // A single sample says nothing of its spread, so the spread is
+            // taken to be as large as the value
+            double mean = scale * luminance(radiance);
+            double spread = mean * mean;
+            if (count > 1) {
+                spread = (scale * sum.luminance_squared - mean * mean) /
+                         (count - 1);
+            }
+            variances[k] = float(std::max(spread, 0.0));
+        }
+
+        // One float per pixel, row-major
+        const float *depth_data() const {
+            return depths.data();
+        }
+        const float *variance_data() const {
+            return variances.data();
+        }
+
+    private:
+        std::vector<float> depths;
+        std::vector<float> variances;
+};
+
+#endif
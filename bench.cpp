@@ -0,0 +1,1453 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <malloc.h>
+#include <memory>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "common.hpp"
+#include "animation.hpp"
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "compiled_scene.hpp"
+#include "denoiser.hpp"
+#include "distributed.hpp"
+#include "flat_bvh.hpp"
+#include "framebuffer.hpp"
+#include "image_metrics.hpp"
+#include "image_writer.hpp"
+#include "obj_file.hpp"
+#include "instance.hpp"
+#include "hittable_list.hpp"
+#include "profile.hpp"
+#include "random.hpp"
+#include "render_server.hpp"
+#include "render_stats.hpp"
+#include "sampler.hpp"
+#include "scene_file.hpp"
+#include "scenes.hpp"
+#include "sphere.hpp"
+#include "sphere_set.hpp"
+#include "tiled_framebuffer.hpp"
+#include "triangle_mesh.hpp"
+#include "wavefront.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Keeps the optimizer from discarding benchmarked work
+static volatile double sink;
+
+template <typename Next>
+static void report_generator(const char *name, Next next) {
+    const int count = 50'000'000;
+    double sum = 0;
+
+    auto start = Clock::now();
+    for (int k = 0; k < count; k++) {
+        sum += next();
+    }
+    double secs = seconds_since(start);
+    sink = sum;
+
+    std::printf("rng  %-16s %8.1f M doubles/s\n", name, count / secs / 1e6);
+}
+
+static void bench_rng() {
+    std::srand(1);
+    report_generator("std::rand",
+                     [] { return std::rand() / (RAND_MAX + 1.0); });
+
+    std::mt19937 mt(1);
+    report_generator("std::mt19937", [&] { return mt() / 4294967296.0; });
+
+    Pcg32 pcg;
+    pcg.seed(1);
+    report_generator("Pcg32", [&] { return pcg.next_double(); });
+
+    Xoshiro256Plus xoshiro;
+    xoshiro.seed(1);
+    report_generator("Xoshiro256Plus", [&] { return xoshiro.next_double(); });
+}
+
+// Camera samples per second on the main.cpp scene at reduced resolution
+static void bench_samples() {
+    HittableList world = random_spheres_scene();
+    Camera cam = random_spheres_camera();
+    cam.image_width = 200;
+    cam.samples_per_pixel = 16;
+
+    for (int threads : {1, 0}) {
+        cam.thread_count = threads;
+
+        auto start = Clock::now();
+        auto image = cam.render_image(world);
+        double secs = seconds_since(start);
+
+        double samples =
+            double(image.width()) * image.height() * cam.samples_per_pixel;
+        std::printf("samples  threads=%-3s %10.0f samples/s\n",
+                    threads ? "1" : "all", samples / secs);
+    }
+}
+
+// Rays from outside the scene bounds toward random points inside them
+static std::vector<Ray> random_rays(const Aabb &bounds, size_t count) {
+    seed_random(12345);
+
+    auto center = bounds.centroid();
+    auto reach = Vec3(bounds.x.size(), bounds.y.size(), bounds.z.size());
+
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (size_t k = 0; k < count; k++) {
+        auto origin = center + reach.length() * random_unit_vector();
+        auto target = center + 0.5 * reach * Vec3::random(-1, 1);
+        rays.emplace_back(origin, target - origin);
+    }
+    return rays;
+}
+
+// Rays per second and number of hits, the latter as a sanity check
+static std::pair<double, size_t> trace_rays(const Hittable &world,
+                                            const std::vector<Ray> &rays) {
+    size_t hits = 0;
+    hit_record rec;
+
+    auto start = Clock::now();
+    for (const auto &r : rays) {
+        hits += world.hit(r, Interval(0.001, infinity), rec);
+    }
+    return {rays.size() / seconds_since(start), hits};
+}
+
+static void bench_bvh() {
+    for (size_t n : {500, 5'000, 50'000, 1'000'000}) {
+        HittableList world = many_spheres_scene(n);
+        auto rays = random_rays(world.bounding_box(), 200'000);
+
+        auto start = Clock::now();
+        BvhNode bvh(world);
+        double build = seconds_since(start);
+
+        auto [bvh_rate, bvh_hits] = trace_rays(bvh, rays);
+        std::printf("bvh  n=%-8zu build %8.3f s   bvh %10.0f rays/s (%zu hits)",
+                    n, build, bvh_rate, bvh_hits);
+
+        // The linear scan only finishes in reasonable time on small scenes
+        if (n <= 5'000) {
+            auto [list_rate, list_hits] = trace_rays(world, rays);
+            std::printf("   list %10.0f rays/s (%zu hits)", list_rate,
+                        list_hits);
+        }
+        std::printf("\n");
+    }
+}
+
+// Linear list vs pointer BVH vs flattened BVH on the main.cpp scene
+static void bench_flat_bvh() {
+    HittableList world = random_spheres_scene();
+    auto lookfrom = random_spheres_camera().lookfrom;
+
+    // Rays from the camera position into the field of small spheres
+    seed_random(12345);
+    std::vector<Ray> rays;
+    for (int k = 0; k < 1'000'000; k++) {
+        auto target = Point3(random_double(-11, 11), random_double(0, 1.2),
+                             random_double(-11, 11));
+        rays.emplace_back(lookfrom, target - lookfrom);
+    }
+
+    BvhNode tree(world);
+    BvhAggregate<Sphere> flat(world);
+
+    BvhTraversalStats stats;
+    hit_record rec;
+    for (const auto &r : rays) {
+        flat.hit(r, Interval(0.001, infinity), rec, &stats);
+    }
+
+    std::printf("flat_bvh  %zu spheres, %zu nodes of %zu bytes\n",
+                world.objects.size(), flat.tree().node_array().size(),
+                sizeof(FlatBvhNode));
+    std::printf("flat_bvh  %.1f nodes visited/ray, %.1f spheres tested/ray "
+                "(list tests %zu)\n",
+                double(stats.nodes_visited) / rays.size(),
+                double(stats.primitives_tested) / rays.size(),
+                world.objects.size());
+
+    const std::pair<const char *, const Hittable *> variants[] = {
+        {"list", &world}, {"BvhNode", &tree}, {"BvhAggregate", &flat}};
+    for (auto [name, variant] : variants) {
+        auto [rate, hits] = trace_rays(*variant, rays);
+        std::printf("flat_bvh  %-13s %10.0f rays/s (%zu hits)\n", name, rate,
+                    hits);
+    }
+}
+
+// Closest-hit throughput of the hit path itself, best of five runs since
+// the record handling is a small part of each query
+static void bench_hit_path() {
+    HittableList world = random_spheres_scene();
+    auto lookfrom = random_spheres_camera().lookfrom;
+
+    seed_random(12345);
+    std::vector<Ray> rays;
+    for (int k = 0; k < 1'000'000; k++) {
+        auto target = Point3(random_double(-11, 11), random_double(0, 1.2),
+                             random_double(-11, 11));
+        rays.emplace_back(lookfrom, target - lookfrom);
+    }
+
+    BvhNode tree(world);
+    BvhAggregate<Sphere> typed(world);
+    BvhAggregate<> generic(world);
+
+    const std::pair<const char *, const Hittable *> variants[] = {
+        {"list", &world},
+        {"BvhNode", &tree},
+        {"BvhAggregate<Sphere>", &typed},
+        {"BvhAggregate<>", &generic}};
+    for (auto [name, variant] : variants) {
+        double best = 0;
+        for (int run = 0; run < 5; run++) {
+            best = std::max(best, trace_rays(*variant, rays).first);
+        }
+        std::printf("hit_path  %-20s %10.0f rays/s\n", name, best);
+    }
+}
+
+// Ray-sphere intersections per second for each SphereSet kernel
+static void bench_sphere_kernels() {
+    HittableList world = random_spheres_scene();
+    auto lookfrom = random_spheres_camera().lookfrom;
+
+    seed_random(12345);
+    std::vector<Ray> rays;
+    for (int k = 0; k < 100'000; k++) {
+        auto target = Point3(random_double(-11, 11), random_double(0, 1.2),
+                             random_double(-11, 11));
+        rays.emplace_back(lookfrom, target - lookfrom);
+    }
+
+    // Reference answers from the linear HittableList
+    std::vector<double> expected;
+    hit_record rec;
+    for (const auto &r : rays) {
+        bool hit = world.hit(r, Interval(0.001, infinity), rec);
+        expected.push_back(hit ? rec.t : -1);
+    }
+
+    SphereSet set(world);
+    for (auto kernel :
+         {SphereKernel::scalar, SphereKernel::sse2, SphereKernel::avx2}) {
+        if (!kernel_supported(kernel)) {
+            std::printf("sphere_kernels  %-6s unsupported on this CPU\n",
+                        kernel_name(kernel));
+            continue;
+        }
+        set.kernel = kernel;
+
+        size_t mismatches = 0;
+        auto start = Clock::now();
+        for (size_t k = 0; k < rays.size(); k++) {
+            bool hit = set.hit(rays[k], Interval(0.001, infinity), rec);
+            mismatches += (hit ? rec.t : -1) != expected[k];
+        }
+        double secs = seconds_since(start);
+
+        double tests = double(rays.size()) * set.size();
+        std::printf("sphere_kernels  %-6s %8.1f M intersections/s  "
+                    "(%zu mismatches vs list)\n",
+                    kernel_name(kernel), tests / secs / 1e6, mismatches);
+    }
+
+    BvhAggregate<Sphere> flat(world);
+    SphereBvh simd_bvh(world);
+    auto [flat_rate, flat_hits] = trace_rays(flat, rays);
+    auto [simd_rate, simd_hits] = trace_rays(simd_bvh, rays);
+    std::printf("sphere_kernels  BvhAggregate<Sphere> %10.0f rays/s (%zu hits)\n"
+                "sphere_kernels  SphereBvh (%s)     %10.0f rays/s (%zu hits)\n",
+                flat_rate, flat_hits, kernel_name(best_sphere_kernel()),
+                simd_rate, simd_hits);
+}
+
+// Time to encode a noisy sky gradient the size of a 4K frame
+static void bench_image_output() {
+    Framebuffer image(3840, 2160);
+    seed_random(12345);
+    for (int j = 0; j < image.height(); j++) {
+        for (int i = 0; i < image.width(); i++) {
+            auto a = double(j) / image.height();
+            auto sky = (1 - a) * Color(1, 1, 1) + a * Color(0.5, 0.7, 1);
+            image.set_pixel(i, j, sky * (0.9 + 0.2 * random_double()));
+        }
+    }
+
+    for (auto format : {ImageFormat::ppm_ascii, ImageFormat::ppm_binary,
+                        ImageFormat::png, ImageFormat::pfm}) {
+        static const char *names[] = {"P3", "P6", "PNG", "PFM"};
+
+        std::ostringstream out;
+        auto writer = make_image_writer(format);
+        auto start = Clock::now();
+        writer->write(out, image);
+        double secs = seconds_since(start);
+
+        std::printf("image_output  %-4s %8.3f s  %7.1f MB\n",
+                    names[int(format)], secs, out.str().size() / 1e6);
+    }
+}
+
+// Uniform vs adaptive sampling on the main.cpp scene, scored against a
+// high sample count reference
+static void bench_adaptive() {
+    HittableList world = random_spheres_scene();
+    world = HittableList(make_shared<BvhAggregate<Sphere>>(world));
+
+    Camera cam = random_spheres_camera();
+    cam.image_width = 120;
+    cam.max_depth = 20;
+
+    // A different seed keeps the reference independent of the test renders
+    cam.samples_per_pixel = 2048;
+    cam.seed = 1;
+    auto reference = cam.render_image(world);
+    cam.seed = 0;
+
+    auto report = [&](const char *mode, double setting) {
+        auto start = Clock::now();
+        auto image = cam.render_image(world);
+        double secs = seconds_since(start);
+
+        double pixels = double(image.width()) * image.height();
+        std::printf("adaptive  %-8s %-6g %6.1f spp  rmse %.5f  %6.2f s\n",
+                    mode, setting, cam.last_sample_count() / pixels,
+                    rmse(image, reference), secs);
+    };
+
+    for (int spp : {16, 32, 64, 128}) {
+        cam.samples_per_pixel = spp;
+        report("uniform", spp);
+    }
+
+    // Same average budgets, spent where the noise is
+    cam.adaptive_sampling = true;
+    cam.min_samples_per_pixel = 16;
+    cam.max_samples_per_pixel = 1024;
+    cam.noise_threshold = 0.005;
+    for (int spp : {16, 32, 64, 128}) {
+        cam.samples_per_pixel = spp;
+        report("adaptive", spp);
+    }
+
+    // Looser thresholds stop before the budget is used up
+    cam.samples_per_pixel = 128;
+    for (double threshold : {0.02, 0.01}) {
+        cam.noise_threshold = threshold;
+        report("thresh", threshold);
+    }
+}
+
+// Path length and render time with and without Russian roulette. The
+// mean pixel value shows that roulette does not bias the image.
+static void bench_roulette() {
+    const std::pair<const char *, HittableList> scenes[] = {
+        {"random", random_spheres_scene()}, {"glass", glass_spheres_scene()}};
+
+    for (const auto &[name, scene] : scenes) {
+        BvhAggregate<Sphere> world(scene);
+
+        Camera cam = random_spheres_camera();
+        cam.image_width = 160;
+        cam.samples_per_pixel = 32;
+
+        double baseline = 0;
+        for (bool roulette : {false, true}) {
+            cam.russian_roulette = roulette;
+
+            auto start = Clock::now();
+            auto image = cam.render_image(world);
+            double secs = seconds_since(start);
+
+            double mean = 0;
+            size_t n = size_t(image.width()) * image.height() * 3;
+            for (size_t k = 0; k < n; k++) {
+                mean += image.data()[k];
+            }
+            mean /= n;
+
+            if (!roulette) baseline = secs;
+            std::printf("roulette  %-6s %-3s %5.2f bounces/path  mean %.4f  "
+                        "%6.2f s  speedup %.2fx\n",
+                        name, roulette ? "on" : "off",
+                        cam.last_average_bounces(), mean, secs,
+                        baseline / secs);
+        }
+    }
+}
+
+// Depth-first against wavefront rendering at equal spp. Both draw the
+// same random numbers per path, so the images agree up to summation order.
+static void bench_wavefront() {
+    const std::pair<const char *, HittableList> scenes[] = {
+        {"random", random_spheres_scene()}, {"glass", glass_spheres_scene()}};
+
+    for (const auto &[name, scene] : scenes) {
+        BvhAggregate<Sphere> world(scene);
+
+        Camera cam = random_spheres_camera();
+        cam.image_width = 160;
+        cam.samples_per_pixel = 32;
+
+        auto start = Clock::now();
+        auto reference = cam.render_image(world);
+        double depth_first = seconds_since(start);
+        std::printf("wavefront %-6s depth-first     %6.2f s\n", name,
+                    depth_first);
+
+        for (size_t size : {256, 4096, 65536}) {
+            WavefrontRenderer renderer;
+            renderer.wavefront_size = size;
+
+            start = Clock::now();
+            auto image = renderer.render(cam, world);
+            double secs = seconds_since(start);
+
+            float max_diff = 0;
+            size_t n = size_t(image.width()) * image.height() * 3;
+            for (size_t k = 0; k < n; k++) {
+                max_diff = std::max(max_diff, std::abs(image.data()[k] -
+                                                       reference.data()[k]));
+            }
+
+            std::printf("wavefront %-6s batch %-8zu  %6.2f s  speedup %.2fx  "
+                        "max diff %.2g\n",
+                        name, size, secs, depth_first / secs, max_diff);
+        }
+    }
+}
+
+// Bytes held by malloc, including large blocks it maps directly
+static size_t heap_in_use() {
+    auto info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Heap footprint, ray throughput and render time of the pointer-based
+// scene representations against the frozen one
+static void bench_compiled_scene() {
+    for (size_t n : {10'000, 100'000, 1'000'000}) {
+        auto before = heap_in_use();
+        auto list = std::make_unique<HittableList>(many_spheres_scene(n));
+        auto list_bytes = heap_in_use() - before;
+        auto rays = random_rays(list->bounding_box(), 200'000);
+
+        before = heap_in_use();
+        auto generic = std::make_unique<BvhAggregate<>>(*list);
+        auto generic_bytes = heap_in_use() - before;
+
+        before = heap_in_use();
+        auto typed = std::make_unique<BvhAggregate<Sphere>>(*list);
+        auto typed_bytes = heap_in_use() - before;
+
+        before = heap_in_use();
+        auto start = Clock::now();
+        auto frozen = std::make_unique<CompiledScene>(*list);
+        double freeze_secs = seconds_since(start);
+        auto frozen_bytes = heap_in_use() - before;
+
+        std::printf("compiled  n=%-8zu list %6.1f MB, freeze %.3f s\n", n,
+                    list_bytes / 1e6, freeze_secs);
+
+        // The aggregates share materials with the list and keep them alive;
+        // the frozen scene owns copies and needs nothing else
+        const std::tuple<const char *, const Hittable *, size_t> variants[] = {
+            {"BvhAggregate<>", generic.get(), generic_bytes + list_bytes},
+            {"BvhAggregate<Sphere>", typed.get(), typed_bytes},
+            {"CompiledScene", frozen.get(), frozen_bytes}};
+        for (auto [name, variant, bytes] : variants) {
+            auto [rate, hits] = trace_rays(*variant, rays);
+
+            Camera cam = random_spheres_camera();
+            cam.image_width = 100;
+            cam.samples_per_pixel = 8;
+            start = Clock::now();
+            cam.render_image(*variant);
+            double secs = seconds_since(start);
+
+            std::printf("compiled  n=%-8zu %-20s %6.1f MB  %10.0f rays/s  "
+                        "render %6.2f s (%zu hits)\n",
+                        n, name, bytes / 1e6, rate, secs, hits);
+        }
+    }
+}
+
+// Renders the main.cpp scene in this build's precision and compares it
+// with the other precision's render, left in the working directory by a
+// run of the other build. Sample noise alone is measured by rendering
+// twice with different seeds; a difference between precisions no larger
+// than that is invisible.
+static void bench_precision() {
+    const char *precision = sizeof(Real) == 4 ? "float" : "double";
+    const char *other = sizeof(Real) == 4 ? "double" : "float";
+
+    CompiledScene world = freeze(random_spheres_scene());
+    Camera cam = random_spheres_camera();
+    cam.image_width = 300;
+    cam.samples_per_pixel = 64;
+
+    auto start = Clock::now();
+    auto image = cam.render_image(world);
+    double secs = seconds_since(start);
+
+    cam.seed = 1;
+    auto reseeded = cam.render_image(world);
+
+    auto mean = [](const Framebuffer &fb) {
+        double sum = 0;
+        size_t n = size_t(fb.width()) * fb.height() * 3;
+        for (size_t k = 0; k < n; k++) {
+            sum += fb.data()[k];
+        }
+        return sum / n;
+    };
+
+    std::printf("precision %-6s render %6.2f s  mean %.5f (reseeded %.5f)  "
+                "rmse vs reseeded %.5f\n",
+                precision, secs, mean(image), mean(reseeded),
+                rmse(image, reseeded));
+
+    std::string path = std::string("precision-") + precision + ".pfm";
+    save_image(path, image);
+
+    std::ifstream in(std::string("precision-") + other + ".pfm",
+                     std::ios::binary);
+    if (in) {
+        auto other_image = read_pfm(in);
+        std::printf("precision %-6s mean %.5f  rmse vs %s %.5f\n", other,
+                    mean(other_image), precision, rmse(image, other_image));
+    }
+}
+
+// Load time of a 1M-sphere scene in both file formats. The files are
+// written first, so they are read from the page cache.
+static void bench_scene_load() {
+    Camera cam = random_spheres_camera();
+    HittableList world = many_spheres_scene(1'000'000);
+
+    for (const char *path : {"bench-1m.scene", "bench-1m.bscene"}) {
+        save_scene(path, cam, world);
+
+        double best = infinity;
+        size_t spheres = 0, bytes = 0;
+        for (int run = 0; run < 3; run++) {
+            auto start = Clock::now();
+            auto scene = load_scene(path);
+            best = std::min(best, seconds_since(start));
+            spheres = scene.world.objects.size();
+            bytes = MappedFile::open_read_only(path).size();
+        }
+
+        std::printf("scene_load  %-16s %7.1f MB  %zu spheres  %6.3f s  "
+                    "%6.1f MB/s\n",
+                    path, bytes / 1e6, spheres, best, bytes / 1e6 / best);
+        std::remove(path);
+    }
+}
+
+// Worker processes against one thread in one process. Parallel efficiency
+// is T1 / (N * TN); the merged image must match the threaded render bit
+// for bit, also when a worker crashes or stalls partway through.
+static void bench_distributed() {
+    CompiledScene world = freeze(random_spheres_scene());
+    Camera cam = random_spheres_camera();
+    cam.image_width = 240;
+    cam.samples_per_pixel = 16;
+    cam.thread_count = 1;
+
+    auto start = Clock::now();
+    auto reference = cam.render_image(world);
+    double single = seconds_since(start);
+    std::printf("distributed 1 thread           %6.2f s\n", single);
+
+    size_t bytes = size_t(reference.width()) * reference.height() * 3 *
+                   sizeof(float);
+    auto report = [&](const char *label, const DistributedRenderer &renderer,
+                      const Framebuffer &image) {
+        const auto &stats = renderer.stats();
+        bool identical =
+            std::memcmp(image.data(), reference.data(), bytes) == 0;
+        std::printf("distributed %-18s %6.2f s  speedup %.2fx  "
+                    "efficiency %3.0f%%  busy %3.0f%%  reissued %d  "
+                    "restarts %d  %s\n",
+                    label, stats.wall_seconds, single / stats.wall_seconds,
+                    100 * single / (stats.workers * stats.wall_seconds),
+                    100 * stats.efficiency(), stats.reissued, stats.restarts,
+                    identical ? "identical" : "DIFFERENT");
+    };
+
+    for (int workers : {1, 2, 4}) {
+        DistributedRenderer renderer;
+        renderer.worker_count = workers;
+        auto image = renderer.render(cam, world);
+
+        char label[32];
+        std::snprintf(label, sizeof label, "%d processes", workers);
+        report(label, renderer, image);
+    }
+
+    DistributedRenderer crashing;
+    crashing.crash_after = 5;
+    auto image = crashing.render(cam, world);
+    report("4, one crashes", crashing, image);
+
+    DistributedRenderer stalling;
+    stalling.stall_after = 5;
+    stalling.tile_timeout = 0.5;
+    image = stalling.render(cam, world);
+    report("4, one stalls", stalling, image);
+}
+
+// JSON values for the PALETTE_STATS counters: null when not compiled in
+static std::string json_count(std::uint64_t count) {
+    return render_stats_enabled ? std::to_string(count) : "null";
+}
+
+static std::string json_rate(double value) {
+    if (!render_stats_enabled || !std::isfinite(value)) return "null";
+    char text[32];
+    std::snprintf(text, sizeof text, "%.6g", value);
+    return text;
+}
+
+/**
+ * Fixed scenes at fixed settings, reported as JSON on stdout so runs on
+ * different commits can be diffed or plotted. Rendering is deterministic,
+ * so the counters only change when the code does; times are the fastest
+ * of three runs. Ray and intersection counters need PALETTE_STATS and are
+ * null without it.
+ */
+static void bench_suite() {
+    struct SuiteScene {
+            const char *name;
+            HittableList scene;
+    };
+    const SuiteScene scenes[] = {
+        {"random_spheres", random_spheres_scene()},
+        {"glass_spheres", glass_spheres_scene()},
+        {"many_spheres", many_spheres_scene(100'000)},
+    };
+    const char *kind_names[material_kind_count] = {"lambertian", "metal",
+                                                   "dielectric"};
+
+    std::printf("{\n  \"config\": {\"real\": \"%s\", \"rng\": \"%s\", "
+                "\"stats\": %s, \"sphere_kernel\": \"%s\", "
+                "\"threads\": %u, \"compiler\": \"%s\"},\n"
+                "  \"scenes\": [",
+                sizeof(Real) == sizeof(float) ? "float" : "double",
+#ifdef PALETTE_RNG_PCG32
+                "pcg32",
+#else
+                "xoshiro256+",
+#endif
+                render_stats_enabled ? "true" : "false",
+                kernel_name(best_sphere_kernel()),
+                std::thread::hardware_concurrency(), __VERSION__);
+
+    for (const auto &[name, scene] : scenes) {
+        CompiledScene world = freeze(scene);
+        Camera cam = random_spheres_camera();
+        cam.image_width = 200;
+        cam.samples_per_pixel = 16;
+
+        double wall = infinity, cpu = 0;
+        for (int run = 0; run < 3; run++) {
+            auto cpu_start = std::clock();
+            auto start = Clock::now();
+            cam.render_image(world);
+            double secs = seconds_since(start);
+            if (secs < wall) {
+                wall = secs;
+                cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+            }
+        }
+
+        const auto &stats = cam.last_render_stats();
+        double rays = double(stats.rays);
+        double samples = double(cam.last_sample_count());
+
+        std::printf("%s\n    {\"name\": \"%s\", \"primitives\": %zu, "
+                    "\"width\": %d, \"height\": %d, \"spp\": %d, "
+                    "\"max_depth\": %d,\n     \"wall_seconds\": %.4f, "
+                    "\"cpu_seconds\": %.4f, \"samples_per_second\": %.6g, "
+                    "\"average_path_depth\": %.4f,\n     \"rays\": %s, "
+                    "\"rays_per_second\": %s, \"nodes_per_ray\": %s, "
+                    "\"intersection_tests_per_ray\": %s,\n     "
+                    "\"scatters\": {",
+                    &name == &scenes[0].name ? "" : ",", name,
+                    world.sphere_count() + world.other_count(),
+                    cam.image_width, cam.height(), cam.samples_per_pixel,
+                    cam.max_depth, wall, cpu, samples / wall,
+                    cam.last_average_bounces(), json_count(stats.rays).c_str(),
+                    json_rate(rays / wall).c_str(),
+                    json_rate(stats.nodes_visited / rays).c_str(),
+                    json_rate(stats.primitive_tests / rays).c_str());
+        for (int k = 0; k < material_kind_count; k++) {
+            std::printf("%s\"%s\": %s", k ? ", " : "", kind_names[k],
+                        json_count(stats.scatters[k]).c_str());
+        }
+        std::printf("}, \"absorbed\": %s}",
+                    json_count(stats.absorbed).c_str());
+    }
+    std::printf("\n  ]\n}\n");
+}
+
+// Where the time of a render goes, per phase. Needs PALETTE_PROFILE; the
+// timeline is written to profile-trace.json.
+static void bench_profile() {
+    if (!profiling_enabled) {
+        std::printf("profile     built without PALETTE_PROFILE\n");
+        return;
+    }
+
+    const std::pair<const char *, HittableList> scenes[] = {
+        {"random", random_spheres_scene()},
+        {"glass", glass_spheres_scene()},
+        {"many", many_spheres_scene(100'000)}};
+
+    for (const auto &[name, scene] : scenes) {
+        CompiledScene world = freeze(scene);
+        Camera cam = random_spheres_camera();
+        cam.image_width = 200;
+        cam.samples_per_pixel = 16;
+
+        profiler().reset();
+        auto start = Clock::now();
+        auto image = cam.render_image(world);
+        save_image("profile.ppm", image);
+        double secs = seconds_since(start);
+
+        auto totals = profiler().summary();
+        std::printf("profile     %-6s %6.2f s ", name, secs);
+        for (int k = 0; k < profile_phase_count; k++) {
+            std::printf(" %s %4.1f%%", phase_name(ProfilePhase(k)),
+                        100 * totals.self_seconds[k] /
+                            (secs * totals.threads));
+        }
+        std::printf("\n");
+    }
+    profiler().write_chrome_trace("profile-trace.json");
+    std::remove("profile.ppm");
+}
+
+// Placement of instance k of n: a square grid on the ground, each copy
+// turned and scaled at random
+static Transform grid_transform(size_t k, size_t n) {
+    seed_random(0, k, 0);
+    auto side = size_t(std::ceil(std::sqrt(double(n))));
+    auto half = 2.0 * side;
+    Vec3 position(4.0 * (k % side) - half, 1.5, 4.0 * (k / side) - half);
+    return Transform::translate(position) *
+           Transform::rotate(Vec3::random(-1, 1), 360 * random_double()) *
+           Transform::scale(0.5 + random_double());
+}
+
+static Camera grid_camera(size_t n) {
+    auto half = 2.0 * std::ceil(std::sqrt(double(n)));
+    Camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 200;
+    cam.samples_per_pixel = 8;
+    cam.max_depth = 20;
+    cam.vfov = 30;
+    cam.lookfrom = Point3(0, 0.3 * half + 10, half + 30);
+    cam.lookat = Point3(0, 0, 0);
+    return cam;
+}
+
+/**
+ * Copies of a 16-sphere cluster on a grid, stored three ways: as
+ * transformed spheres in a CompiledScene, as Instance objects frozen into
+ * a CompiledScene, and in an InstanceSet. Heap is measured once the
+ * builder lists are gone. The largest InstanceSet is out of reach of the
+ * other two.
+ */
+static void bench_instancing() {
+    HittableList cluster = many_spheres_scene(16);
+    auto prototype = make_shared<CompiledScene>(freeze(cluster));
+
+    auto report = [](const char *kind, size_t n, size_t bytes, double build,
+                     const Camera &cam, const Hittable &world,
+                     const Framebuffer *reference) {
+        Camera render_cam = cam;
+        auto start = Clock::now();
+        auto image = render_cam.render_image(world);
+        double secs = seconds_since(start);
+        std::printf("instancing %-9s %9zu %8.1f MB  build %6.2f s  render "
+                    "%6.2f s",
+                    kind, n, bytes / 1e6, build, secs);
+        if (reference) {
+            std::printf("  rmse vs flat %.5f", rmse(image, *reference));
+        }
+        std::printf("\n");
+        return image;
+    };
+
+    for (size_t n : {size_t(10'000), size_t(100'000), size_t(10'000'000)}) {
+        Camera cam = grid_camera(n);
+        bool compare = n <= 100'000;
+        Framebuffer reference;
+
+        if (compare) {
+            auto before = heap_in_use();
+            auto start = Clock::now();
+            std::unique_ptr<CompiledScene> flat;
+            {
+                HittableList spheres;
+                spheres.objects.reserve(n * cluster.objects.size());
+                for (size_t k = 0; k < n; k++) {
+                    auto to_world = grid_transform(k, n);
+                    auto scale = to_world.vector(Vec3(1, 0, 0)).length();
+                    for (const auto &object : cluster.objects) {
+                        auto sphere = static_cast<const Sphere *>(object.get());
+                        spheres.add(make_shared<Sphere>(
+                            to_world.point(sphere->center()),
+                            sphere->radius() * scale, sphere->material()));
+                    }
+                }
+                flat = std::make_unique<CompiledScene>(spheres);
+            }
+            double build = seconds_since(start);
+            reference = report("flat", n, heap_in_use() - before, build, cam,
+                               *flat, nullptr);
+        }
+
+        if (compare) {
+            auto before = heap_in_use();
+            auto start = Clock::now();
+            std::unique_ptr<CompiledScene> scene;
+            {
+                HittableList instances;
+                instances.objects.reserve(n);
+                for (size_t k = 0; k < n; k++) {
+                    instances.add(make_shared<Instance>(
+                        prototype, grid_transform(k, n)));
+                }
+                scene = std::make_unique<CompiledScene>(instances);
+            }
+            double build = seconds_since(start);
+            report("instance", n, heap_in_use() - before, build, cam, *scene,
+                   &reference);
+        }
+
+        auto before = heap_in_use();
+        auto start = Clock::now();
+        InstanceSet set;
+        auto id = set.add_prototype(prototype);
+        set.reserve(n);
+        for (size_t k = 0; k < n; k++) {
+            set.add(id, grid_transform(k, n));
+        }
+        set.build();
+        double build = seconds_since(start);
+        report("set", n, heap_in_use() - before, build, cam, set,
+               compare ? &reference : nullptr);
+    }
+}
+
+/**
+ * A million-triangle closed mesh: OBJ load time, memory per triangle and
+ * rays per second. Rays from inside that miss would be leaks between
+ * triangles; half of them are aimed straight at vertices, where
+ * neighbouring triangles meet.
+ */
+static void bench_mesh() {
+    auto gray = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    const char *path = "bench-mesh.obj";
+    save_obj(path, *bumpy_sphere_mesh(500, gray));
+
+    // Parsing alone, then parsing and building the tree
+    double parse = infinity, load = infinity;
+    for (int run = 0; run < 3; run++) {
+        std::vector<Point3> vertices;
+        std::vector<std::uint32_t> indices;
+        auto start = Clock::now();
+        auto file = MappedFile::open_read_only(path);
+        obj_format::Parser(path, file.data(), file.data() + file.size())
+            .parse(vertices, indices);
+        parse = std::min(parse, seconds_since(start));
+    }
+
+    shared_ptr<TriangleMesh> mesh;
+    size_t bytes = 0;
+    for (int run = 0; run < 3; run++) {
+        mesh.reset();
+        auto before = heap_in_use();
+        auto start = Clock::now();
+        mesh = load_obj(path, gray);
+        load = std::min(load, seconds_since(start));
+        bytes = heap_in_use() - before;
+    }
+    auto file_bytes = MappedFile::open_read_only(path).size();
+    std::remove(path);
+
+    auto triangles = mesh->triangle_count();
+    std::printf("mesh  load     %zu triangles  %.1f MB obj  parse %.3f s "
+                "(%.0f MB/s)  with BVH build %.3f s\n",
+                triangles, file_bytes / 1e6, parse, file_bytes / 1e6 / parse,
+                load);
+    std::printf("mesh  memory   %.1f MB heap  %.1f bytes/triangle "
+                "(buffers and tree %.1f)\n",
+                bytes / 1e6, double(bytes) / triangles,
+                double(mesh->memory_bytes()) / triangles);
+
+    auto rays = random_rays(mesh->bounding_box(), 1'000'000);
+    auto [rate, hits] = trace_rays(*mesh, rays);
+    std::printf("mesh  trace    %10.0f rays/s  (%zu of %zu hit)\n", rate,
+                hits, rays.size());
+
+    seed_random(7);
+    const auto &vertices = mesh->vertex_array();
+    size_t leaks = 0, probes = 1'000'000;
+    hit_record rec;
+    for (size_t k = 0; k < probes; k++) {
+        Point3 origin = 0.1 * Vec3::random(-1, 1);
+        Vec3 dir = k % 2 ? random_unit_vector()
+                         : vertices[k / 2 % vertices.size()] - origin;
+        leaks += !mesh->hit(Ray(origin, dir), Interval(0, infinity), rec);
+    }
+    std::printf("mesh  leaks    %zu of %zu rays from inside\n", leaks,
+                probes);
+
+    HittableList scene;
+    scene.add(make_shared<Sphere>(Point3(0, -1001, 0), 1000, gray));
+    scene.add(mesh);
+    CompiledScene world = freeze(scene);
+
+    Camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 200;
+    cam.samples_per_pixel = 16;
+    cam.lookfrom = Point3(0, 1, 4);
+    cam.lookat = Point3(0, 0, 0);
+    cam.vfov = 40;
+
+    auto start = Clock::now();
+    cam.render_image(world);
+    double secs = seconds_since(start);
+    std::printf("mesh  render   %.2f s  %.0f samples/s\n", secs,
+                cam.last_sample_count() / secs);
+}
+
+/**
+ * Samples per pixel each sampler needs to reach a fixed error against a
+ * high sample count reference, interpolated log-log between the powers of
+ * two that bracket it. Both scenes use the book's camera with defocus.
+ */
+static void bench_sampler() {
+    const std::pair<const char *, HittableList> scenes[] = {
+        {"random", random_spheres_scene()}, {"glass", glass_spheres_scene()}};
+    const SamplerKind kinds[] = {SamplerKind::independent,
+                                 SamplerKind::stratified, SamplerKind::sobol};
+    const double target = 0.02;
+
+    for (const auto &[name, scene] : scenes) {
+        CompiledScene world = freeze(scene);
+
+        Camera cam = random_spheres_camera();
+        cam.image_width = 96;
+        cam.max_depth = 20;
+
+        cam.sampler = SamplerKind::sobol;
+        cam.samples_per_pixel = 4096;
+        cam.seed = 1;
+        auto reference = cam.render_image(world);
+        cam.seed = 0;
+
+        for (auto kind : kinds) {
+            cam.sampler = kind;
+            double needed = 0, last_spp = 0, last_error = 0;
+            std::printf("sampler  %-7s %-11s rmse", name, sampler_name(kind));
+            for (int spp = 1; spp <= 256; spp *= 2) {
+                cam.samples_per_pixel = spp;
+                double error = rmse(cam.render_image(world), reference);
+                std::printf(" %.4f", error);
+
+                if (needed == 0 && error <= target) {
+                    needed = spp;
+                    if (last_spp > 0) {
+                        double slope = std::log(error / last_error) /
+                                       std::log(spp / last_spp);
+                        needed = last_spp * std::pow(target / last_error,
+                                                     1 / slope);
+                    }
+                }
+                last_spp = spp;
+                last_error = error;
+            }
+            if (needed > 0) {
+                std::printf("  %.1f spp to %g\n", needed, target);
+            } else {
+                std::printf("  over 256 spp to %g\n", target);
+            }
+        }
+    }
+}
+
+/**
+ * A sequence of camera jobs on one scene, from a RenderServer that keeps
+ * it loaded against cold starts that load and build it for every job.
+ * The cold starts run in this process, so they leave out process startup
+ * and understate the difference. Time to first tile is the median over
+ * the jobs.
+ */
+static void bench_server() {
+    const char *scene_path = "bench-server.bscene";
+    const char *socket_path = "bench-server.sock";
+    save_scene(scene_path, random_spheres_camera(),
+               many_spheres_scene(100'000));
+
+    const int job_count = 100;
+    std::vector<RenderJob> jobs(job_count);
+    for (int k = 0; k < job_count; k++) {
+        double angle = 2 * pi * k / job_count;
+        jobs[k].scene = scene_path;
+        jobs[k].camera.lookfrom =
+            Point3(13 * std::cos(angle), 2 + k % 5, 13 * std::sin(angle));
+        jobs[k].camera.vfov = 20 + k % 10;
+        jobs[k].camera.image_width = 160;
+        jobs[k].camera.samples_per_pixel = 4;
+    }
+
+    auto median = [](std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    };
+    auto report = [&](const char *mode, const std::vector<double> &first,
+                      double total) {
+        std::printf("server  %-5s %d jobs  first tile %7.2f ms  "
+                    "%6.2f jobs/s  %6.2f s\n",
+                    mode, job_count, 1e3 * median(first), job_count / total,
+                    total);
+    };
+
+    std::vector<double> first_tile;
+    Framebuffer cold_image;
+    auto start = Clock::now();
+    for (const auto &job : jobs) {
+        auto job_start = Clock::now();
+        auto loaded = load_scene(job.scene);
+        CompiledScene world = freeze(loaded.world);
+        Camera cam = loaded.camera;
+        job.camera.apply(cam);
+        cam.initialize();
+
+        Framebuffer image(cam.image_width, cam.height());
+        std::atomic<bool> first{true};
+        cam.for_each_tile([&](const Tile &tile) {
+            cam.render_tile(world, tile, image);
+            if (first.exchange(false)) {
+                first_tile.push_back(seconds_since(job_start));
+            }
+        });
+        cold_image = std::move(image);
+    }
+    report("cold", first_tile, seconds_since(start));
+
+    RenderServer server(socket_path);
+    std::thread serving([&] { server.serve(); });
+    while (!server.ready()) {
+        std::this_thread::yield();
+    }
+
+    Framebuffer warm_image;
+    {
+        RenderClient client(socket_path);
+
+        // The first job loads the scene into the server
+        start = Clock::now();
+        client.render(jobs[0]);
+        std::printf("server  load  %.3f s for the first job\n",
+                    seconds_since(start));
+
+        first_tile.clear();
+        start = Clock::now();
+        for (const auto &job : jobs) {
+            auto job_start = Clock::now();
+            bool first = true;
+            warm_image = client.render(job, [&](const Tile &,
+                                                const Framebuffer &) {
+                if (first) first_tile.push_back(seconds_since(job_start));
+                first = false;
+            });
+        }
+        report("warm", first_tile, seconds_since(start));
+    }
+    server.stop();
+    serving.join();
+    std::remove(scene_path);
+
+    std::printf("server  last image rmse against the cold start %g\n",
+                rmse(warm_image, cold_image));
+}
+
+/**
+ * A million moving spheres over 12 frames at 24 frames per unit of scene
+ * time: per-frame tree update cost and ray rate when refitting, when
+ * rebuilding every frame and under the automatic choice between them.
+ * A quarter of the spheres follow keyframes, the rest move linearly.
+ */
+static void bench_animation() {
+    const size_t count = 1'000'000;
+    const int frames = 12;
+    const double frame_rate = 24, shutter = 0.5;
+
+    auto make_scene = [&](BvhUpdate update) {
+        seed_random(3);
+        auto half = 0.5 * std::cbrt(double(count));
+        auto diffuse = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+        auto spheres = std::make_unique<AnimatedSpheres>();
+        spheres->update = update;
+        spheres->reserve(count);
+
+        std::vector<double> times = {0, 0.125, 0.25, 0.375, 0.5};
+        std::vector<Point3> centers(times.size());
+        for (size_t k = 0; k < count; k++) {
+            auto center = Point3::random(-half, half);
+            if (k % 4 == 0) {
+                for (auto &key : centers) {
+                    key = center;
+                    center += Vec3::random(-1, 1);
+                }
+                spheres->add_keyframed(times, centers, 0.2, diffuse);
+            } else {
+                spheres->add_moving(center, Vec3::random(-4, 4), 0.2,
+                                    diffuse);
+            }
+        }
+        return spheres;
+    };
+
+    const std::pair<const char *, BvhUpdate> modes[] = {
+        {"refit", BvhUpdate::refit},
+        {"rebuild", BvhUpdate::rebuild},
+        {"auto", BvhUpdate::automatic}};
+
+    for (const auto &[name, update] : modes) {
+        auto spheres = make_scene(update);
+        double update_total = 0, trace_total = 0;
+        int rebuilds = 0;
+
+        for (int frame = 0; frame < frames; frame++) {
+            double open = frame / frame_rate;
+            double close = open + shutter / frame_rate;
+
+            auto start = Clock::now();
+            bool rebuilt = spheres->set_shutter(open, close);
+            double update_seconds = seconds_since(start);
+
+            // The first frame always builds, so it is left out of the sums
+            auto rays = random_rays(spheres->bounding_box(), 200'000);
+            for (auto &ray : rays) {
+                ray = Ray(ray.origin(), ray.direction(),
+                          Real(random_double(open, close)));
+            }
+            auto [rate, hits] = trace_rays(*spheres, rays);
+            if (frame > 0) {
+                update_total += update_seconds;
+                trace_total += rays.size() / rate;
+                rebuilds += rebuilt;
+            }
+
+            std::printf("animation  %-7s frame %2d  %-8s %9.2f ms  "
+                        "sah %6.2f (%.2fx built)  %8.0f rays/s\n",
+                        name, frame, rebuilt ? "rebuild" : "refit",
+                        1e3 * update_seconds, spheres->sah_cost(),
+                        spheres->sah_cost() / spheres->built_sah_cost(),
+                        rate);
+        }
+        std::printf("animation  %-7s frames 1-%d: %d rebuilds, update "
+                    "%.2f ms/frame, trace %.3f s/frame\n",
+                    name, frames - 1, rebuilds,
+                    1e3 * update_total / (frames - 1),
+                    trace_total / (frames - 1));
+    }
+}
+
+/**
+ * Error of denoised low sample counts against a 2048 spp reference of the
+ * book's scene, next to the 500 spp main.cpp renders by default, then the
+ * denoiser's time on a full 1200x675 frame. The image is 480 wide so the
+ * reference stays affordable; the filter works in pixels, so larger
+ * images only make its job easier.
+ */
+static void bench_denoise() {
+    CompiledScene world = freeze(random_spheres_scene());
+    Camera cam = random_spheres_camera();
+    cam.image_width = 480;
+
+    cam.sampler = SamplerKind::sobol;
+    cam.samples_per_pixel = 2048;
+    cam.seed = 1;
+    auto reference = cam.render_image(world);
+    cam.seed = 0;
+
+    cam.sampler = SamplerKind::independent;
+    cam.samples_per_pixel = 500;
+    auto image = cam.render_image(world);
+    std::printf("denoise  independent  500 spp  rmse %.4f  ssim %.4f\n",
+                rmse(image, reference), ssim(image, reference));
+
+    Denoiser denoiser;
+    cam.render_aovs = true;
+    for (auto kind : {SamplerKind::independent, SamplerKind::sobol}) {
+        cam.sampler = kind;
+        for (int spp : {16, 32, 64}) {
+            cam.samples_per_pixel = spp;
+            auto noisy = cam.render_image(world);
+            auto denoised = denoiser.denoise(noisy, cam.last_aovs());
+            std::printf("denoise  %-11s %4d spp  rmse %.4f  ssim %.4f  "
+                        "denoised rmse %.4f  ssim %.4f\n",
+                        sampler_name(kind), spp, rmse(noisy, reference),
+                        ssim(noisy, reference), rmse(denoised, reference),
+                        ssim(denoised, reference));
+        }
+    }
+
+    cam.image_width = 1200;
+    cam.samples_per_pixel = 4;
+    auto noisy = cam.render_image(world);
+    for (int threads : {1, 0}) {
+        denoiser.thread_count = threads;
+        double best = infinity;
+        for (int run = 0; run < 5; run++) {
+            auto start = Clock::now();
+            denoiser.denoise(noisy, cam.last_aovs());
+            best = std::min(best, seconds_since(start));
+        }
+        std::printf("denoise  %dx%d on %s: %.1f ms\n", noisy.width(),
+                    noisy.height(),
+                    threads == 1 ? "1 thread" : "all threads", 1e3 * best);
+    }
+}
+
+// The main.cpp layout with every material made diffuse, for kernels with
+// a single material kind
+static HittableList diffuse_spheres_scene() {
+    HittableList world;
+    for (const auto &object : random_spheres_scene().objects) {
+        auto sphere = std::dynamic_pointer_cast<Sphere>(object);
+        world.add(make_shared<Sphere>(
+            sphere->center(), sphere->radius(),
+            make_shared<Lambertian>(sphere->material()->albedo())));
+    }
+    return world;
+}
+
+/**
+ * Each specialized render kernel against the generic one, on scenes with
+ * one, two and three material kinds, through the pinhole and the thin
+ * lens, at the specialized max_depth 50 and at 20, which only gets the
+ * lens and materials specialized. Images must be identical.
+ */
+static void bench_kernels() {
+    std::tuple<const char *, HittableList, const char *> scenes[] = {
+        {"diffuse", diffuse_spheres_scene(), "lambertian"},
+        {"glass", glass_spheres_scene(), "lambertian+dielectric"},
+        {"random", random_spheres_scene(), "all"}};
+
+    for (auto &[name, list, kinds] : scenes) {
+        CompiledScene world = freeze(list);
+        for (double defocus_angle : {0.0, 0.6}) {
+            for (int depth : {50, 20}) {
+                Camera cam = random_spheres_camera();
+                cam.image_width = 240;
+                cam.samples_per_pixel = 16;
+                cam.thread_count = 1;
+                cam.defocus_angle = defocus_angle;
+                cam.max_depth = depth;
+
+                // Alternating runs keep clock drift out of the ratio
+                Framebuffer images[2];
+                double best[2] = {infinity, infinity};
+                for (int run = 0; run < 10; run++) {
+                    cam.specialize_kernels = run % 2;
+                    auto start = Clock::now();
+                    images[run % 2] = cam.render_image(world);
+                    best[run % 2] = std::min(best[run % 2],
+                                             seconds_since(start));
+                }
+                const auto &generic = images[0], &specialized = images[1];
+                double samples = cam.last_sample_count() / 1e6;
+                double generic_rate = samples / best[0];
+                double specialized_rate = samples / best[1];
+                bool same = std::equal(
+                    generic.data(),
+                    generic.data() + 3 * size_t(generic.width()) *
+                                         generic.height(),
+                    specialized.data());
+
+                std::printf("kernels  %-8s %-21s %-9s depth %2d  generic "
+                            "%.3f M samples/s  specialized %.3f  x%.3f%s\n",
+                            name, kinds,
+                            defocus_angle > 0 ? "thin lens" : "pinhole",
+                            depth, generic_rate, specialized_rate,
+                            specialized_rate / generic_rate,
+                            same ? "" : "  IMAGES DIFFER");
+            }
+        }
+    }
+}
+
+// Peak resident memory since the last reset_peak_rss, from Linux's VmHWM
+static void reset_peak_rss() {
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+static size_t peak_rss() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A 40000x25000 render through a TiledFramebuffer, encoded to PNG from
+ * it. The float image would take 12 GB, more than many machines have;
+ * peak memory should stay near the tiles in flight while rendering and one
+ * band of tiles while encoding. One sample of one bounce keeps it to
+ * minutes. A small render first checks the tiled path against the
+ * in-memory one.
+ */
+static void bench_gigapixel() {
+    HittableList list;
+    auto diffuse = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    list.add(make_shared<Sphere>(Point3(0, 0, -1), 0.5, diffuse));
+    list.add(make_shared<Sphere>(Point3(0, -100.5, -1), 100, diffuse));
+    CompiledScene world = freeze(list);
+
+    Camera cam;
+    cam.aspect_ratio = 1.6;
+    cam.samples_per_pixel = 1;
+    cam.max_depth = 2;
+    cam.tile_size = 64;
+    const char *tiles_path = "bench-gigapixel.tiles";
+    const char *png_path = "bench-gigapixel.png";
+
+    cam.image_width = 1000;
+    auto reference = cam.render_image(world);
+    {
+        TiledFramebuffer image(tiles_path, cam.image_width, cam.height(),
+                               cam.tile_size);
+        cam.render_image(world, image);
+        bool same = true;
+        for (int j = 0; j < image.height(); j++) {
+            for (int i = 0; i < image.width(); i++) {
+                auto d = image.pixel(i, j) - reference.pixel(i, j);
+                same &= d.length_squared() == 0;
+            }
+        }
+        std::printf("gigapixel  %dx%d tiled image %s the in-memory one\n",
+                    image.width(), image.height(),
+                    same ? "matches" : "DIFFERS FROM");
+    }
+
+    cam.image_width = 40000;
+    cam.initialize();
+    TiledFramebuffer image(tiles_path, cam.image_width, cam.height(),
+                           cam.tile_size);
+    std::remove(tiles_path); // the mapping keeps the space until exit
+    double pixels = double(image.width()) * image.height();
+    double float_bytes = pixels * 3 * sizeof(float);
+
+    reset_peak_rss();
+    auto start = Clock::now();
+    cam.render_image(world, image);
+    double render_secs = seconds_since(start);
+    auto render_peak = peak_rss();
+
+    reset_peak_rss();
+    start = Clock::now();
+    auto rows = image.rows();
+    save_image(png_path, rows);
+    double encode_secs = seconds_since(start);
+    auto encode_peak = peak_rss();
+    auto png_bytes = MappedFile::open_read_only(png_path).size();
+    std::remove(png_path);
+
+    std::printf("gigapixel  %dx%d  %.2f Gpixel  float image %.1f GB  tile "
+                "file %.1f GB\n",
+                image.width(), image.height(), pixels / 1e9, float_bytes / 1e9,
+                image.file_size() / 1e9);
+    std::printf("gigapixel  render %6.1f s  %5.2f Mpixel/s  peak RSS "
+                "%6.1f MB\n",
+                render_secs, pixels / 1e6 / render_secs, render_peak / 1e6);
+    std::printf("gigapixel  encode %6.1f s  %5.1f MB PNG     peak RSS "
+                "%6.1f MB\n",
+                encode_secs, png_bytes / 1e6, encode_peak / 1e6);
+}
+
+struct Benchmark {
+        const char *name;
+        std::function<void()> run;
+};
+
+int main(int argc, char **argv) {
+    std::vector<Benchmark> benchmarks = {
+        {"rng", bench_rng},
+        {"samples", bench_samples},
+        {"bvh", bench_bvh},
+        {"flat_bvh", bench_flat_bvh},
+        {"hit_path", bench_hit_path},
+        {"sphere_kernels", bench_sphere_kernels},
+        {"image_output", bench_image_output},
+        {"adaptive", bench_adaptive},
+        {"roulette", bench_roulette},
+        {"wavefront", bench_wavefront},
+        {"compiled_scene", bench_compiled_scene},
+        {"precision", bench_precision},
+        {"scene_load", bench_scene_load},
+        {"distributed", bench_distributed},
+        {"suite", bench_suite},
+        {"profile", bench_profile},
+        {"instancing", bench_instancing},
+        {"mesh", bench_mesh},
+        {"sampler", bench_sampler},
+        {"server", bench_server},
+        {"animation", bench_animation},
+        {"denoise", bench_denoise},
+        {"kernels", bench_kernels},
+        {"gigapixel", bench_gigapixel},
+    };
+
+    // With no arguments every benchmark runs, otherwise only the named ones
+    for (const auto &benchmark : benchmarks) {
+        bool selected = argc < 2;
+        for (int k = 1; k < argc; k++) {
+            selected |= std::strcmp(argv[k], benchmark.name) == 0;
+        }
+        if (selected) {
+            benchmark.run();
+        }
+    }
+}
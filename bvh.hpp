@@ -0,0 +1,191 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "common.hpp"
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "render_stats.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Where a primitive range should be divided
+struct BvhSplit {
+        int axis = -1; // -1 when no bin boundary separates the centroids
+        int bin = 0;   // primitives in bins <= bin go to the left child
+        double cost = infinity;
+        Interval centroid_range;
+
+        static constexpr int bin_count = 16;
+
+        int bin_of(const Point3 &centroid) const {
+            auto extent = centroid_range.size();
+            int b = int(bin_count * (centroid[axis] - centroid_range.min) /
+                        extent);
+            return std::clamp(b, 0, bin_count - 1);
+        }
+
+        bool goes_left(const Aabb &box) const {
+            return bin_of(box.centroid()) <= bin;
+        }
+};
+
+/**
+ * Binned surface area heuristic (Wald 2007). Centroids are dropped into
+ * bins along each axis and every bin boundary is scored by
+ *   area(left) * count(left) + area(right) * count(right)
+ * relative to the parent area. bounds_of(k) returns the box of the k-th
+ * primitive in the range.
+ */
+template <typename BoundsOf>
+BvhSplit find_sah_split(size_t count, BoundsOf bounds_of) {
+    constexpr int bins = BvhSplit::bin_count;
+
+    Aabb parent;
+    Interval centroids[3];
+    for (size_t k = 0; k < count; k++) {
+        auto box = bounds_of(k);
+        auto c = box.centroid();
+        parent = Aabb(parent, box);
+        for (int axis = 0; axis < 3; axis++) {
+            centroids[axis] =
+                Interval(centroids[axis], Interval(c[axis], c[axis]));
+        }
+    }
+
+    BvhSplit best;
+    auto parent_area = parent.surface_area();
+
+    for (int axis = 0; axis < 3; axis++) {
+        BvhSplit candidate;
+        candidate.axis = axis;
+        candidate.centroid_range = centroids[axis];
+        if (candidate.centroid_range.size() <= 0) continue;
+
+        Aabb bin_box[bins];
+        size_t bin_size[bins] = {};
+        for (size_t k = 0; k < count; k++) {
+            auto box = bounds_of(k);
+            int b = candidate.bin_of(box.centroid());
+            bin_box[b] = Aabb(bin_box[b], box);
+            bin_size[b]++;
+        }
+
+        // Sweep from the right so each boundary's right side is known
+        double right_cost[bins];
+        Aabb right;
+        size_t right_count = 0;
+        for (int b = bins - 1; b > 0; b--) {
+            right = Aabb(right, bin_box[b]);
+            right_count += bin_size[b];
+            right_cost[b - 1] = right.surface_area() * right_count;
+        }
+
+        Aabb left;
+        size_t left_count = 0;
+        for (int b = 0; b < bins - 1; b++) {
+            left = Aabb(left, bin_box[b]);
+            left_count += bin_size[b];
+            if (left_count == 0 || left_count == count) continue;
+
+            auto cost =
+                1 + (left.surface_area() * left_count + right_cost[b]) /
+                        parent_area;
+            if (cost < best.cost) {
+                candidate.bin = b;
+                candidate.cost = cost;
+                best = candidate;
+            }
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Pointer-based bounding volume hierarchy over arbitrary hittables.
+ * Interior nodes are split with the binned SAH, leaves are the objects
+ * themselves.
+ */
+class BvhNode : public Hittable {
+    public:
+        BvhNode(HittableList list)
+            : BvhNode(list.objects, 0, list.objects.size()) {
+        }
+
+        BvhNode(std::vector<shared_ptr<Hittable>> &objects, size_t start,
+                size_t end) {
+            size_t object_span = end - start;
+
+            for (size_t k = start; k < end; k++) {
+                bbox = Aabb(bbox, objects[k]->bounding_box());
+            }
+
+            // An empty list leaves no children and an empty box: no hits
+            if (object_span == 0) {
+                return;
+            }
+            if (object_span == 1) {
+                left = right = objects[start];
+                return;
+            }
+            if (object_span == 2) {
+                left = objects[start];
+                right = objects[start + 1];
+                return;
+            }
+
+            auto split = find_sah_split(object_span, [&](size_t k) {
+                return objects[start + k]->bounding_box();
+            });
+
+            size_t mid;
+            if (split.axis < 0) {
+                // Coincident centroids: any split is as good as another
+                mid = start + object_span / 2;
+            } else {
+                auto first_right = std::partition(
+                    objects.begin() + start, objects.begin() + end,
+                    [&](const shared_ptr<Hittable> &object) {
+                        return split.goes_left(object->bounding_box());
+                    });
+                mid = first_right - objects.begin();
+            }
+
+            left = make_shared<BvhNode>(objects, start, mid);
+            right = make_shared<BvhNode>(objects, mid, end);
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            PALETTE_COUNT(nodes_visited, 1);
+            if (!left || !bbox.hit(r, ray_t)) {
+                return false;
+            }
+
+            bool hit_left = left->hit(r, ray_t, rec);
+            if (right == left) {
+                return hit_left;
+            }
+            bool hit_right = right->hit(
+                r, Interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+
+            return hit_left || hit_right;
+        }
+
+        Aabb bounding_box() const override {
+            return bbox;
+        }
+
+        unsigned material_kinds() const override {
+            if (!left) return 0;
+            return left->material_kinds() | right->material_kinds();
+        }
+
+    private:
+        shared_ptr<Hittable> left;
+        shared_ptr<Hittable> right;
+        Aabb bbox;
+};
+
+#endif
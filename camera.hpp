@@ -1,10 +1,52 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "aov.hpp"
 #include "hittable.hpp"
 #include "material.hpp"
 #include "color.hpp"
 #include "vec3.hpp"
+#include "framebuffer.hpp"
+#include "image_writer.hpp"
+#include "profile.hpp"
+#include "render_stats.hpp"
+#include "tile_scheduler.hpp"
+#include "tiled_framebuffer.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Per-thread tallies of the paths traced by Camera::ray_color
+struct PathCounters {
+        std::uint64_t bounces = 0;
+};
+
+inline PathCounters &path_counters() {
+    thread_local PathCounters counters;
+    return counters;
+}
+
+// Lens a render kernel is compiled for; any tests defocus_angle per ray
+enum class LensKind { any, pinhole, thin_lens };
+
+/**
+ * What a render kernel takes as known at compile time: the lens, the
+ * material kinds of the scene as material_bit values, and max_depth, where
+ * 0 leaves it to the camera. Code for lenses and materials the kernel
+ * cannot meet is left out and its tests fold away. GenericKernel assumes
+ * nothing and renders any scene.
+ */
+template <LensKind Lens, unsigned MaterialKinds, int MaxDepth>
+struct RenderKernel {
+        static constexpr LensKind lens = Lens;
+        static constexpr unsigned material_kinds = MaterialKinds;
+        static constexpr int max_depth = MaxDepth;
+};
+
+using GenericKernel = RenderKernel<LensKind::any, all_material_kinds, 0>;
 
 class Camera {
     public:
@@ -21,39 +63,155 @@ class Camera {
         double defocus_angle = 0;
         double focus_dist = 10;
 
+        // Rays are spread over the scene times [shutter_open,
+        // shutter_close) for motion blur; equal values freeze one moment
+        double shutter_open = 0;
+        double shutter_close = 0;
+
+        // 0 uses every hardware thread. Output does not depend on this.
+        int thread_count = 0;
+        int tile_size = 16;
+        std::uint64_t seed = 0;
+
+        // Where each sample's random numbers come from; see sampler.hpp.
+        // The stratified grid is laid out for samples_per_pixel.
+        SamplerKind sampler = SamplerKind::independent;
+
+        // Adaptive sampling keeps samples_per_pixel as the average budget of
+        // each tile but spends it unevenly. Every pixel first takes
+        // min_samples_per_pixel. The rest goes to pixels whose estimated
+        // error is above noise_threshold, in proportion to that error, up to
+        // max_samples_per_pixel. Budget left once a tile converges is saved.
+        bool adaptive_sampling = false;
+        int min_samples_per_pixel = 16;
+        int max_samples_per_pixel = 1024;
+        double noise_threshold = 0.01;
+
+        // Paths are randomly terminated after roulette_depth bounces
+        bool russian_roulette = true;
+        int roulette_depth = 3;
+
+        // Also fill last_aovs() with each pixel's albedo, normal and depth,
+        // for Denoiser. Costs no extra rays and leaves the image unchanged.
+        bool render_aovs = false;
+
+        // Render with a kernel compiled for the lens, max_depth and the
+        // scene's material kinds rather than the generic one, which tests
+        // them per ray. Output does not depend on this.
+        bool specialize_kernels = true;
+
+        // Renders and writes a binary PPM to stdout
         void render(const Hittable &world) {
+            auto image = render_image(world);
+            PALETTE_PROFILE_SCOPE(output);
+            PpmBinaryWriter().write(std::cout, image);
+        }
+
+        // Renders and writes to path, in the format its extension names
+        void render(const Hittable &world, const std::string &path) {
+            save_image(path, render_image(world));
+        }
+
+        Framebuffer render_image(const Hittable &world) {
             initialize();
 
-            std::cout << "P3\n"
-                      << image_width << ' ' << image_height << "\n255\n";
-
-            for (int j = 0; j < image_height; j++) {
-                std::clog << "\rScanlines remaining: " << (image_height - j)
-                          << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    Color pixel_color(0, 0, 0);
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        Ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_depth, world);
-                    }
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
-                }
+            Framebuffer image(image_width, image_height);
+            aovs_taken = render_aovs ? AovBuffers(image_width, image_height)
+                                     : AovBuffers();
+            render_tiles(world, image, render_aovs ? &aovs_taken : nullptr,
+                         [](const Tile &) {});
+            return image;
+        }
+
+        /**
+         * Renders into an out-of-core image, which must have this camera's
+         * size and tile_size. Every tile is released once rendered, so only
+         * the tiles in flight are in memory. AOVs would need the whole
+         * image in memory and cannot be taken.
+         */
+        void render_image(const Hittable &world, TiledFramebuffer &image) {
+            initialize();
+            if (image.width() != image_width ||
+                image.height() != image_height ||
+                image.tile_size() != std::max(tile_size, 1)) {
+                throw std::invalid_argument(
+                    "Camera: tiled image does not match the camera");
+            }
+            if (render_aovs) {
+                throw std::invalid_argument(
+                    "Camera: a tiled image cannot take AOVs");
             }
 
-            std::clog << "\rDone.                 \n";
+            aovs_taken = AovBuffers();
+            render_tiles(world, image, nullptr,
+                         [&](const Tile &tile) { image.release(tile); });
         }
 
-    private:
-        int image_height;
-        double pixel_samples_scale;
-        Point3 center;
-        Point3 pixel_00_loc; // Location of pixel 0, 0
-        Vec3 pixel_delta_u;  // Horizontal pixel offset vector
-        Vec3 pixel_delta_v;  // Vertical pixel offset vector
-        Vec3 u, v, w;        // Orthonormal basis for camera frame
-        Vec3 defocus_disk_u;
-        Vec3 defocus_disk_v;
+        // Camera samples traced by the last render_image call
+        std::uint64_t last_sample_count() const {
+            return samples_taken;
+        }
 
+        // Average scattering events per camera path in the last render
+        double last_average_bounces() const {
+            return samples_taken ? double(bounces_taken) / samples_taken : 0;
+        }
+
+        // Features of the last render_image call; empty without render_aovs
+        const AovBuffers &last_aovs() const {
+            return aovs_taken;
+        }
+
+        // Counters of the last render_image call; zero without PALETTE_STATS
+        const RenderStats &last_render_stats() const {
+            return stats_taken;
+        }
+
+        int height() const {
+            return image_height;
+        }
+
+        // Bounds on the settings that size a render
+        static constexpr int max_image_side = 1 << 16;
+        static constexpr int max_samples = 1 << 20;
+        static constexpr int max_path_depth = 1 << 16;
+
+        /**
+         * Checks the settings that size a render, which scene files and
+         * render jobs take from outside, so that a bad one fails with a
+         * message rather than a division by zero or a huge allocation.
+         * Returns the name of the first setting out of bounds and says why
+         * in `why`, or returns nullptr.
+         */
+        const char *invalid_setting(std::string &why) const {
+            auto bound = std::to_string(max_image_side);
+            if (image_width < 1 || image_width > max_image_side) {
+                why = " must be from 1 to " + bound;
+                return "image_width";
+            }
+            if (!(aspect_ratio > 0) || !std::isfinite(aspect_ratio)) {
+                why = " must be positive";
+                return "aspect_ratio";
+            }
+            auto rows = image_width / aspect_ratio;
+            if (rows < 1 || rows >= max_image_side + 1) {
+                why = " puts the image height, image_width / aspect_ratio, "
+                      "outside 1 to " +
+                      bound;
+                return "aspect_ratio";
+            }
+            if (samples_per_pixel < 1 || samples_per_pixel > max_samples) {
+                why = " must be from 1 to " + std::to_string(max_samples);
+                return "samples_per_pixel";
+            }
+            if (max_depth < 0 || max_depth > max_path_depth) {
+                why = " must be from 0 to " + std::to_string(max_path_depth);
+                return "max_depth";
+            }
+            return nullptr;
+        }
+
+        // Derives the view from the public settings; render_image calls it
         void initialize() {
             image_height = int(image_width / aspect_ratio);
             image_height = (image_height < 1) ? 1 : image_height;
@@ -91,22 +249,407 @@ class Camera {
             defocus_disk_v = v * defocus_radius;
         }
 
+        /**
+         * Runs fn(tile) for every tile of the image on thread_count workers.
+         * Tiles never overlap, so fn may write its pixels without locking.
+         */
+        template <typename TileFn>
+        void for_each_tile(TileFn &&fn) const {
+            int workers = thread_count > 0
+                              ? thread_count
+                              : int(std::thread::hardware_concurrency());
+            workers = std::max(workers, 1);
+
+            TileScheduler scheduler(image_width, image_height, tile_size,
+                                    workers);
+            std::atomic<int> tiles_done{0};
+            std::mutex log_lock;
+
+            auto work = [&](int worker) {
+                Tile tile;
+                while (scheduler.next(worker, tile)) {
+                    fn(tile);
+
+                    int done = ++tiles_done;
+                    std::lock_guard<std::mutex> guard(log_lock);
+                    std::clog << "\rTiles remaining: "
+                              << (scheduler.tile_count() - done) << ' '
+                              << std::flush;
+                }
+                // Code after the render draws independent numbers again
+                thread_sample_stream() = SampleStream();
+            };
+
+            std::vector<std::thread> threads;
+            for (int worker = 1; worker < workers; worker++) {
+                threads.emplace_back(work, worker);
+            }
+            work(0);
+            for (auto &thread : threads) {
+                thread.join();
+            }
+        }
+
+        /**
+         * Renders the pixels of one tile into image, and their features into
+         * aovs if given, and returns the number of samples taken. Adaptive
+         * sampling depends on the tile's pixels, so the same image needs the
+         * same tile_size. Image is a Framebuffer or a TiledFramebuffer.
+         */
+        template <typename Image>
+        std::uint64_t render_tile(const Hittable &world, const Tile &tile,
+                                  Image &image,
+                                  AovBuffers *aovs = nullptr) const {
+            PALETTE_PROFILE_TILE(tile);
+            return with_kernel(world, [&](auto kernel) {
+                using Kernel = decltype(kernel);
+                if (adaptive_sampling) {
+                    return render_tile_adaptive<Kernel>(world, tile, image,
+                                                        aovs);
+                }
+                return render_tile_uniform<Kernel>(world, tile, image, aovs);
+            });
+        }
+
+        // Sum of samples [first, end) of pixel (i, j); adds their features
+        // to *features if given
+        Color sample_pixel(const Hittable &world, int i, int j, int first,
+                           int end, SampleFeatures *features = nullptr) const {
+            return with_kernel(world, [&](auto kernel) {
+                return sample_pixel_with<decltype(kernel)>(world, i, j, first,
+                                                           end, features);
+            });
+        }
+
+        /**
+         * Calls fn(Kernel()) with the RenderKernel that fits this camera
+         * and world. Kernels are instantiated for the pinhole and the thin
+         * lens, max_depth 50 (the book's) or other, and each set of
+         * material kinds, 28 in all; without specialize_kernels, or for
+         * scenes that do not know their kinds, fn gets GenericKernel.
+         */
+        template <typename KernelFn>
+        auto with_kernel(const Hittable &world, KernelFn &&fn) const
+            -> decltype(fn(GenericKernel())) {
+            auto kinds = world.material_kinds();
+            if (!specialize_kernels || kinds == 0 ||
+                (kinds & ~all_material_kinds) != 0) {
+                return fn(GenericKernel());
+            }
+            if (defocus_angle <= 0) {
+                return with_depth<LensKind::pinhole>(kinds, fn);
+            }
+            return with_depth<LensKind::thin_lens>(kinds, fn);
+        }
+
+        // Points the calling thread's generator and sampler at one sample
+        // of a pixel, numbered j * image_width + i
+        void start_sample(std::uint64_t pixel, int sample) const {
+            ::start_sample(sampler, seed, pixel, std::uint32_t(sample),
+                           std::uint32_t(samples_per_pixel));
+        }
+
+        // Camera ray for one sample of pixel (i, j), drawn from the calling
+        // thread's generator and sampler
+        Ray sample_ray(int i, int j) const {
+            return get_ray<GenericKernel>(i, j);
+        }
+
+        // Closest hit along a path segment, ignoring floating point error
+        // hits right at its origin
+        static bool trace(const Hittable &world, const Ray &ray,
+                          hit_record &rec) {
+            PALETTE_COUNT(rays, 1);
+            PALETTE_PROFILE_SCOPE(intersect);
+            return world.hit(ray, Interval(0.001, infinity), rec);
+        }
+
+        // Radiance of rays that escape the scene
+        static Color sky_color(const Ray &r) {
+            Vec3 unit_direction = unit_vector(r.direction());
+            auto a = 0.5 * (unit_direction.y() + 1.0);
+            return (1.0 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0);
+        }
+
+        // Russian roulette after the given bounce. Surviving paths have
+        // their throughput reweighted; returns false if the path ends.
+        bool survives_roulette(Color &throughput, int bounce) const {
+            if (!russian_roulette || bounce + 1 < roulette_depth) return true;
+
+            auto survival = std::fmin(
+                std::fmax(throughput.x(),
+                          std::fmax(throughput.y(), throughput.z())),
+                0.95);
+            if (sample_1d() >= survival) {
+                return false;
+            }
+            throughput /= survival;
+            return true;
+        }
+
+    private:
+        std::uint64_t samples_taken = 0;
+        std::uint64_t bounces_taken = 0;
+        RenderStats stats_taken;
+        AovBuffers aovs_taken;
+        int image_height;
+        double pixel_samples_scale;
+        Point3 center;
+        Point3 pixel_00_loc; // Location of pixel 0, 0
+        Vec3 pixel_delta_u;  // Horizontal pixel offset vector
+        Vec3 pixel_delta_v;  // Vertical pixel offset vector
+        Vec3 u, v, w;        // Orthonormal basis for camera frame
+        Vec3 defocus_disk_u;
+        Vec3 defocus_disk_v;
+
+        // Renders every tile into image on thread_count workers, calling
+        // done(tile) after each, and reports on the render
+        template <typename Image, typename DoneFn>
+        void render_tiles(const Hittable &world, Image &image,
+                          AovBuffers *aovs, DoneFn &&done) {
+            std::atomic<std::uint64_t> samples{0};
+            std::atomic<std::uint64_t> bounces{0};
+            std::mutex stats_mutex;
+            stats_taken = RenderStats();
+
+            for_each_tile([&](const Tile &tile) {
+                auto bounces_before = path_counters().bounces;
+                auto stats_before = render_stats();
+                samples += render_tile(world, tile, image, aovs);
+                bounces += path_counters().bounces - bounces_before;
+                done(tile);
+
+                if constexpr (render_stats_enabled) {
+                    auto tile_stats = render_stats() - stats_before;
+                    std::lock_guard<std::mutex> lock(stats_mutex);
+                    stats_taken += tile_stats;
+                }
+            });
+
+            samples_taken = samples;
+            bounces_taken = bounces;
+            std::clog << "\rDone.                 \n";
+            if constexpr (render_stats_enabled) {
+                std::clog << stats_taken.rays << " rays, "
+                          << double(stats_taken.primitive_tests) /
+                                 stats_taken.rays
+                          << " primitive tests per ray\n";
+            }
+            if (adaptive_sampling) {
+                auto uniform = double(image_width) * image_height *
+                               samples_per_pixel;
+                std::clog << "Adaptive sampling took " << samples_taken
+                          << " samples, " << 100.0 * samples_taken / uniform
+                          << "% of uniform " << samples_per_pixel << " spp\n";
+            }
+        }
+
+        template <LensKind Lens, typename KernelFn>
+        auto with_depth(unsigned kinds, KernelFn &fn) const
+            -> decltype(fn(GenericKernel())) {
+            if (max_depth == 50) {
+                return with_kinds<Lens, 50>(kinds, fn);
+            }
+            return with_kinds<Lens, 0>(kinds, fn);
+        }
+
+        template <LensKind Lens, int MaxDepth, unsigned Kinds = 1,
+                  typename KernelFn>
+        static auto with_kinds(unsigned kinds, KernelFn &fn)
+            -> decltype(fn(GenericKernel())) {
+            if constexpr (Kinds < all_material_kinds) {
+                if (kinds != Kinds) {
+                    return with_kinds<Lens, MaxDepth, Kinds + 1>(kinds, fn);
+                }
+            }
+            return fn(RenderKernel<Lens, Kinds, MaxDepth>());
+        }
+
+        template <typename Kernel, typename Image>
+        std::uint64_t render_tile_uniform(const Hittable &world,
+                                          const Tile &tile, Image &image,
+                                          AovBuffers *aovs) const {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    SampleFeatures features;
+                    auto sum = sample_pixel_with<Kernel>(
+                        world, i, j, 0, samples_per_pixel,
+                        aovs ? &features : nullptr);
+                    image.set_pixel(i, j, pixel_samples_scale * sum);
+                    if (aovs) {
+                        aovs->set_pixel(i, j, sum, features,
+                                        samples_per_pixel);
+                    }
+                }
+            }
+            return std::uint64_t(tile.width()) * tile.height() *
+                   samples_per_pixel;
+        }
+
+        template <typename Kernel>
+        Color sample_pixel_with(const Hittable &world, int i, int j,
+                                int first, int end,
+                                SampleFeatures *features) const {
+            auto pixel = std::uint64_t(j) * image_width + i;
+
+            Color pixel_color(0, 0, 0);
+            for (int sample = first; sample < end; sample++) {
+                // Seeding per sample makes the result independent of
+                // which thread, tile or pass produced it
+                start_sample(pixel, sample);
+                Ray r = get_ray<Kernel>(i, j);
+                auto color = ray_color<Kernel>(r, world, features);
+                pixel_color += color;
+                if (features) {
+                    features->luminance_squared += luminance(color) *
+                                                   luminance(color);
+                }
+            }
+            return pixel_color;
+        }
+
+        // Running statistics of one pixel during adaptive sampling
+        struct PixelEstimate {
+                Color sum;
+                SampleFeatures features;
+                int count = 0;
+                double mean = 0, m2 = 0; // Welford, on luminance
+
+                void add(const Color &sample) {
+                    sum += sample;
+                    count++;
+
+                    auto value = luminance(sample);
+                    auto delta = value - mean;
+                    mean += delta / count;
+                    m2 += delta * (value - mean);
+                }
+
+                // Standard deviation of one sample as it shows after gamma
+                // encoding: d sqrt(x) / dx = 1 / (2 sqrt(x))
+                double deviation() const {
+                    auto std_dev = std::sqrt(m2 / (count - 1));
+                    return std_dev / (2 * std::sqrt(std::max(mean, 1e-4)));
+                }
+
+                // Standard error of the mean, on the same scale
+                double error() const {
+                    return deviation() / std::sqrt(count);
+                }
+        };
+
+        /**
+         * Renders one tile adaptively and returns the samples it used.
+         * Allocation depends only on the tile's own pixels, and each pixel
+         * still draws sample indices 0, 1, 2, ..., so the result does not
+         * depend on threading.
+         */
+        template <typename Kernel, typename Image>
+        std::uint64_t render_tile_adaptive(const Hittable &world,
+                                           const Tile &tile, Image &image,
+                                           AovBuffers *aovs) const {
+            int min_samples = std::max(min_samples_per_pixel, 2);
+            int max_samples = std::max(max_samples_per_pixel, min_samples);
+
+            auto pixels = size_t(tile.width()) * tile.height();
+            std::vector<PixelEstimate> estimates(pixels);
+
+            auto take_samples = [&](size_t k, int count) {
+                int i = tile.x0 + int(k % tile.width());
+                int j = tile.y0 + int(k / tile.width());
+                auto pixel = std::uint64_t(j) * image_width + i;
+
+                auto &estimate = estimates[k];
+                for (int n = 0; n < count; n++) {
+                    start_sample(pixel, estimate.count);
+                    auto color = ray_color<Kernel>(
+                        get_ray<Kernel>(i, j), world,
+                        aovs ? &estimate.features : nullptr);
+                    estimate.add(color);
+                    estimate.features.luminance_squared +=
+                        luminance(color) * luminance(color);
+                }
+            };
+
+            auto budget = std::int64_t(pixels) *
+                          (std::max(samples_per_pixel, min_samples) -
+                           min_samples);
+            for (size_t k = 0; k < pixels; k++) {
+                take_samples(k, min_samples);
+            }
+
+            // The total squared error of the tile is lowest when each pixel
+            // gets samples in proportion to its per-sample deviation. The
+            // budget is handed out in halving rounds so the estimates get
+            // refined before all of it is committed.
+            std::vector<std::pair<double, size_t>> noisy;
+            while (budget > 0) {
+                noisy.clear();
+                double total_deviation = 0;
+                for (size_t k = 0; k < pixels; k++) {
+                    const auto &estimate = estimates[k];
+                    if (estimate.count < max_samples &&
+                        estimate.error() > noise_threshold) {
+                        noisy.emplace_back(estimate.deviation(), k);
+                        total_deviation += estimate.deviation();
+                    }
+                }
+                if (noisy.empty()) break;
+
+                auto round = std::max<std::int64_t>(budget / 2, noisy.size());
+                round = std::min(round, budget);
+                for (auto [deviation, k] : noisy) {
+                    auto extra = std::int64_t(
+                        std::ceil(round * deviation / total_deviation));
+                    extra = std::min<std::int64_t>(
+                        {extra, max_samples - estimates[k].count, budget});
+                    take_samples(k, int(extra));
+                    budget -= extra;
+                    if (budget <= 0) break;
+                }
+            }
+
+            std::uint64_t used = 0;
+            for (size_t k = 0; k < pixels; k++) {
+                const auto &estimate = estimates[k];
+                int i = tile.x0 + int(k % tile.width());
+                int j = tile.y0 + int(k / tile.width());
+                image.set_pixel(i, j, estimate.sum / estimate.count);
+                if (aovs) {
+                    aovs->set_pixel(i, j, estimate.sum, estimate.features,
+                                    estimate.count);
+                }
+                used += estimate.count;
+            }
+            return used;
+        }
+
         // Compute ray using location of pixel 0, 0 and antialiasing
+        template <typename Kernel>
         Ray get_ray(int i, int j) const {
+            PALETTE_PROFILE_SCOPE(camera_ray);
             auto offset = sample_square();
             auto pixel_sample = pixel_00_loc +
                                 ((i + offset.x()) * pixel_delta_u) +
                                 ((j + offset.y()) * pixel_delta_v);
 
-            auto ray_origin =
-                (defocus_angle <= 0) ? center : defocus_disk_sample();
+            bool pinhole = Kernel::lens == LensKind::any
+                               ? defocus_angle <= 0
+                               : Kernel::lens == LensKind::pinhole;
+            auto ray_origin = pinhole ? center : defocus_disk_sample();
             auto ray_direction = pixel_sample - ray_origin;
 
-            return Ray(ray_origin, ray_direction);
+            // Static renders draw no time, so their samples stay as before
+            auto ray_time = shutter_open;
+            if (shutter_close > shutter_open) {
+                ray_time += (shutter_close - shutter_open) * sample_1d();
+            }
+            return Ray(ray_origin, ray_direction, Real(ray_time));
         }
 
         Vec3 sample_square() const {
-            return Vec3(random_double() - 0.5, random_double() - 0.5, 0);
+            auto [x, y] = sample_2d();
+            return Vec3(x - 0.5, y - 0.5, 0);
         }
 
         Point3 defocus_disk_sample() const {
@@ -115,28 +658,93 @@ class Camera {
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        Color ray_color(const Ray &r, int depth, const Hittable &world) const {
+        /**
+         * Follows one path iteratively, carrying the product of the
+         * attenuations so far as its throughput. After roulette_depth
+         * bounces a path survives with probability equal to its largest
+         * throughput channel (at most 0.95) and is reweighted by the inverse,
+         * which keeps the estimate unbiased while dropping paths that would
+         * contribute little anyway.
+         *
+         * With features given, the path adds its SampleFeatures to them.
+         * They draw no random numbers, so the radiance is the same either
+         * way. Kernel only narrows the materials tested for and may fix
+         * the depth; every kernel draws the same numbers.
+         */
+        template <typename Kernel>
+        Color ray_color(const Ray &r, const Hittable &world,
+                        SampleFeatures *features) const {
+            int depth = Kernel::max_depth > 0 ? Kernel::max_depth : max_depth;
+            Color throughput(1, 1, 1);
+            Ray ray = r;
+            auto &counters = path_counters();
+
+            // Features are taken at the first surface the path does not
+            // pass straight through; until then, tint is the product of
+            // the mirrors and glass on the way. A path that ends first
+            // keeps the last normal and a black albedo.
+            Color tint(1, 1, 1);
+            Vec3 last_normal = -unit_vector(r.direction());
+            auto take_features = [&](const Color &albedo, const Vec3 &normal) {
+                if (features) {
+                    features->albedo += tint * albedo;
+                    features->normal += normal;
+                    features = nullptr;
+                }
+            };
+
             // after maximum ray bounces, stop gathering light information
-            if (depth <= 0) {
-                return Color(0, 0, 0);
-            }
+            for (int bounce = 0; bounce < depth; bounce++) {
+                hit_record rec;
 
-            hit_record rec;
+                if (!trace(world, ray, rec)) {
+                    auto sky = sky_color(ray);
+                    take_features(sky, -unit_vector(ray.direction()));
+                    return throughput * sky;
+                }
+                if (features && bounce == 0) {
+                    features->depth += rec.t * ray.direction().length();
+                }
+                last_normal = rec.normal;
 
-            // ignore floating point error hits
-            if (world.hit(r, Interval(0.001, infinity), rec)) {
                 Ray scattered;
                 Color attenuation;
-                if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-                    return attenuation * ray_color(scattered, depth - 1, world);
+                if (!rec.mat->scatter_as<Kernel::material_kinds>(
+                        ray, rec, attenuation, scattered)) {
+                    PALETTE_COUNT(absorbed, 1);
+                    take_features(Color(0, 0, 0), rec.normal);
+                    return Color(0, 0, 0);
+                }
+                counters.bounces++;
+                PALETTE_COUNT(scatters[int(rec.mat->kind())], 1);
+
+                if (features) {
+                    if (passes_features_on(*rec.mat)) {
+                        tint = tint * attenuation;
+                    } else {
+                        take_features(attenuation, rec.normal);
+                    }
+                }
+
+                throughput = throughput * attenuation;
+                ray = scattered;
+
+                if (!survives_roulette(throughput, bounce)) {
+                    take_features(Color(0, 0, 0), last_normal);
+                    return Color(0, 0, 0);
                 }
-                return Color(0, 0, 0);
             }
 
-            // If no hits, render sky
-            Vec3 unit_direction = unit_vector(r.direction());
-            auto a = 0.5 * (unit_direction.y() + 1.0);
-            return (1.0 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0);
+            take_features(Color(0, 0, 0), last_normal);
+            return Color(0, 0, 0);
+        }
+
+        // Glass and perfect mirrors show what lies behind or in front of
+        // them, so the denoiser is better guided by that
+        static bool passes_features_on(const Material &mat) {
+            return mat.kind() == MaterialKind::dielectric ||
+                   (mat.kind() == MaterialKind::metal &&
+                    mat.parameter() == 0);
         }
 };
 
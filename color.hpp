@@ -13,19 +13,21 @@ inline double linear_to_gamma(double linear_component) {
     return 0;
 }
 
-void write_color(std::ostream &out, const Color &pixel_color) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
-    static const Interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+// Rec. 709 luminance of a linear color
+inline double luminance(const Color &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Gamma-encoded 8-bit value of one linear channel
+inline int color_byte(double linear_component) {
+    static const IntervalT<double> intensity(0.000, 0.999);
+    return int(256 * intensity.clamp(linear_to_gamma(linear_component)));
+}
+
+inline void write_color(std::ostream &out, const Color &pixel_color) {
+    int rbyte = color_byte(pixel_color.x());
+    int gbyte = color_byte(pixel_color.y());
+    int bbyte = color_byte(pixel_color.z());
 
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
 }
@@ -7,9 +7,20 @@
 #include <limits>
 #include <memory>
 
+#include "random.hpp"
+#include "sampler.hpp"
+
 using std::make_shared;
 using std::shared_ptr;
 
+// Scalar type of the geometry and shading math, float when the build
+// defines PALETTE_FLOAT. Camera settings and image metrics stay double.
+#ifdef PALETTE_FLOAT
+using Real = float;
+#else
+using Real = double;
+#endif
+
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
@@ -18,7 +29,7 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    return std::rand() / (RAND_MAX + 1.0);
+    return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max) {
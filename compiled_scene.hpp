@@ -0,0 +1,101 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "common.hpp"
+#include "flat_bvh.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "sphere.hpp"
+#include "sphere_set.hpp"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Immutable, render-ready form of a scene. A HittableList is the builder:
+ * freezing it packs every sphere into one SphereBvh, whose coordinates
+ * live in flat arrays and whose materials are copied by value, so
+ * rendering follows no per-object pointers and makes no virtual material
+ * calls. Objects of other types keep their own representation in a
+ * separate BvhAggregate. Nested lists are flattened.
+ *
+ * The scene does not refer back to the list, which can be dropped once
+ * the scene is built.
+ */
+class CompiledScene : public Hittable {
+    public:
+        explicit CompiledScene(const HittableList &list) {
+            std::vector<const Sphere *> sphere_input;
+            std::vector<shared_ptr<Hittable>> other_input;
+            collect(list, sphere_input, other_input);
+
+            if (!sphere_input.empty()) {
+                spheres = std::make_unique<SphereBvh>(sphere_input);
+                bbox = Aabb(bbox, spheres->bounding_box());
+            }
+            if (!other_input.empty()) {
+                others = std::make_unique<BvhAggregate<>>(other_input);
+                bbox = Aabb(bbox, others->bounding_box());
+            }
+            sphere_total = sphere_input.size();
+            other_total = other_input.size();
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            bool hit_anything = false;
+            if (spheres && spheres->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+            if (others && others->hit(r, ray_t, rec)) {
+                hit_anything = true;
+            }
+            return hit_anything;
+        }
+
+        Aabb bounding_box() const override {
+            return bbox;
+        }
+
+        unsigned material_kinds() const override {
+            return (spheres ? spheres->material_kinds() : 0) |
+                   (others ? others->material_kinds() : 0);
+        }
+
+        size_t sphere_count() const {
+            return sphere_total;
+        }
+
+        size_t other_count() const {
+            return other_total;
+        }
+
+    private:
+        std::unique_ptr<SphereBvh> spheres;
+        std::unique_ptr<BvhAggregate<>> others;
+        size_t sphere_total = 0;
+        size_t other_total = 0;
+        Aabb bbox;
+
+        static void collect(const HittableList &list,
+                            std::vector<const Sphere *> &sphere_input,
+                            std::vector<shared_ptr<Hittable>> &other_input) {
+            for (const auto &object : list.objects) {
+                if (auto sphere = dynamic_cast<const Sphere *>(object.get())) {
+                    sphere_input.push_back(sphere);
+                } else if (auto nested = dynamic_cast<const HittableList *>(
+                               object.get())) {
+                    collect(*nested, sphere_input, other_input);
+                } else {
+                    other_input.push_back(object);
+                }
+            }
+        }
+};
+
+// Finishes building: the returned scene is what gets rendered
+inline CompiledScene freeze(const HittableList &list) {
+    return CompiledScene(list);
+}
+
+#endif
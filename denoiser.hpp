@@ -0,0 +1,269 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "aov.hpp"
+#include "framebuffer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/**
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al., Edge-Avoiding
+ * A-Trous Wavelet Transform for fast Global Illumination Filtering, HPG
+ * 2010) guided by a render's AOVs. Each pass blurs with a 3x3 B-spline
+ * kernel whose taps are 2^pass pixels apart, so five passes reach 31
+ * pixels each way for 45 taps per pixel. A tap's weight falls off with its
+ * difference from the center pixel in normal, relative depth and color,
+ * which keeps silhouettes and creases sharp while noise is averaged away.
+ *
+ * As in SVGF (Schied et al., Spatiotemporal Variance-Guided Filtering,
+ * HPG 2017) color differences are measured against the pixel's estimated
+ * noise, which each pass filters along with the color, so that shading
+ * detail survives where the noise is low. The image is divided by the
+ * albedo before filtering and multiplied back after, so only the lighting
+ * is smoothed and neighbouring objects keep their own colors.
+ */
+class Denoiser {
+    public:
+        int passes = 5;
+
+        // Differences at which a tap's weight drops to about 1/e: the RMS
+        // color difference per channel in standard deviations of the
+        // pixel's noise, the cosine distance 1 - n.n' of the normals and
+        // the depth difference relative to depth per pixel of tap distance
+        double sigma_color = 4;
+        double sigma_normal = 0.1;
+        double sigma_depth = 0.03;
+
+        // 0 uses every hardware thread. Output does not depend on this.
+        int thread_count = 0;
+
+        Framebuffer denoise(const Framebuffer &noisy,
+                            const AovBuffers &aovs) const {
+            int w = noisy.width(), h = noisy.height();
+            if (aovs.width() != w || aovs.height() != h) {
+                throw std::invalid_argument(
+                    "Denoiser: image and AOV sizes differ");
+            }
+
+            auto pixels = size_t(w) * h;
+            Guides guides(pixels);
+            Planes current(pixels), next(pixels);
+            for (size_t p = 0; p < pixels; p++) {
+                const float *albedo = aovs.albedo.data() + 3 * p;
+                for (int c = 0; c < 3; c++) {
+                    current.channel[c][p] =
+                        noisy.data()[3 * p + c] / (albedo[c] + albedo_floor);
+                }
+                float shade = float(luminance(Color(albedo[0], albedo[1],
+                                                    albedo[2]))) +
+                              albedo_floor;
+                current.variance[p] =
+                    aovs.variance_data()[p] / (shade * shade);
+
+                // Averaged normals are shorter at edges; only their
+                // direction is compared
+                const float *n = aovs.normal.data() + 3 * p;
+                float length = std::sqrt(n[0] * n[0] + n[1] * n[1] +
+                                         n[2] * n[2]);
+                for (int c = 0; c < 3; c++) {
+                    guides.normal[c][p] = length > 0 ? n[c] / length : 0;
+                }
+                float depth = aovs.depth_data()[p];
+                guides.depth[p] = depth;
+                guides.inverse_depth[p] =
+                    1 / (float(sigma_depth) * depth + 1e-6f);
+            }
+
+            float color_scale = 1 / (3 * float(sigma_color * sigma_color));
+            for (int pass = 0; pass < passes; pass++) {
+                int step = 1 << pass;
+                Weights weights{color_scale, 1 / float(sigma_normal),
+                                1.0f / step};
+                for_each_row(h, [&](int y) {
+                    for (int x = 0; x < w; x += span) {
+                        filter_span(w, h, y, x, std::min(x + span, w), step,
+                                    weights, guides, current, next);
+                    }
+                });
+                std::swap(current, next);
+            }
+
+            Framebuffer result(w, h);
+            for (size_t p = 0; p < pixels; p++) {
+                for (int c = 0; c < 3; c++) {
+                    result.data()[3 * p + c] =
+                        current.channel[c][p] *
+                        (aovs.albedo.data()[3 * p + c] + albedo_floor);
+                }
+            }
+            return result;
+        }
+
+    private:
+        // Keeps black albedo from dividing by zero
+        static constexpr float albedo_floor = 0.01f;
+
+        // Images are filtered one channel per array, so that the inner
+        // loop reads and writes contiguous floats and vectorizes
+        struct Planes {
+                std::vector<float> channel[3];
+                std::vector<float> variance; // of the luminance
+
+                explicit Planes(size_t pixels) : variance(pixels) {
+                    for (auto &values : channel) values.resize(pixels);
+                }
+        };
+
+        struct Guides {
+                std::vector<float> normal[3];
+                std::vector<float> depth;
+                std::vector<float> inverse_depth; // 1 / (sigma_depth depth)
+
+                explicit Guides(size_t pixels)
+                    : depth(pixels), inverse_depth(pixels) {
+                    for (auto &values : normal) values.resize(pixels);
+                }
+        };
+
+        // Reciprocals of the falloffs in the current pass
+        struct Weights {
+                float color, normal, depth;
+        };
+
+        // Pixels of a row filtered together. Their sums live in local
+        // arrays, which the compiler knows cannot overlap the planes, so
+        // the loop over them vectorizes.
+        static constexpr int span = 64;
+
+        // exp(-x) for x >= 0 as (1 - x / 16)^16, which needs no library
+        // call and reaches 0 at x = 16. The clamp is written without a
+        // branch so that loops calling this still vectorize.
+        static float falloff(float x) {
+            float y = 1 - x * (1.0f / 16);
+            y = 0.5f * (y + std::fabs(y));
+            y *= y;
+            y *= y;
+            y *= y;
+            return y * y;
+        }
+
+        // Filters pixels [begin, end) of row y, at most span of them
+        static void filter_span(int w, int h, int y, int begin, int end,
+                                int step, const Weights &weights,
+                                const Guides &guides, const Planes &in,
+                                Planes &out) {
+            static constexpr float kernel[3] = {0.25f, 0.5f, 0.25f};
+            int count = end - begin;
+            auto row = std::ptrdiff_t(y) * w + begin;
+
+            const float *r = in.channel[0].data();
+            const float *g = in.channel[1].data();
+            const float *b = in.channel[2].data();
+            const float *v = in.variance.data();
+            const float *nx = guides.normal[0].data();
+            const float *ny = guides.normal[1].data();
+            const float *nz = guides.normal[2].data();
+            const float *z = guides.depth.data();
+            const float *inv_z = guides.inverse_depth.data();
+
+            // The center tap counts fully whatever its guides say, so no
+            // weight sum is zero. Color differences are scaled by the
+            // center's noise, blurred over its row neighbours to steady it.
+            float weight_sum[span], r_sum[span], g_sum[span], b_sum[span],
+                v_sum[span], color_scale[span];
+            const float center = kernel[1] * kernel[1];
+            for (int k = 0; k < count; k++) {
+                auto p = row + k;
+                int x = begin + k;
+                weight_sum[k] = center;
+                r_sum[k] = center * r[p];
+                g_sum[k] = center * g[p];
+                b_sum[k] = center * b[p];
+                v_sum[k] = center * center * v[p];
+
+                float noise = 0.5f * v[p] + 0.25f * v[p - (x > 0)] +
+                              0.25f * v[p + (x + 1 < w)];
+                color_scale[k] = weights.color / (noise + 1e-6f);
+            }
+
+            for (int dy = -1; dy <= 1; dy++) {
+                int qy = y + dy * step;
+                if (qy < 0 || qy >= h) continue;
+
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (dx == 0 && dy == 0) continue;
+
+                    // Taps outside the image are dropped, not clamped
+                    int offset = dx * step;
+                    int k0 = std::max(begin, -offset) - begin;
+                    int k1 = std::min(end, w - offset) - begin;
+                    float tap = kernel[dy + 1] * kernel[dx + 1];
+                    auto tap_row = std::ptrdiff_t(qy) * w + begin + offset;
+
+                    for (int k = k0; k < k1; k++) {
+                        auto p = row + k, q = tap_row + k;
+                        float dr = r[p] - r[q], dg = g[p] - g[q],
+                              db = b[p] - b[q];
+                        float color = (dr * dr + dg * dg + db * db) *
+                                      color_scale[k];
+                        float normal =
+                            (1 - (nx[p] * nx[q] + ny[p] * ny[q] +
+                                  nz[p] * nz[q])) *
+                            weights.normal;
+                        float depth = std::fabs(z[p] - z[q]) * inv_z[p] *
+                                      weights.depth;
+                        float weight = tap * falloff(color + normal + depth);
+
+                        weight_sum[k] += weight;
+                        r_sum[k] += weight * r[q];
+                        g_sum[k] += weight * g[q];
+                        b_sum[k] += weight * b[q];
+                        v_sum[k] += weight * weight * v[q];
+                    }
+                }
+            }
+
+            // A weighted mean of independent values has variance
+            // sum w^2 v / (sum w)^2
+            for (int k = 0; k < count; k++) {
+                float scale = 1 / weight_sum[k];
+                out.channel[0][row + k] = r_sum[k] * scale;
+                out.channel[1][row + k] = g_sum[k] * scale;
+                out.channel[2][row + k] = b_sum[k] * scale;
+                out.variance[row + k] = v_sum[k] * scale * scale;
+            }
+        }
+
+        // Runs fn(y) for every row on thread_count workers
+        template <typename RowFn>
+        void for_each_row(int height, RowFn &&fn) const {
+            int workers = thread_count > 0
+                              ? thread_count
+                              : int(std::thread::hardware_concurrency());
+            workers = std::clamp(workers, 1, std::max(height, 1));
+
+            std::atomic<int> next_row{0};
+            auto work = [&] {
+                for (int y; (y = next_row++) < height;) {
+                    fn(y);
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (int worker = 1; worker < workers; worker++) {
+                threads.emplace_back(work);
+            }
+            work();
+            for (auto &thread : threads) {
+                thread.join();
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "socket_io.hpp"
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Renders a Camera's image with several worker processes on this machine.
+ * The workers are forked once the scene is built, so they share it
+ * copy-on-write and only tiles cross the sockets: a request names a tile
+ * and the reply carries its float pixels.
+ *
+ * A worker that dies gets its tile handed out again and is replaced. A
+ * tile that has been out for longer than tile_timeout is also given to an
+ * idle worker, and whichever copy comes back first is used. When no
+ * worker is idle to take it, the worker holding it is presumed stuck and
+ * replaced like a dead one. Each pixel is
+ * seeded from (seed, pixel, sample) and belongs to exactly one tile of the
+ * camera's tile grid, so the merged image equals Camera::render_image,
+ * however the work was spread and retried.
+ */
+class DistributedRenderer {
+    public:
+        int worker_count = 4;
+        double tile_timeout = 60; // seconds
+        int max_restarts = 16;    // replacement workers before giving up
+
+        // Fault injection for testing. The first worker process exits when
+        // it receives its crash_after-th tile, or hangs on its
+        // stall_after-th. 0 disables either.
+        int crash_after = 0;
+        int stall_after = 0;
+
+        struct Stats {
+                double wall_seconds = 0;
+                double busy_seconds = 0; // summed over workers
+                int workers = 0;
+                int tiles = 0;
+                int reissued = 0; // tiles handed out more than once
+                int restarts = 0;
+
+                // Share of the workers' time spent rendering
+                double efficiency() const {
+                    return busy_seconds / (wall_seconds * workers);
+                }
+        };
+
+        Framebuffer render(Camera &cam, const Hittable &world) {
+            cam.initialize();
+            auto start = Clock::now();
+
+            Framebuffer image(cam.image_width, cam.height());
+            tiles = image_tiles(cam.image_width, cam.height(), cam.tile_size);
+            done.assign(tiles.size(), false);
+            pending.clear();
+            for (int k = 0; k < int(tiles.size()); k++) {
+                pending.push_back(k);
+            }
+            issued_at.assign(tiles.size(), Clock::time_point());
+            last_stats = Stats();
+            last_stats.workers = std::max(worker_count, 1);
+            last_stats.tiles = int(tiles.size());
+
+            workers.clear();
+            for (int k = 0; k < last_stats.workers; k++) {
+                spawn(cam, world, k == 0);
+            }
+
+            int remaining = int(tiles.size());
+            while (remaining > 0) {
+                assign_idle_workers();
+                replace_stuck_workers();
+                remaining -= collect(image);
+                std::clog << "\rTiles remaining: " << remaining << ' '
+                          << std::flush;
+            }
+
+            shutdown();
+            last_stats.wall_seconds = seconds_since(start);
+            std::clog << "\rDone.                 \n";
+            return image;
+        }
+
+        const Stats &stats() const {
+            return last_stats;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Request {
+                std::int32_t index;
+                std::int32_t x0, y0, x1, y1;
+        };
+
+        // Followed by the tile's pixels, row by row, as rgb floats
+        struct Reply {
+                std::int32_t index;
+                std::uint32_t reserved;
+                double seconds;
+        };
+
+        struct Worker {
+                pid_t pid;
+                int fd;
+                int tile; // -1 when idle
+                bool faulty;
+                Clock::time_point tile_since; // when tile was handed over
+        };
+
+        std::vector<Tile> tiles;
+        std::vector<bool> done;
+        std::deque<int> pending;
+        std::vector<Clock::time_point> issued_at;
+        std::vector<Worker> workers;
+        Stats last_stats;
+
+        // What a new worker needs to be forked
+        const Camera *camera = nullptr;
+        const Hittable *scene = nullptr;
+
+        static double seconds_since(Clock::time_point start) {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        void spawn(const Camera &cam, const Hittable &world, bool faulty) {
+            camera = &cam;
+            scene = &world;
+
+            int fds[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                throw std::runtime_error("socketpair failed");
+            }
+
+            std::cout.flush();
+            std::clog.flush();
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                throw std::runtime_error("fork failed");
+            }
+
+            if (pid == 0) {
+                // Other workers' sockets must not stay open in here, or
+                // they would never see the coordinator hang up
+                for (const auto &worker : workers) {
+                    ::close(worker.fd);
+                }
+                ::close(fds[0]);
+                int status = 1;
+                try {
+                    serve(cam, world, fds[1], faulty);
+                    status = 0;
+                } catch (...) {
+                }
+                ::_exit(status);
+            }
+
+            ::close(fds[1]);
+            workers.push_back({pid, fds[0], -1, faulty, Clock::now()});
+        }
+
+        // Worker process: renders requested tiles until the socket closes
+        void serve(const Camera &cam, const Hittable &world, int fd,
+                   bool faulty) const {
+            Framebuffer image(cam.image_width, cam.height());
+            std::vector<float> pixels;
+            int received = 0;
+
+            Request request;
+            while (read_all(fd, &request, sizeof request)) {
+                received++;
+                if (faulty && received == crash_after) ::_exit(1);
+                if (faulty && received == stall_after) ::pause();
+
+                Tile tile{request.x0, request.y0, request.x1, request.y1};
+                auto start = Clock::now();
+                cam.render_tile(world, tile, image);
+
+                Reply reply{request.index, 0, seconds_since(start)};
+                pixels.clear();
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    size_t first = size_t(j) * image.width() + tile.x0;
+                    const float *row = image.data() + first * 3;
+                    pixels.insert(pixels.end(), row, row + tile.width() * 3);
+                }
+
+                if (!write_all(fd, &reply, sizeof reply) ||
+                    !write_all(fd, pixels.data(),
+                               pixels.size() * sizeof(float))) {
+                    return;
+                }
+            }
+        }
+
+        // Next tile for an idle worker: a fresh one, or else one that has
+        // been out too long
+        int next_tile() {
+            while (!pending.empty()) {
+                int k = pending.front();
+                pending.pop_front();
+                if (!done[k]) return k;
+            }
+
+            for (int k = 0; k < int(tiles.size()); k++) {
+                if (done[k] || seconds_since(issued_at[k]) < tile_timeout) {
+                    continue;
+                }
+                // A tile nobody holds is already back in pending
+                bool held_by_worker = false;
+                for (const auto &worker : workers) {
+                    held_by_worker |= worker.tile == k;
+                }
+                if (!held_by_worker) continue;
+
+                last_stats.reissued++;
+                return k;
+            }
+            return -1;
+        }
+
+        void assign_idle_workers() {
+            for (size_t w = 0; w < workers.size(); w++) {
+                if (workers[w].tile >= 0) continue;
+
+                int k = next_tile();
+                if (k < 0) return;
+
+                const Tile &tile = tiles[k];
+                Request request{k, tile.x0, tile.y0, tile.x1, tile.y1};
+                issued_at[k] = Clock::now();
+                workers[w].tile = k;
+                workers[w].tile_since = issued_at[k];
+                if (!write_all(workers[w].fd, &request, sizeof request)) {
+                    lose(w);
+                    w--;
+                }
+            }
+        }
+
+        // Overdue tiles go to idle workers first. With none idle, as with
+        // a single worker or when every worker hangs, waiting longer would
+        // never end, so workers past tile_timeout are replaced.
+        void replace_stuck_workers() {
+            for (const auto &worker : workers) {
+                if (worker.tile < 0) return;
+            }
+            for (size_t w = workers.size(); w-- > 0;) {
+                if (seconds_since(workers[w].tile_since) >= tile_timeout) {
+                    lose(w);
+                }
+            }
+        }
+
+        // Waits for replies; returns the number of tiles newly finished
+        int collect(Framebuffer &image) {
+            std::vector<pollfd> fds;
+            for (const auto &worker : workers) {
+                fds.push_back({worker.fd, POLLIN, 0});
+            }
+
+            // Wake up now and then so overdue tiles get reissued
+            int timeout_ms = int(std::min(tile_timeout, 1.0) * 1000);
+            if (::poll(fds.data(), fds.size(), timeout_ms) <= 0) return 0;
+
+            int finished = 0;
+            for (size_t w = fds.size(); w-- > 0;) {
+                if (fds[w].revents == 0) continue;
+
+                Reply reply;
+                if (!read_all(workers[w].fd, &reply, sizeof reply) ||
+                    reply.index < 0 || reply.index >= int(tiles.size())) {
+                    lose(w);
+                    continue;
+                }
+
+                const Tile &tile = tiles[reply.index];
+                std::vector<float> pixels(size_t(tile.width()) *
+                                          tile.height() * 3);
+                if (!read_all(workers[w].fd, pixels.data(),
+                              pixels.size() * sizeof(float))) {
+                    lose(w);
+                    continue;
+                }
+
+                workers[w].tile = -1;
+                last_stats.busy_seconds += reply.seconds;
+                if (done[reply.index]) continue; // the slower copy
+
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    std::memcpy(image.data() +
+                                    (size_t(j) * image.width() + tile.x0) * 3,
+                                &pixels[size_t(j - tile.y0) * tile.width() * 3],
+                                size_t(tile.width()) * 3 * sizeof(float));
+                }
+                done[reply.index] = true;
+                finished++;
+            }
+            return finished;
+        }
+
+        // Retires a worker that died or broke the protocol, puts its tile
+        // back at the front of the queue and starts a replacement
+        void lose(size_t w) {
+            Worker worker = workers[w];
+            workers.erase(workers.begin() + w);
+
+            ::close(worker.fd);
+            ::kill(worker.pid, SIGKILL);
+            ::waitpid(worker.pid, nullptr, 0);
+
+            if (worker.tile >= 0 && !done[worker.tile]) {
+                pending.push_front(worker.tile);
+                last_stats.reissued++;
+            }
+
+            if (last_stats.restarts < max_restarts) {
+                last_stats.restarts++;
+                spawn(*camera, *scene, false);
+            } else if (workers.empty()) {
+                throw std::runtime_error(
+                    "DistributedRenderer: every worker failed");
+            }
+        }
+
+        void shutdown() {
+            for (const auto &worker : workers) {
+                ::close(worker.fd);
+                // Busy workers hold a reissued tile that is no longer needed
+                if (worker.tile >= 0) ::kill(worker.pid, SIGKILL);
+            }
+            for (const auto &worker : workers) {
+                ::waitpid(worker.pid, nullptr, 0);
+            }
+            workers.clear();
+        }
+};
+
+#endif
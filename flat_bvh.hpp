@@ -0,0 +1,439 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "common.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "render_stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/**
+ * One node of a FlatBvh. Children are stored depth first: an interior
+ * node's first child directly follows it, the second child lives at
+ * `offset`. A leaf covers primitives [offset, offset + count).
+ * Bounds are single precision, rounded outward so they stay conservative.
+ */
+struct FlatBvhNode {
+        float lo[3];
+        float hi[3];
+        std::uint32_t offset;
+        std::uint16_t count; // 0 for interior nodes
+        std::uint16_t axis;  // split axis of interior nodes
+};
+
+static_assert(sizeof(FlatBvhNode) == 32, "BVH nodes must stay 32 bytes");
+
+struct BvhTraversalStats {
+        std::uint64_t nodes_visited = 0;
+        std::uint64_t primitives_tested = 0;
+};
+
+/**
+ * Bounding volume hierarchy packed into one contiguous array. FlatBvh only
+ * knows about boxes: the owner keeps its primitives in `primitive_order()`
+ * and supplies the leaf test, so the traversal loop itself makes no
+ * virtual calls.
+ */
+class FlatBvh {
+    public:
+        static constexpr int max_leaf_size = 4;
+        static constexpr int stack_size = 64;
+
+        FlatBvh() {
+        }
+
+        explicit FlatBvh(const std::vector<Aabb> &boxes) {
+            build(boxes);
+        }
+
+        void build(const std::vector<Aabb> &boxes) {
+            nodes.clear();
+            order.resize(boxes.size());
+            std::iota(order.begin(), order.end(), 0);
+            if (boxes.empty()) return;
+
+            nodes.reserve(2 * boxes.size());
+            build_range(boxes, 0, boxes.size(), 0);
+            nodes.shrink_to_fit(); // leaves hold several primitives
+        }
+
+        /**
+         * Recomputes every node's bounds for moved primitives, keeping the
+         * tree's shape; leaf_boxes[k] bounds the primitive in leaf slot k.
+         * Far cheaper than build, but the tree gets worse as primitives
+         * drift from where it was built for: compare sah_cost before and
+         * after to decide when to rebuild.
+         */
+        void refit(const std::vector<Aabb> &leaf_boxes) {
+            if (leaf_boxes.size() != order.size()) {
+                throw std::invalid_argument("FlatBvh: refit box count");
+            }
+
+            // Children follow their parent, so a reverse sweep sees them
+            // first
+            for (size_t k = nodes.size(); k-- > 0;) {
+                auto &node = nodes[k];
+                if (node.count > 0) {
+                    Aabb bounds;
+                    for (auto slot = node.offset;
+                         slot < node.offset + node.count; slot++) {
+                        bounds = Aabb(bounds, leaf_boxes[slot]);
+                    }
+                    set_bounds(node, bounds);
+                    continue;
+                }
+
+                const auto &first = nodes[k + 1];
+                const auto &second = nodes[node.offset];
+                for (int axis = 0; axis < 3; axis++) {
+                    node.lo[axis] = std::min(first.lo[axis], second.lo[axis]);
+                    node.hi[axis] = std::max(first.hi[axis], second.hi[axis]);
+                }
+            }
+        }
+
+        /**
+         * Expected cost of tracing a ray through the tree by the surface
+         * area heuristic: each node's visit and each leaf's primitive
+         * tests, weighted by the node's area relative to the root's.
+         */
+        double sah_cost() const {
+            if (nodes.empty()) return 0;
+            double root_area = node_box(nodes[0]).surface_area();
+            if (root_area <= 0) return 0;
+
+            double cost = 0;
+            for (const auto &node : nodes) {
+                cost += node_box(node).surface_area() *
+                        (node.count > 0 ? node.count : 1);
+            }
+            return cost / root_area;
+        }
+
+        // Input index of the primitive in each leaf slot
+        const std::vector<std::uint32_t> &primitive_order() const {
+            return order;
+        }
+
+        const std::vector<FlatBvhNode> &node_array() const {
+            return nodes;
+        }
+
+        Aabb bounding_box() const {
+            if (nodes.empty()) return Aabb();
+            return node_box(nodes[0]);
+        }
+
+        /**
+         * Finds the closest hit along r. leaf_hit(first, count, ray_t) tests
+         * primitives [first, first + count) and, on a hit, must shrink
+         * ray_t.max to the hit distance and return true.
+         */
+        template <typename LeafHit>
+        bool intersect(const Ray &r, Interval ray_t, LeafHit &&leaf_hit,
+                       BvhTraversalStats *stats = nullptr) const {
+            if (nodes.empty()) return false;
+
+            const Point3 &orig = r.origin();
+            const Vec3 &dir = r.direction();
+            const Real inv_dir[3] = {1 / dir[0], 1 / dir[1], 1 / dir[2]};
+            const bool dir_is_neg[3] = {inv_dir[0] < 0, inv_dir[1] < 0,
+                                        inv_dir[2] < 0};
+
+            std::uint32_t stack[stack_size];
+            int stack_top = 0;
+            std::uint32_t current = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const FlatBvhNode &node = nodes[current];
+                if (stats) stats->nodes_visited++;
+                PALETTE_COUNT(nodes_visited, 1);
+
+                if (node_hit(node, orig, inv_dir, ray_t)) {
+                    if (node.count > 0) {
+                        if (stats) stats->primitives_tested += node.count;
+                        if (leaf_hit(node.offset, node.count, ray_t)) {
+                            hit_anything = true;
+                        }
+                    } else {
+                        // Visit the child nearer along the split axis first
+                        if (dir_is_neg[node.axis]) {
+                            stack[stack_top++] = current + 1;
+                            current = node.offset;
+                        } else {
+                            stack[stack_top++] = node.offset;
+                            current = current + 1;
+                        }
+                        continue;
+                    }
+                }
+
+                if (stack_top == 0) break;
+                current = stack[--stack_top];
+            }
+
+            return hit_anything;
+        }
+
+    private:
+        std::vector<FlatBvhNode> nodes;
+        std::vector<std::uint32_t> order;
+
+        static float round_down(double x) {
+            auto f = float(x);
+            return double(f) > x ? std::nextafter(f, -INFINITY) : f;
+        }
+
+        static float round_up(double x) {
+            auto f = float(x);
+            return double(f) < x ? std::nextafter(f, INFINITY) : f;
+        }
+
+        static void set_bounds(FlatBvhNode &node, const Aabb &bounds) {
+            for (int axis = 0; axis < 3; axis++) {
+                const Interval &extent = bounds.axis_interval(axis);
+                node.lo[axis] = round_down(extent.min);
+                node.hi[axis] = round_up(extent.max);
+            }
+        }
+
+        static Aabb node_box(const FlatBvhNode &node) {
+            return Aabb(Interval(node.lo[0], node.hi[0]),
+                        Interval(node.lo[1], node.hi[1]),
+                        Interval(node.lo[2], node.hi[2]));
+        }
+
+        // The slab distances are rounded. Stretching the far one by their
+        // worst-case relative error (1 + 2 gamma_3, as in PBRT) keeps a ray
+        // through a box's corner or edge from slipping past it, which a
+        // watertight primitive test relies on.
+        static constexpr Real far_scale =
+            1 + 2 * (3 * std::numeric_limits<Real>::epsilon() / 2) /
+                    (1 - 3 * std::numeric_limits<Real>::epsilon() / 2);
+
+        static bool node_hit(const FlatBvhNode &node, const Point3 &orig,
+                             const Real inv_dir[3], const Interval &ray_t) {
+            auto t_min = ray_t.min;
+            auto t_max = ray_t.max;
+            for (int axis = 0; axis < 3; axis++) {
+                auto t0 = (node.lo[axis] - orig[axis]) * inv_dir[axis];
+                auto t1 = (node.hi[axis] - orig[axis]) * inv_dir[axis];
+                if (t0 > t1) std::swap(t0, t1);
+                t1 *= far_scale;
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min) return false;
+            }
+            return true;
+        }
+
+        void build_range(const std::vector<Aabb> &boxes, size_t start,
+                         size_t end, int depth) {
+            size_t index = nodes.size();
+            nodes.emplace_back();
+
+            Aabb bounds;
+            for (size_t k = start; k < end; k++) {
+                bounds = Aabb(bounds, boxes[order[k]]);
+            }
+            set_bounds(nodes[index], bounds);
+
+            size_t count = end - start;
+            auto make_leaf = [&] {
+                nodes[index].offset = std::uint32_t(start);
+                nodes[index].count = std::uint16_t(count);
+                nodes[index].axis = 0;
+            };
+
+            if (count == 1) {
+                make_leaf();
+                return;
+            }
+
+            auto split = find_sah_split(
+                count, [&](size_t k) { return boxes[order[start + k]]; });
+
+            // Past this depth the SAH is ignored in favour of median splits,
+            // which bounds the tree depth and so the traversal stack
+            bool force_median = depth > stack_size / 2;
+
+            if (count <= max_leaf_size &&
+                (split.axis < 0 || split.cost >= double(count))) {
+                make_leaf();
+                return;
+            }
+
+            size_t mid;
+            int axis;
+            if (split.axis < 0 || force_median) {
+                axis = bounds.longest_axis();
+                mid = start + count / 2;
+                std::nth_element(order.begin() + start, order.begin() + mid,
+                                 order.begin() + end,
+                                 [&](std::uint32_t a, std::uint32_t b) {
+                                     return boxes[a].centroid()[axis] <
+                                            boxes[b].centroid()[axis];
+                                 });
+            } else {
+                axis = split.axis;
+                auto first_right = std::partition(
+                    order.begin() + start, order.begin() + end,
+                    [&](std::uint32_t k) { return split.goes_left(boxes[k]); });
+                mid = first_right - order.begin();
+            }
+
+            build_range(boxes, start, mid, depth + 1);
+            nodes[index].offset = std::uint32_t(nodes.size());
+            nodes[index].count = 0;
+            nodes[index].axis = std::uint16_t(axis);
+            build_range(boxes, mid, end, depth + 1);
+        }
+};
+
+inline const Hittable &primitive_ref(const shared_ptr<Hittable> &object) {
+    return *object;
+}
+
+template <typename Primitive>
+const Primitive &primitive_ref(const Primitive &object) {
+    return object;
+}
+
+// Primitives with hit_distance/fill_record, such as Sphere, can postpone
+// their surface attributes until the closest hit is known
+template <typename Primitive>
+using hit_distance_t = decltype(std::declval<const Primitive &>().hit_distance(
+    std::declval<const Ray &>(), Interval(), std::declval<Real &>()));
+
+template <typename Primitive, typename = void>
+struct has_deferred_hit : std::false_type {};
+
+template <typename Primitive>
+struct has_deferred_hit<Primitive, std::void_t<hit_distance_t<Primitive>>>
+    : std::true_type {};
+
+/**
+ * Hittable over a FlatBvh whose primitives are stored by value in leaf
+ * order. With a final primitive type such as Sphere the leaf test is a
+ * direct call; shared_ptr<Hittable> is accepted for mixed scenes.
+ */
+template <typename Primitive = shared_ptr<Hittable>>
+class BvhAggregate : public Hittable {
+    public:
+        explicit BvhAggregate(std::vector<Primitive> objects) {
+            std::vector<Aabb> boxes;
+            boxes.reserve(objects.size());
+            for (const auto &object : objects) {
+                boxes.push_back(primitive_ref(object).bounding_box());
+            }
+
+            bvh.build(boxes);
+
+            primitives.reserve(objects.size());
+            for (auto k : bvh.primitive_order()) {
+                kinds |= primitive_ref(objects[k]).material_kinds();
+                primitives.push_back(std::move(objects[k]));
+            }
+        }
+
+        // Throws std::invalid_argument if the list holds other types
+        explicit BvhAggregate(const HittableList &list)
+            : BvhAggregate(collect(list)) {
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            return hit(r, ray_t, rec, nullptr);
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec,
+                 BvhTraversalStats *stats) const {
+            if constexpr (has_deferred_hit<Primitive>::value) {
+                const Primitive *closest = nullptr;
+                Real closest_t = 0;
+                bvh.intersect(
+                    r, ray_t,
+                    [&](std::uint32_t first, std::uint32_t count,
+                        Interval &t) {
+                        bool hit_anything = false;
+                        for (auto k = first; k < first + count; k++) {
+                            Real root;
+                            if (primitives[k].hit_distance(r, t, root)) {
+                                hit_anything = true;
+                                closest = &primitives[k];
+                                closest_t = root;
+                                t.max = root;
+                            }
+                        }
+                        return hit_anything;
+                    },
+                    stats);
+                if (!closest) return false;
+
+                closest->fill_record(r, closest_t, rec);
+                return true;
+            }
+
+            return bvh.intersect(
+                r, ray_t,
+                [&](std::uint32_t first, std::uint32_t count,
+                    Interval &t) {
+                    bool hit_anything = false;
+                    for (auto k = first; k < first + count; k++) {
+                        if (primitive_ref(primitives[k]).hit(r, t, rec)) {
+                            hit_anything = true;
+                            t.max = rec.t;
+                        }
+                    }
+                    return hit_anything;
+                },
+                stats);
+        }
+
+        Aabb bounding_box() const override {
+            return bvh.bounding_box();
+        }
+
+        unsigned material_kinds() const override {
+            return kinds;
+        }
+
+        const FlatBvh &tree() const {
+            return bvh;
+        }
+
+    private:
+        FlatBvh bvh;
+        std::vector<Primitive> primitives;
+        unsigned kinds = 0;
+
+        static std::vector<Primitive> collect(const HittableList &list) {
+            std::vector<Primitive> objects;
+            objects.reserve(list.objects.size());
+            for (const auto &object : list.objects) {
+                if constexpr (std::is_same_v<Primitive, shared_ptr<Hittable>>) {
+                    objects.push_back(object);
+                } else {
+                    auto typed = dynamic_cast<const Primitive *>(object.get());
+                    if (!typed) {
+                        throw std::invalid_argument(
+                            "BvhAggregate: unexpected primitive type");
+                    }
+                    objects.push_back(*typed);
+                }
+            }
+            return objects;
+        }
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "color.hpp"
+
+#include <vector>
+
+/**
+ * Linear RGB image in single precision, row-major from the top left
+ * pixel. Render workers write disjoint pixels, so no locking is needed.
+ */
+class Framebuffer {
+    public:
+        Framebuffer() {
+        }
+
+        Framebuffer(int width, int height)
+            : w(width), h(height), rgb(size_t(width) * height * 3, 0.0f) {
+        }
+
+        int width() const {
+            return w;
+        }
+        int height() const {
+            return h;
+        }
+
+        Color pixel(int i, int j) const {
+            auto k = index(i, j);
+            return Color(rgb[k], rgb[k + 1], rgb[k + 2]);
+        }
+
+        void set_pixel(int i, int j, const Color &c) {
+            auto k = index(i, j);
+            rgb[k] = float(c.x());
+            rgb[k + 1] = float(c.y());
+            rgb[k + 2] = float(c.z());
+        }
+
+        // Interleaved r, g, b floats
+        const float *data() const {
+            return rgb.data();
+        }
+        float *data() {
+            return rgb.data();
+        }
+
+    private:
+        int w = 0;
+        int h = 0;
+        std::vector<float> rgb;
+
+        size_t index(int i, int j) const {
+            return (size_t(j) * w + i) * 3;
+        }
+};
+
+#endif
@@ -5,27 +5,48 @@
 #include "ray.hpp"
 #include "vec3.hpp"
 #include "interval.hpp"
+#include "aabb.hpp"
 
 class Material;
 
+// Materials are owned by the scene; the record only borrows a handle, so
+// filling one in never touches a reference count
 struct hit_record {
         Point3 p;
         Vec3 normal;
-        shared_ptr<Material> mat;
-        double t;
+        const Material *mat;
+        Real t;
         bool front_face;
 
         void set_face_normal(const Ray &r, const Vec3 &outward_normal) {
             front_face = dot(r.direction(), outward_normal) < 0;
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        // Ray leaving the hit point in direction dir at the time of r_in.
+        // Its origin is nudged off the surface toward the side dir points
+        // to.
+        Ray spawn_ray(const Ray &r_in, const Vec3 &dir) const {
+            auto side = dot(dir, normal) > 0 ? normal : -normal;
+            return Ray(offset_ray_origin(p, side), dir, r_in.time());
+        }
 };
 
 class Hittable {
     public:
+        // Leaves the record untouched unless it returns true
         virtual bool hit(const Ray &r, Interval ray_t,
                          hit_record &record) const = 0;
 
+        virtual Aabb bounding_box() const = 0;
+
+        // Bit set of the MaterialKinds of the surfaces, bit 1 << kind for
+        // each kind; all bits when unknown. Lets Camera pick a render
+        // kernel that only has code for these kinds.
+        virtual unsigned material_kinds() const {
+            return ~0u;
+        }
+
         virtual ~Hittable() = default;
 };
 
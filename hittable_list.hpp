@@ -10,6 +10,8 @@
 using std::make_shared;
 using std::shared_ptr;
 
+// Also the scene builder: freeze() in compiled_scene.hpp packs a finished
+// list into the form that is rendered
 class HittableList : public Hittable {
     public:
         // shared_ptr prevents object slicing
@@ -23,28 +25,43 @@ class HittableList : public Hittable {
 
         void clear() {
             objects.clear();
+            bbox = Aabb();
         }
 
         void add(shared_ptr<Hittable> object) {
             objects.push_back(object);
+            bbox = Aabb(bbox, object->bounding_box());
         }
 
         bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
-            hit_record temp_rec;
             bool any_hits = false;
             auto closest_so_far = ray_t.max;
 
+            // A miss leaves rec alone, so no temporary record is needed
             for (const auto &object : objects) {
-                if (object->hit(r, Interval(ray_t.min, closest_so_far),
-                                temp_rec)) {
+                if (object->hit(r, Interval(ray_t.min, closest_so_far), rec)) {
                     any_hits = true;
-                    closest_so_far = temp_rec.t;
-                    rec = temp_rec;
+                    closest_so_far = rec.t;
                 }
             }
 
             return any_hits;
         }
+
+        Aabb bounding_box() const override {
+            return bbox;
+        }
+
+        unsigned material_kinds() const override {
+            unsigned kinds = 0;
+            for (const auto &object : objects) {
+                kinds |= object->material_kinds();
+            }
+            return kinds;
+        }
+
+    private:
+        Aabb bbox;
 };
 
 #endif
@@ -0,0 +1,103 @@
+#ifndef IMAGE_METRICS_H
+#define IMAGE_METRICS_H
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+// Channel value as displayed: clamped to [0, 1] and gamma encoded
+inline double display_value(float linear) {
+    return linear_to_gamma(std::fmin(std::fmax(double(linear), 0.0), 1.0));
+}
+
+// Root mean square error over all channels of two same-sized images,
+// measured on displayed values so fireflies cannot dominate
+inline double rmse(const Framebuffer &a, const Framebuffer &b) {
+    if (a.width() != b.width() || a.height() != b.height()) {
+        throw std::invalid_argument("rmse: image sizes differ");
+    }
+
+    size_t n = size_t(a.width()) * a.height() * 3;
+    double sum = 0;
+    for (size_t k = 0; k < n; k++) {
+        double d = display_value(a.data()[k]) - display_value(b.data()[k]);
+        sum += d * d;
+    }
+    return std::sqrt(sum / n);
+}
+
+/**
+ * Mean structural similarity of two same-sized images (Wang et al., Image
+ * Quality Assessment: From Error Visibility to Structural Similarity,
+ * 2004), on displayed values with the usual 11x11 Gaussian window of
+ * sigma 1.5, averaged over the channels. 1 for identical images; unlike
+ * rmse it punishes blurred detail more than a uniform error.
+ */
+inline double ssim(const Framebuffer &a, const Framebuffer &b) {
+    if (a.width() != b.width() || a.height() != b.height()) {
+        throw std::invalid_argument("ssim: image sizes differ");
+    }
+
+    const int radius = 5;
+    double kernel[2 * radius + 1], kernel_sum = 0;
+    for (int k = -radius; k <= radius; k++) {
+        kernel[k + radius] = std::exp(-k * k / (2 * 1.5 * 1.5));
+        kernel_sum += kernel[k + radius];
+    }
+    for (auto &weight : kernel) weight /= kernel_sum;
+
+    // Gaussian blur of a plane, renormalized where the window leaves the
+    // image
+    int w = a.width(), h = a.height();
+    auto blur = [&](const std::vector<double> &plane) {
+        std::vector<double> rows(plane.size()), result(plane.size());
+        for (int pass = 0; pass < 2; pass++) {
+            const auto &in = pass == 0 ? plane : rows;
+            auto &out = pass == 0 ? rows : result;
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    double sum = 0, total = 0;
+                    for (int k = -radius; k <= radius; k++) {
+                        int qx = pass == 0 ? x + k : x;
+                        int qy = pass == 0 ? y : y + k;
+                        if (qx < 0 || qx >= w || qy < 0 || qy >= h) continue;
+                        sum += kernel[k + radius] * in[size_t(qy) * w + qx];
+                        total += kernel[k + radius];
+                    }
+                    out[size_t(y) * w + x] = sum / total;
+                }
+            }
+        }
+        return result;
+    };
+
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    auto pixels = size_t(w) * h;
+    double total = 0;
+    std::vector<double> x(pixels), y(pixels), xx(pixels), yy(pixels),
+        xy(pixels);
+    for (int c = 0; c < 3; c++) {
+        for (size_t p = 0; p < pixels; p++) {
+            x[p] = display_value(a.data()[3 * p + c]);
+            y[p] = display_value(b.data()[3 * p + c]);
+            xx[p] = x[p] * x[p];
+            yy[p] = y[p] * y[p];
+            xy[p] = x[p] * y[p];
+        }
+        auto mx = blur(x), my = blur(y);
+        auto sxx = blur(xx), syy = blur(yy), sxy = blur(xy);
+        for (size_t p = 0; p < pixels; p++) {
+            double vx = sxx[p] - mx[p] * mx[p];
+            double vy = syy[p] - my[p] * my[p];
+            double cov = sxy[p] - mx[p] * my[p];
+            total += (2 * mx[p] * my[p] + c1) * (2 * cov + c2) /
+                     ((mx[p] * mx[p] + my[p] * my[p] + c1) * (vx + vy + c2));
+        }
+    }
+    return total / (3 * pixels);
+}
+
+#endif
@@ -0,0 +1,415 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "color.hpp"
+#include "framebuffer.hpp"
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef PALETTE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+enum class ImageFormat { ppm_ascii, ppm_binary, png, pfm };
+
+/**
+ * Where a writer reads the image from, one row at a time, so that images
+ * larger than memory can be encoded as they are read. Rows are asked for
+ * top to bottom, except by PfmWriter, which goes bottom to top.
+ */
+class ImageRows {
+    public:
+        virtual ~ImageRows() = default;
+
+        virtual int width() const = 0;
+        virtual int height() const = 0;
+
+        // Interleaved r, g, b floats of row j, valid until the next call
+        virtual const float *row(int j) = 0;
+};
+
+class FramebufferRows : public ImageRows {
+    public:
+        explicit FramebufferRows(const Framebuffer &image) : image(image) {
+        }
+
+        int width() const override {
+            return image.width();
+        }
+        int height() const override {
+            return image.height();
+        }
+
+        const float *row(int j) override {
+            return image.data() + size_t(j) * image.width() * 3;
+        }
+
+    private:
+        const Framebuffer &image;
+};
+
+// Encodes an image into one image file format
+class ImageWriter {
+    public:
+        virtual ~ImageWriter() = default;
+
+        void write(std::ostream &out, const Framebuffer &image) const {
+            FramebufferRows rows(image);
+            write_rows(out, rows);
+        }
+
+        virtual void write_rows(std::ostream &out, ImageRows &rows) const = 0;
+};
+
+// Plain-text P3, mostly for diffing and debugging
+class PpmAsciiWriter : public ImageWriter {
+    public:
+        void write_rows(std::ostream &out, ImageRows &rows) const override {
+            out << "P3\n"
+                << rows.width() << ' ' << rows.height() << "\n255\n";
+            for (int j = 0; j < rows.height(); j++) {
+                const float *rgb = rows.row(j);
+                for (int i = 0; i < rows.width(); i++) {
+                    write_color(out, Color(rgb[3 * i], rgb[3 * i + 1],
+                                           rgb[3 * i + 2]));
+                }
+            }
+        }
+};
+
+// Shared by the 8-bit formats: gamma encoded, quantized rgb bytes
+inline void quantize_row(const float *rgb, int width, std::uint8_t *bytes) {
+    for (int k = 0; k < width * 3; k++) {
+        bytes[k] = std::uint8_t(color_byte(rgb[k]));
+    }
+}
+
+class PpmBinaryWriter : public ImageWriter {
+    public:
+        void write_rows(std::ostream &out, ImageRows &rows) const override {
+            out << "P6\n"
+                << rows.width() << ' ' << rows.height() << "\n255\n";
+
+            std::vector<std::uint8_t> row(size_t(rows.width()) * 3);
+            for (int j = 0; j < rows.height(); j++) {
+                quantize_row(rows.row(j), rows.width(), row.data());
+                out.write(reinterpret_cast<const char *>(row.data()),
+                          std::streamsize(row.size()));
+            }
+        }
+};
+
+/**
+ * Portable float map: linear, unclamped 32-bit floats for HDR work.
+ * Rows are stored bottom to top and the negative scale marks the data as
+ * little endian.
+ */
+class PfmWriter : public ImageWriter {
+    public:
+        void write_rows(std::ostream &out, ImageRows &rows) const override {
+            out << "PF\n"
+                << rows.width() << ' ' << rows.height() << "\n-1.0\n";
+
+            auto row_bytes = size_t(rows.width()) * 3 * sizeof(float);
+            std::vector<char> row(row_bytes);
+            for (int j = rows.height() - 1; j >= 0; j--) {
+                const float *rgb = rows.row(j);
+                for (size_t k = 0; k < size_t(rows.width()) * 3; k++) {
+                    std::uint32_t bits;
+                    std::memcpy(&bits, &rgb[k], sizeof bits);
+                    for (int b = 0; b < 4; b++) {
+                        row[k * 4 + b] = char((bits >> (8 * b)) & 0xff);
+                    }
+                }
+                out.write(row.data(), std::streamsize(row_bytes));
+            }
+        }
+};
+
+// Reads back what PfmWriter writes, so renders from different builds can be
+// compared at full precision. Only little endian files are accepted.
+inline Framebuffer read_pfm(std::istream &in) {
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    in >> magic >> width >> height >> scale;
+    in.get(); // the single whitespace byte ending the header
+    if (!in || magic != "PF" || width <= 0 || height <= 0 || scale >= 0) {
+        throw std::runtime_error("read_pfm: unsupported header");
+    }
+
+    Framebuffer image(width, height);
+    std::vector<char> row(size_t(width) * 3 * sizeof(float));
+    for (int j = height - 1; j >= 0; j--) {
+        if (!in.read(row.data(), std::streamsize(row.size()))) {
+            throw std::runtime_error("read_pfm: truncated data");
+        }
+        float *rgb = image.data() + size_t(j) * width * 3;
+        for (size_t k = 0; k < size_t(width) * 3; k++) {
+            std::uint32_t bits = 0;
+            for (int b = 0; b < 4; b++) {
+                bits |= std::uint32_t(std::uint8_t(row[k * 4 + b])) << (8 * b);
+            }
+            std::memcpy(&rgb[k], &bits, sizeof bits);
+        }
+    }
+    return image;
+}
+
+/**
+ * 8-bit RGB PNG. Rows use the Sub filter, which suits smooth renders.
+ * The pixel data is deflated with zlib when it is available, otherwise it
+ * is stored in uncompressed deflate blocks. Rows are deflated as they are
+ * read and written out in IDAT chunks of about a megabyte, so the image
+ * never has to be in memory whole.
+ */
+class PngWriter : public ImageWriter {
+    public:
+        int compression_level = 3;
+
+        void write_rows(std::ostream &out, ImageRows &rows) const override {
+            static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                                       '\r', '\n', 0x1a, '\n'};
+            out.write(reinterpret_cast<const char *>(signature), 8);
+
+            std::vector<std::uint8_t> header;
+            put_u32(header, std::uint32_t(rows.width()));
+            put_u32(header, std::uint32_t(rows.height()));
+            header.insert(header.end(), {8, 2, 0, 0, 0}); // 8-bit RGB
+            write_chunk(out, "IHDR", header);
+
+            auto stride = size_t(rows.width()) * 3;
+            std::vector<std::uint8_t> row(stride), filtered(stride + 1);
+            Deflater deflater(out, compression_level);
+            for (int j = 0; j < rows.height(); j++) {
+                quantize_row(rows.row(j), rows.width(), row.data());
+
+                filtered[0] = 1; // Sub: difference to the pixel on the left
+                for (size_t k = 0; k < stride; k++) {
+                    auto left = k >= 3 ? row[k - 3] : 0;
+                    filtered[k + 1] = std::uint8_t(row[k] - left);
+                }
+                deflater.add(filtered.data(), filtered.size());
+            }
+            deflater.finish();
+
+            write_chunk(out, "IEND", {});
+        }
+
+    private:
+        static constexpr size_t idat_size = size_t(1) << 20;
+
+        static void put_u32(std::vector<std::uint8_t> &bytes,
+                            std::uint32_t value) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                bytes.push_back(std::uint8_t(value >> shift));
+            }
+        }
+
+        static std::uint32_t crc32(const std::uint8_t *bytes, size_t size,
+                                   std::uint32_t crc = 0) {
+            static const auto table = [] {
+                std::vector<std::uint32_t> t(256);
+                for (std::uint32_t n = 0; n < 256; n++) {
+                    std::uint32_t c = n;
+                    for (int k = 0; k < 8; k++) {
+                        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                    }
+                    t[n] = c;
+                }
+                return t;
+            }();
+
+            crc = ~crc;
+            for (size_t k = 0; k < size; k++) {
+                crc = table[(crc ^ bytes[k]) & 0xff] ^ (crc >> 8);
+            }
+            return ~crc;
+        }
+
+        static void write_chunk(std::ostream &out, const char *type,
+                                const std::vector<std::uint8_t> &data) {
+            std::vector<std::uint8_t> head;
+            put_u32(head, std::uint32_t(data.size()));
+            head.insert(head.end(), type, type + 4);
+
+            auto crc = crc32(head.data() + 4, 4);
+            crc = crc32(data.data(), data.size(), crc);
+
+            std::vector<std::uint8_t> tail;
+            put_u32(tail, crc);
+
+            out.write(reinterpret_cast<const char *>(head.data()), 8);
+            out.write(reinterpret_cast<const char *>(data.data()),
+                      std::streamsize(data.size()));
+            out.write(reinterpret_cast<const char *>(tail.data()), 4);
+        }
+
+        // The zlib stream of the IDAT chunks, fed a row at a time. Full
+        // chunks are written as they fill up, the rest by finish().
+        class Deflater {
+            public:
+                Deflater(std::ostream &out, int level) : out(out) {
+#ifdef PALETTE_HAVE_ZLIB
+                    if (deflateInit(&stream, level) != Z_OK) {
+                        throw std::runtime_error(
+                            "PngWriter: zlib compression failed");
+                    }
+#else
+                    (void)level;
+                    packed = {0x78, 0x01};
+#endif
+                }
+
+                Deflater(const Deflater &) = delete;
+                Deflater &operator=(const Deflater &) = delete;
+
+                ~Deflater() {
+#ifdef PALETTE_HAVE_ZLIB
+                    deflateEnd(&stream);
+#endif
+                }
+
+                void add(const std::uint8_t *bytes, size_t size) {
+#ifdef PALETTE_HAVE_ZLIB
+                    stream.next_in = const_cast<std::uint8_t *>(bytes);
+                    stream.avail_in = uInt(size);
+                    while (stream.avail_in > 0) {
+                        run(Z_NO_FLUSH);
+                    }
+#else
+                    // Stored blocks of at most 65535 bytes; a full block
+                    // is only written once more data shows it is not the
+                    // last
+                    for (size_t k = 0; k < size; k++) {
+                        if (block.size() == 0xffff) store_block(false);
+                        block.push_back(bytes[k]);
+                        a = (a + bytes[k]) % 65521;
+                        b = (b + a) % 65521;
+                    }
+#endif
+                    flush_chunks(false);
+                }
+
+                void finish() {
+#ifdef PALETTE_HAVE_ZLIB
+                    while (run(Z_FINISH) != Z_STREAM_END) {
+                    }
+#else
+                    store_block(true);
+                    put_u32(packed, (b << 16) | a);
+#endif
+                    flush_chunks(true);
+                }
+
+            private:
+                std::ostream &out;
+                std::vector<std::uint8_t> packed; // not yet in a chunk
+#ifdef PALETTE_HAVE_ZLIB
+                z_stream stream{};
+
+                int run(int flush) {
+                    std::uint8_t buffer[1 << 16];
+                    stream.next_out = buffer;
+                    stream.avail_out = sizeof buffer;
+                    int status = deflate(&stream, flush);
+                    if (status == Z_STREAM_ERROR) {
+                        throw std::runtime_error(
+                            "PngWriter: zlib compression failed");
+                    }
+                    packed.insert(packed.end(), buffer,
+                                  buffer + sizeof buffer - stream.avail_out);
+                    return status;
+                }
+#else
+                std::vector<std::uint8_t> block;
+                std::uint32_t a = 1, b = 0; // adler32
+
+                void store_block(bool last) {
+                    auto len = std::uint16_t(block.size());
+                    packed.push_back(last ? 1 : 0);
+                    packed.push_back(std::uint8_t(len));
+                    packed.push_back(std::uint8_t(len >> 8));
+                    packed.push_back(std::uint8_t(~len));
+                    packed.push_back(std::uint8_t(~len >> 8));
+                    packed.insert(packed.end(), block.begin(), block.end());
+                    block.clear();
+                }
+#endif
+
+                void flush_chunks(bool all) {
+                    if (!all && packed.size() < idat_size) return;
+                    write_chunk(out, "IDAT", packed);
+                    packed.clear();
+                }
+        };
+};
+
+inline std::unique_ptr<ImageWriter> make_image_writer(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::ppm_ascii:
+        return std::make_unique<PpmAsciiWriter>();
+    case ImageFormat::png:
+        return std::make_unique<PngWriter>();
+    case ImageFormat::pfm:
+        return std::make_unique<PfmWriter>();
+    default:
+        return std::make_unique<PpmBinaryWriter>();
+    }
+}
+
+// .ppm is written as binary P6; anything unrecognized is an error
+inline ImageFormat format_from_path(const std::string &path) {
+    auto ends_with = [&](const char *suffix) {
+        auto n = std::strlen(suffix);
+        return path.size() >= n &&
+               path.compare(path.size() - n, n, suffix) == 0;
+    };
+
+    if (ends_with(".ppm")) return ImageFormat::ppm_binary;
+    if (ends_with(".png")) return ImageFormat::png;
+    if (ends_with(".pfm")) return ImageFormat::pfm;
+    throw std::invalid_argument("unknown image format: " + path);
+}
+
+inline void save_image(const std::string &path, ImageRows &rows) {
+    PALETTE_PROFILE_SCOPE(output);
+    auto writer = make_image_writer(format_from_path(path));
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("cannot open " + path + " for writing");
+    }
+    writer->write_rows(out, rows);
+    // A full disk shows up only once the buffered bytes are pushed out
+    out.close();
+    if (!out) {
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+inline void save_image(const std::string &path, const Framebuffer &image) {
+    FramebufferRows rows(image);
+    save_image(path, rows);
+}
+
+// Encodes and writes on a separate thread so rendering can carry on
+inline std::future<void> save_image_async(std::string path,
+                                          Framebuffer image) {
+    return std::async(std::launch::async,
+                      [path = std::move(path), image = std::move(image)] {
+                          save_image(path, image);
+                      });
+}
+
+#endif
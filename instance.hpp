@@ -0,0 +1,335 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "common.hpp"
+#include "aabb.hpp"
+#include "flat_bvh.hpp"
+#include "hittable.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Affine map from an object's space to world space, kept together with
+ * its inverse. Built up from translate, scale and rotate with operator*,
+ * which applies the right-hand side first.
+ */
+class Transform {
+    public:
+        // The identity
+        Transform() {
+            for (int row = 0; row < 3; row++) {
+                for (int col = 0; col < 4; col++) {
+                    fwd[row][col] = inv[row][col] = row == col ? 1 : 0;
+                }
+            }
+        }
+
+        static Transform translate(const Vec3 &offset) {
+            Transform t;
+            for (int row = 0; row < 3; row++) {
+                t.fwd[row][3] = offset[row];
+                t.inv[row][3] = -double(offset[row]);
+            }
+            return t;
+        }
+
+        static Transform scale(double factor) {
+            return scale(Vec3(factor, factor, factor));
+        }
+
+        static Transform scale(const Vec3 &factors) {
+            Transform t;
+            for (int axis = 0; axis < 3; axis++) {
+                if (factors[axis] == 0) {
+                    throw std::invalid_argument("Transform: zero scale");
+                }
+                t.fwd[axis][axis] = factors[axis];
+                t.inv[axis][axis] = 1 / double(factors[axis]);
+            }
+            return t;
+        }
+
+        // Counterclockwise about axis, looking down it toward the origin
+        static Transform rotate(const Vec3 &axis, double degrees) {
+            auto a = Vec3T<double>(unit_vector(axis));
+            auto theta = degrees_to_radians(degrees);
+            auto c = std::cos(theta), s = std::sin(theta), k = 1 - c;
+
+            double m[3][3] = {
+                {c + a[0] * a[0] * k, a[0] * a[1] * k - a[2] * s,
+                 a[0] * a[2] * k + a[1] * s},
+                {a[1] * a[0] * k + a[2] * s, c + a[1] * a[1] * k,
+                 a[1] * a[2] * k - a[0] * s},
+                {a[2] * a[0] * k - a[1] * s, a[2] * a[1] * k + a[0] * s,
+                 c + a[2] * a[2] * k}};
+
+            // Rotations are orthogonal, so the inverse is the transpose
+            Transform t;
+            for (int row = 0; row < 3; row++) {
+                for (int col = 0; col < 3; col++) {
+                    t.fwd[row][col] = m[row][col];
+                    t.inv[row][col] = m[col][row];
+                }
+            }
+            return t;
+        }
+
+        // Applies other first, then this
+        Transform operator*(const Transform &other) const {
+            Transform t;
+            compose(fwd, other.fwd, t.fwd);
+            compose(other.inv, inv, t.inv);
+            return t;
+        }
+
+        Transform inverse() const {
+            Transform t;
+            std::copy(&inv[0][0], &inv[0][0] + 12, &t.fwd[0][0]);
+            std::copy(&fwd[0][0], &fwd[0][0] + 12, &t.inv[0][0]);
+            return t;
+        }
+
+        Point3 point(const Point3 &p) const {
+            return apply(fwd, p, 1);
+        }
+
+        Vec3 vector(const Vec3 &v) const {
+            return apply(fwd, v, 0);
+        }
+
+        // Normals go through the inverse transpose to stay perpendicular
+        Vec3 normal(const Vec3 &n) const {
+            return apply_transposed(inv, n);
+        }
+
+        Ray to_object(const Ray &r) const {
+            return Ray(apply(inv, r.origin(), 1), apply(inv, r.direction(), 0),
+                       r.time());
+        }
+
+        // World box of the eight transformed corners of box
+        Aabb box(const Aabb &box) const {
+            Aabb result;
+            for (int corner = 0; corner < 8; corner++) {
+                Point3 p((corner & 1 ? box.x.max : box.x.min),
+                         (corner & 2 ? box.y.max : box.y.min),
+                         (corner & 4 ? box.z.max : box.z.min));
+                auto q = point(p);
+                result = Aabb(result, Aabb(q, q));
+            }
+            return result;
+        }
+
+        // Rows of the object-from-world matrix, for compact storage
+        const double (&inverse_matrix() const)[3][4] {
+            return inv;
+        }
+
+    private:
+        double fwd[3][4]; // object to world
+        double inv[3][4]; // world to object
+
+        static void compose(const double a[3][4], const double b[3][4],
+                            double out[3][4]) {
+            for (int row = 0; row < 3; row++) {
+                for (int col = 0; col < 4; col++) {
+                    double sum = col == 3 ? a[row][3] : 0;
+                    for (int k = 0; k < 3; k++) {
+                        sum += a[row][k] * b[k][col];
+                    }
+                    out[row][col] = sum;
+                }
+            }
+        }
+
+        template <typename Matrix>
+        static Vec3 apply(const Matrix &m, const Vec3 &v, double w) {
+            double out[3];
+            for (int row = 0; row < 3; row++) {
+                out[row] = m[row][0] * double(v[0]) + m[row][1] * double(v[1]) +
+                           m[row][2] * double(v[2]) + m[row][3] * w;
+            }
+            return Vec3(out[0], out[1], out[2]);
+        }
+
+        template <typename Matrix>
+        static Vec3 apply_transposed(const Matrix &m, const Vec3 &v) {
+            double out[3];
+            for (int col = 0; col < 3; col++) {
+                out[col] = m[0][col] * double(v[0]) + m[1][col] * double(v[1]) +
+                           m[2][col] * double(v[2]);
+            }
+            return Vec3(out[0], out[1], out[2]);
+        }
+
+        friend class InstanceSet;
+};
+
+// Moves a hit found on an object-space ray back to world space. t carries
+// over because the direction is transformed without normalizing.
+template <typename Normal>
+void hit_to_world(const Ray &r, Normal &&to_world_normal, hit_record &rec) {
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(to_world_normal(rec.normal));
+}
+
+/**
+ * A shared object, typically an aggregate of its own, placed in the world
+ * by a transform. Many instances can refer to one prototype. Instances in
+ * a HittableList end up in the top level BvhAggregate of a CompiledScene,
+ * above the prototypes' own hierarchies.
+ */
+class Instance : public Hittable {
+    public:
+        Instance(shared_ptr<Hittable> prototype, const Transform &to_world)
+            : prototype(prototype), to_world(to_world),
+              bbox(to_world.box(prototype->bounding_box())) {
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            if (!prototype->hit(to_world.to_object(r), ray_t, rec)) {
+                return false;
+            }
+            hit_to_world(
+                r, [&](const Vec3 &n) { return to_world.normal(n); }, rec);
+            return true;
+        }
+
+        Aabb bounding_box() const override {
+            return bbox;
+        }
+
+        unsigned material_kinds() const override {
+            return prototype->material_kinds();
+        }
+
+    private:
+        shared_ptr<Hittable> prototype;
+        Transform to_world;
+        Aabb bbox;
+};
+
+/**
+ * Two-level hierarchy for scenes with millions of instances. Each instance
+ * is only a prototype index and its world-to-object matrix in floats, 52
+ * bytes, under one FlatBvh; the prototypes keep their own hierarchies.
+ * Instance boxes are only needed while building, so add() collects them
+ * and build() drops them.
+ */
+class InstanceSet : public Hittable {
+    public:
+        // Returns the index to pass to add()
+        std::uint32_t add_prototype(shared_ptr<Hittable> prototype) {
+            prototype_boxes.push_back(prototype->bounding_box());
+            prototypes.push_back(std::move(prototype));
+            return std::uint32_t(prototypes.size() - 1);
+        }
+
+        void add(std::uint32_t prototype, const Transform &to_world) {
+            if (prototype >= prototypes.size()) {
+                throw std::out_of_range("InstanceSet: no such prototype");
+            }
+
+            Record record;
+            for (int row = 0; row < 3; row++) {
+                for (int col = 0; col < 4; col++) {
+                    record.to_object[row][col] = float(to_world.inv[row][col]);
+                }
+            }
+            record.prototype = prototype;
+            records.push_back(record);
+            boxes.push_back(to_world.box(prototype_boxes[prototype]));
+        }
+
+        void reserve(size_t count) {
+            records.reserve(count);
+            boxes.reserve(count);
+        }
+
+        // Builds the top level; call once every instance has been added
+        void build() {
+            bvh.build(boxes);
+
+            std::vector<Record> ordered;
+            ordered.reserve(records.size());
+            for (auto k : bvh.primitive_order()) {
+                ordered.push_back(records[k]);
+            }
+            records = std::move(ordered);
+            boxes = std::vector<Aabb>();
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            const Record *closest = nullptr;
+            bvh.intersect(r, ray_t,
+                          [&](std::uint32_t first, std::uint32_t count,
+                              Interval &t) {
+                              bool hit_anything = false;
+                              for (auto k = first; k < first + count; k++) {
+                                  const auto &record = records[k];
+                                  Ray local(
+                                      Transform::apply(record.to_object,
+                                                       r.origin(), 1),
+                                      Transform::apply(record.to_object,
+                                                       r.direction(), 0),
+                                      r.time());
+                                  if (prototypes[record.prototype]->hit(
+                                          local, t, rec)) {
+                                      hit_anything = true;
+                                      closest = &record;
+                                      t.max = rec.t;
+                                  }
+                              }
+                              return hit_anything;
+                          });
+            if (!closest) return false;
+
+            hit_to_world(
+                r,
+                [&](const Vec3 &n) {
+                    return Transform::apply_transposed(closest->to_object, n);
+                },
+                rec);
+            return true;
+        }
+
+        Aabb bounding_box() const override {
+            return bvh.bounding_box();
+        }
+
+        size_t size() const {
+            return records.size();
+        }
+
+        size_t prototype_count() const {
+            return prototypes.size();
+        }
+
+        unsigned material_kinds() const override {
+            unsigned kinds = 0;
+            for (const auto &prototype : prototypes) {
+                kinds |= prototype->material_kinds();
+            }
+            return kinds;
+        }
+
+    private:
+        struct Record {
+                float to_object[3][4];
+                std::uint32_t prototype;
+        };
+
+        static_assert(sizeof(Record) == 52, "instances must stay small");
+
+        std::vector<shared_ptr<Hittable>> prototypes;
+        std::vector<Aabb> prototype_boxes;
+        std::vector<Record> records;
+        std::vector<Aabb> boxes; // until build()
+        FlatBvh bvh;
+};
+
+#endif
@@ -4,38 +4,53 @@
 #include "common.hpp"
 #include <memory>
 
-class Interval {
+template <typename T>
+class IntervalT {
     public:
-        double min, max;
+        T min, max;
 
-        Interval() : min(+infinity), max(-infinity) {
+        IntervalT() : min(+infinity), max(-infinity) {
         }
 
-        Interval(double min, double max) : min(min), max(max) {
+        IntervalT(T min, T max) : min(min), max(max) {
         }
 
-        double size() const {
+        // Tightest interval enclosing both a and b
+        IntervalT(const IntervalT &a, const IntervalT &b)
+            : min(std::fmin(a.min, b.min)), max(std::fmax(a.max, b.max)) {
+        }
+
+        T size() const {
             return max - min;
         }
 
-        bool contains(double x) const {
+        bool contains(T x) const {
             return min <= x && x <= max;
         }
 
-        bool surrounds(double x) const {
+        bool surrounds(T x) const {
             return min < x && x < max;
         }
 
-        double clamp(double x) const {
+        T clamp(T x) const {
             if (x < min) return min;
             if (x > max) return max;
             return x;
         }
 
-        static const Interval empty, universe;
+        IntervalT expand(T delta) const {
+            auto padding = delta / 2;
+            return IntervalT(min - padding, max + padding);
+        }
+
+        static const IntervalT empty, universe;
 };
 
-const Interval Interval::empty = Interval(+infinity, -infinity);
-const Interval Interval::universe = Interval(-infinity, +infinity);
+template <typename T>
+const IntervalT<T> IntervalT<T>::empty = IntervalT(+infinity, -infinity);
+template <typename T>
+const IntervalT<T> IntervalT<T>::universe = IntervalT(-infinity, +infinity);
+
+using Interval = IntervalT<Real>;
 
 #endif
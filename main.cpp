@@ -1,75 +1,352 @@
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <string>
 
-#include "vec3.hpp"
 #include "common.hpp"
+#include "animation.hpp"
 #include "camera.hpp"
-#include "hittable.hpp"
+#include "compiled_scene.hpp"
+#include "denoiser.hpp"
+#include "distributed.hpp"
 #include "hittable_list.hpp"
-#include "material.hpp"
+#include "profile.hpp"
+#include "progressive.hpp"
+#include "render_server.hpp"
+#include "scene_file.hpp"
+#include "scenes.hpp"
 #include "sphere.hpp"
-#include "color.hpp"
-
-int main() {
-    HittableList world;
-
-    auto ground_material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
-    world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            Point3 center(a + 0.9 * random_double(), 0.2,
-                          b + 0.9 * random_double());
-
-            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<Material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = Color::random() * Color::random();
-                    sphere_material = make_shared<Lambertian>(albedo);
-                    world.add(
-                        make_shared<Sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // Metal
-                    auto albedo = Color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<Metal>(albedo, fuzz);
-                    world.add(
-                        make_shared<Sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<Dielectric>(1.5);
-                    world.add(
-                        make_shared<Sphere>(center, 0.2, sphere_material));
-                }
+#include "tiled_framebuffer.hpp"
+#include "wavefront.hpp"
+
+// Lets Ctrl-C and kill stop --serve cleanly, removing its socket
+static RenderServer *running_server = nullptr;
+
+static void stop_server(int) {
+    if (running_server) running_server->stop();
+}
+
+// out.png becomes out_0007.png for frame 7
+static std::string frame_path(const std::string &path, int frame) {
+    char number[16];
+    std::snprintf(number, sizeof number, "_%04d", frame);
+    auto dot = path.find_last_of('.');
+    auto slash = path.find_last_of('/');
+    if (dot == std::string::npos ||
+        (slash != std::string::npos && dot < slash)) {
+        return path + number;
+    }
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+// Renders through a tile file and encodes the image from it band by band,
+// so neither step holds the whole image
+static void render_out_of_core(Camera &cam, const Hittable &world,
+                               const std::string &tile_file,
+                               const std::string &output) {
+    // 64 x 64 float RGB tiles are whole pages, so the file has no padding
+    cam.tile_size = 64;
+    cam.initialize();
+    TiledFramebuffer image(tile_file, cam.image_width, cam.height(),
+                           cam.tile_size);
+    // The mapping keeps the space until exit, so nothing is left behind
+    std::remove(tile_file.c_str());
+
+    cam.render_image(world, image);
+    auto rows = image.rows();
+    if (output.empty()) {
+        PALETTE_PROFILE_SCOPE(output);
+        PpmBinaryWriter().write_rows(std::cout, rows);
+    } else {
+        save_image(output, rows);
+    }
+}
+
+static void usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options] [scene] [output]\n"
+              << "  scene                 .scene or .bscene file; the book's "
+                 "final scene if omitted\n"
+              << "  output                .ppm, .png or .pfm; binary PPM to "
+                 "stdout if omitted\n"
+              << "  --checkpoint <file>   render progressively, resuming "
+                 "from <file>\n"
+              << "  --preview <file>      write the image after every pass\n"
+              << "  --pass-samples <n>    samples per pixel per pass\n"
+              << "  --wavefront           trace paths in batches, one bounce "
+                 "at a time\n"
+              << "  --processes <n>       render tiles in n worker "
+                 "processes\n"
+              << "  --profile <file>      time render phases and write a "
+                 "Chrome trace\n"
+              << "  --sampler <name>      independent, stratified or sobol\n"
+              << "  --samples <n>         samples per pixel, overriding the "
+                 "scene's\n"
+              << "  --width <n>           image width, overriding the "
+                 "scene's\n"
+              << "  --tile-file <file>    render through a memory-mapped "
+                 "file of tiles, for images\n"
+              << "                        larger than memory; the file is "
+                 "removed when done\n"
+              << "  --denoise             filter the noise out, guided by "
+                 "albedo, normal and\n"
+              << "                        depth buffers; 32 to 64 samples "
+                 "are then enough\n"
+              << "  --serve <socket>      keep scenes loaded and render jobs "
+                 "sent to <socket>\n"
+              << "  --connect <socket>    render on the server at <socket>\n"
+              << "  --frames <n>          render n frames of the book's scene "
+                 "in motion,\n"
+              << "                        numbering the output files\n";
+    std::exit(1);
+}
+
+int main(int argc, char **argv) {
+    std::string scene_path;
+    std::string output;
+    ProgressiveRenderer progressive;
+    bool use_progressive = false;
+    bool use_wavefront = false;
+    int processes = 0;
+    std::string trace_path;
+    const char *sampler = nullptr;
+    int samples = 0;
+    int width = 0;
+    std::string tile_file;
+    bool denoise = false;
+    std::string serve_path;
+    std::string connect_path;
+    int frames = 0;
+
+    for (int k = 1; k < argc; k++) {
+        auto option = [&](const char *name) {
+            if (std::strcmp(argv[k], name) != 0) return false;
+            if (k + 1 >= argc) usage(argv[0]);
+            return true;
+        };
+
+        if (option("--checkpoint")) {
+            progressive.checkpoint_path = argv[++k];
+            use_progressive = true;
+        } else if (option("--preview")) {
+            progressive.preview_path = argv[++k];
+            use_progressive = true;
+        } else if (option("--pass-samples")) {
+            progressive.samples_per_pass = std::atoi(argv[++k]);
+            use_progressive = true;
+        } else if (option("--processes")) {
+            processes = std::atoi(argv[++k]);
+            if (processes < 1) usage(argv[0]);
+        } else if (option("--profile")) {
+            trace_path = argv[++k];
+        } else if (option("--sampler")) {
+            sampler = argv[++k];
+        } else if (option("--samples")) {
+            samples = std::atoi(argv[++k]);
+            if (samples < 1) usage(argv[0]);
+        } else if (option("--width")) {
+            width = std::atoi(argv[++k]);
+            if (width < 1) usage(argv[0]);
+        } else if (option("--tile-file")) {
+            tile_file = argv[++k];
+        } else if (option("--serve")) {
+            serve_path = argv[++k];
+        } else if (option("--connect")) {
+            connect_path = argv[++k];
+        } else if (option("--frames")) {
+            frames = std::atoi(argv[++k]);
+            if (frames < 1) usage(argv[0]);
+        } else if (std::strcmp(argv[k], "--wavefront") == 0) {
+            use_wavefront = true;
+        } else if (std::strcmp(argv[k], "--denoise") == 0) {
+            denoise = true;
+        } else if (argv[k][0] == '-') {
+            usage(argv[0]);
+        } else if (is_scene_path(argv[k]) && scene_path.empty() &&
+                   output.empty()) {
+            scene_path = argv[k];
+        } else if (!output.empty()) {
+            usage(argv[0]);
+        } else {
+            output = argv[k];
+        }
+    }
+
+    // An output the writers cannot encode is refused before rendering
+    if (!output.empty()) {
+        try {
+            format_from_path(output);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    }
+
+    if (!serve_path.empty()) {
+        try {
+            RenderServer server(serve_path);
+            running_server = &server;
+            std::signal(SIGINT, stop_server);
+            std::signal(SIGTERM, stop_server);
+            server.serve();
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!connect_path.empty()) {
+        RenderJob job;
+        // The server resolves relative paths from its own directory
+        char resolved[PATH_MAX];
+        if (!scene_path.empty()) {
+            job.scene = ::realpath(scene_path.c_str(), resolved)
+                            ? resolved
+                            : scene_path;
+        }
+        if (sampler) {
+            SamplerKind kind;
+            if (!sampler_from_name(sampler, kind)) usage(argv[0]);
+            job.camera.sampler = kind;
+        }
+        if (samples > 0) job.camera.samples_per_pixel = samples;
+        if (width > 0) job.camera.image_width = width;
+
+        try {
+            Framebuffer image = RenderClient(connect_path).render(job);
+            if (output.empty()) {
+                PpmBinaryWriter().write(std::cout, image);
+            } else {
+                save_image(output, image);
             }
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
         }
+        return 0;
     }
 
-    auto material1 = make_shared<Dielectric>(1.5);
-    world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+    if (frames > 0) {
+        if (output.empty() || !scene_path.empty()) usage(argv[0]);
+
+        auto world = bouncing_spheres_scene();
+        Camera cam = random_spheres_camera();
+        if (sampler && !sampler_from_name(sampler, cam.sampler)) {
+            usage(argv[0]);
+        }
+        if (samples > 0) cam.samples_per_pixel = samples;
+        if (width > 0) cam.image_width = width;
+        std::string why;
+        if (auto setting = cam.invalid_setting(why)) {
+            std::cerr << setting << why << '\n';
+            return 1;
+        }
+
+        AnimationRenderer animation;
+        animation.frame_count = frames;
+        auto save_frame = [&](int frame, const Framebuffer &image) {
+            save_image(frame_path(output, frame), image);
+            const auto &stats = animation.frame_stats().back();
+            std::clog << "Frame " << frame << ": "
+                      << (stats.rebuilt ? "rebuilt" : "refitted") << " in "
+                      << 1e3 * stats.update_seconds << " ms, rendered in "
+                      << stats.render_seconds << " s\n";
+        };
+        try {
+            animation.render(cam, *world, save_frame);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
-    auto material2 = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-    world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+    HittableList scene = random_spheres_scene();
+    Camera cam = random_spheres_camera();
+    if (!scene_path.empty()) {
+        try {
+            auto loaded = load_scene(scene_path);
+            scene = std::move(loaded.world);
+            cam = loaded.camera;
+            progressive.scene_key = loaded.key;
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    }
+    if (sampler && !sampler_from_name(sampler, cam.sampler)) {
+        usage(argv[0]);
+    }
+    if (samples > 0) {
+        cam.samples_per_pixel = samples;
+    }
+    if (width > 0) {
+        cam.image_width = width;
+    }
+    std::string why;
+    if (auto setting = cam.invalid_setting(why)) {
+        std::cerr << setting << why << '\n';
+        return 1;
+    }
+    CompiledScene world = freeze(scene);
 
-    auto material3 = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+    if (denoise && (use_progressive || use_wavefront || processes > 0)) {
+        std::cerr << "--denoise needs the default renderer\n";
+        return 1;
+    }
+    if (!tile_file.empty() &&
+        (denoise || use_progressive || use_wavefront || processes > 0)) {
+        std::cerr << "--tile-file needs the default renderer without "
+                     "--denoise\n";
+        return 1;
+    }
+    cam.render_aovs = denoise;
 
-    Camera cam;
+    if (!trace_path.empty() && !profiling_enabled) {
+        std::cerr << "--profile needs a build with PALETTE_PROFILE\n";
+        return 1;
+    }
+    profiler().reset();
 
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 1200;
-    cam.samples_per_pixel = 500;
-    cam.max_depth = 50;
+    DistributedRenderer distributed;
+    distributed.worker_count = processes;
 
-    cam.vfov = 20;
-    cam.lookfrom = Point3(13, 2, 3);
-    cam.lookat = Point3(0, 0, 0);
-    cam.vup = Vec3(0, 1, 0);
+    if (!tile_file.empty()) {
+        try {
+            render_out_of_core(cam, world, tile_file, output);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    } else {
+        try {
+            Framebuffer image =
+                use_progressive ? progressive.render(cam, world)
+                : use_wavefront ? WavefrontRenderer().render(cam, world)
+                : processes > 0 ? distributed.render(cam, world)
+                                : cam.render_image(world);
+            if (denoise) {
+                PALETTE_PROFILE_SCOPE(denoise);
+                image = Denoiser().denoise(image, cam.last_aovs());
+            }
 
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 10.0;
+            if (output.empty()) {
+                PALETTE_PROFILE_SCOPE(output);
+                PpmBinaryWriter().write(std::cout, image);
+            } else {
+                save_image(output, image);
+            }
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    }
 
-    cam.render(world);
+    if (!trace_path.empty()) {
+        profiler().report(std::clog);
+        profiler().write_chrome_trace(trace_path);
+    }
 }
@@ -0,0 +1,125 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A file mapped read-write into memory (POSIX). Opening an existing file
+ * maps it at its current size; creating one sizes it first. Writes land
+ * in the page cache and reach the disk on sync() or when unmapped.
+ */
+class MappedFile {
+    public:
+        MappedFile() {
+        }
+
+        // Maps an existing file, or creates one of `size` bytes if the
+        // file is missing or has a different size. Delegating makes the
+        // object whole first, so the destructor closes fd if a step fails.
+        MappedFile(const std::string &path, size_t size) : MappedFile() {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0) fail("open", path);
+
+            struct stat info;
+            if (::fstat(fd, &info) != 0) fail("stat", path);
+            existed = size_t(info.st_size) == size;
+            if (!existed && ::ftruncate(fd, off_t(size)) != 0) {
+                fail("resize", path);
+            }
+
+            map(path, size, PROT_READ | PROT_WRITE);
+        }
+
+        // Maps an existing file read-only at its current size
+        static MappedFile open_read_only(const std::string &path) {
+            MappedFile file;
+            file.fd = ::open(path.c_str(), O_RDONLY);
+            if (file.fd < 0) fail("open", path);
+
+            struct stat info;
+            if (::fstat(file.fd, &info) != 0) fail("stat", path);
+            file.existed = true;
+            file.map(path, size_t(info.st_size), PROT_READ);
+            return file;
+        }
+
+        MappedFile(MappedFile &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        MappedFile &operator=(MappedFile &&other) noexcept {
+            std::swap(fd, other.fd);
+            std::swap(bytes, other.bytes);
+            std::swap(length, other.length);
+            std::swap(existed, other.existed);
+            return *this;
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile() {
+            if (bytes) ::munmap(bytes, length);
+            if (fd >= 0) ::close(fd);
+        }
+
+        char *data() const {
+            return static_cast<char *>(bytes);
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        // True when the file was already there at the requested size
+        bool reused() const {
+            return existed;
+        }
+
+        // Blocks until [offset, offset + count) is on disk
+        void sync(size_t offset, size_t count) const {
+            // msync wants a page-aligned start
+            auto page = size_t(::sysconf(_SC_PAGESIZE));
+            auto start = offset / page * page;
+            ::msync(data() + start, offset + count - start, MS_SYNC);
+        }
+
+        void sync() const {
+            if (bytes) ::msync(bytes, length, MS_SYNC);
+        }
+
+    private:
+        int fd = -1;
+        void *bytes = nullptr;
+        size_t length = 0;
+        bool existed = false;
+
+        void map(const std::string &path, size_t size, int protection) {
+            length = size;
+            if (size == 0) return;
+
+            bytes = ::mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+            if (bytes == MAP_FAILED) {
+                bytes = nullptr;
+                fail("map", path);
+            }
+        }
+
+        [[noreturn]] static void fail(const char *what,
+                                      const std::string &path) {
+            throw std::runtime_error(std::string("cannot ") + what + " " +
+                                     path + ": " + std::strerror(errno));
+        }
+};
+
+#endif
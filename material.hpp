@@ -3,24 +3,88 @@
 
 #include "hittable.hpp"
 #include "color.hpp"
+#include "profile.hpp"
 
+// Lets batch renderers group hits that run the same scatter code
+enum class MaterialKind { lambertian, metal, dielectric };
+
+constexpr int material_kind_count = 3;
+
+// Bits of Hittable::material_kinds
+constexpr unsigned material_bit(MaterialKind kind) {
+    return 1u << int(kind);
+}
+
+constexpr unsigned all_material_kinds = (1u << material_kind_count) - 1;
+
+/**
+ * Materials are small tagged values rather than a class hierarchy: scatter
+ * switches on the kind instead of going through a vtable, and a compiled
+ * scene can copy them into one contiguous array. The subclasses below
+ * only provide the constructors.
+ */
 class Material {
     public:
-        virtual ~Material() = default;
+        MaterialKind kind() const {
+            return tag;
+        }
 
-        virtual bool scatter(const Ray &r_in, const hit_record &rec,
-                             Color &attenuation, Ray &scattered) const {
-            return false;
+        const Color &albedo() const {
+            return alb;
         }
-};
 
-class Lambertian : public Material {
-    public:
-        Lambertian(const Color &albedo) : albedo(albedo) {
+        // Fuzz of a metal, refraction index of a dielectric
+        double parameter() const {
+            return param;
         }
 
         bool scatter(const Ray &r_in, const hit_record &rec, Color &attenuation,
-                     Ray &scattered) const override {
+                     Ray &scattered) const {
+            return scatter_as<all_material_kinds>(r_in, rec, attenuation,
+                                                  scattered);
+        }
+
+        // scatter for a material known to be one of the kinds in Kinds, a
+        // set of material_bit values. Only those kinds are tested for, and
+        // the last one is not tested at all, so a kernel for scenes of one
+        // kind calls its scatter code directly.
+        template <unsigned Kinds>
+        bool scatter_as(const Ray &r_in, const hit_record &rec,
+                        Color &attenuation, Ray &scattered) const {
+            static_assert((Kinds & all_material_kinds) != 0,
+                          "scatter_as needs a material kind");
+            PALETTE_PROFILE_SCOPE(scatter);
+            constexpr auto lambertian = material_bit(MaterialKind::lambertian);
+            constexpr auto metal = material_bit(MaterialKind::metal);
+            constexpr auto dielectric = material_bit(MaterialKind::dielectric);
+
+            if constexpr ((Kinds & lambertian) != 0) {
+                if ((Kinds & (metal | dielectric)) == 0 ||
+                    tag == MaterialKind::lambertian) {
+                    return scatter_lambertian(r_in, rec, attenuation,
+                                              scattered);
+                }
+            }
+            if constexpr ((Kinds & metal) != 0) {
+                if ((Kinds & dielectric) == 0 || tag == MaterialKind::metal) {
+                    return scatter_metal(r_in, rec, attenuation, scattered);
+                }
+            }
+            return scatter_dielectric(r_in, rec, attenuation, scattered);
+        }
+
+    protected:
+        Material(MaterialKind tag, const Color &albedo, double parameter)
+            : tag(tag), alb(albedo), param(parameter) {
+        }
+
+    private:
+        MaterialKind tag;
+        Color alb;
+        double param;
+
+        bool scatter_lambertian(const Ray &r_in, const hit_record &rec,
+                                Color &attenuation, Ray &scattered) const {
             auto scatter_direction = rec.normal + random_unit_vector();
 
             // prevent degenerate scatter direction
@@ -28,43 +92,26 @@ class Lambertian : public Material {
                 scatter_direction = rec.normal;
             }
 
-            scattered = Ray(rec.p, scatter_direction);
-            attenuation = albedo;
+            scattered = rec.spawn_ray(r_in, scatter_direction);
+            attenuation = alb;
             return true;
         }
 
-    private:
-        Color albedo;
-};
-
-class Metal : public Material {
-    public:
-        Metal(const Color &albedo, double fuzz)
-            : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {
-        }
-
-        bool scatter(const Ray &r_in, const hit_record &rec, Color &attenuation,
-                     Ray &scattered) const override {
+        bool scatter_metal(const Ray &r_in, const hit_record &rec,
+                           Color &attenuation, Ray &scattered) const {
+            auto fuzz = param;
             Vec3 reflected = reflect(r_in.direction(), rec.normal);
             reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-            scattered = Ray(rec.p, reflected);
-            attenuation = albedo;
+            scattered = rec.spawn_ray(r_in, reflected);
+            attenuation = alb;
             return dot(scattered.direction(), rec.normal) > 0;
         }
 
-    private:
-        Color albedo;
-        double fuzz;
-};
-
-class Dielectric : public Material {
-    public:
-        Dielectric(double refraction_index)
-            : refraction_index(refraction_index) {
-        }
+        bool scatter_dielectric(const Ray &r_in, const hit_record &rec,
+                                Color &attenuation, Ray &scattered) const {
+            // https://en.wikipedia.org/wiki/Refractive_index
+            auto refraction_index = param;
 
-        bool scatter(const Ray &r_in, const hit_record &rec, Color &attenuation,
-                     Ray &scattered) const override {
             // Dielectrics absorb no light
             attenuation = Color(1.0, 1.0, 1.0);
             double ri =
@@ -79,22 +126,19 @@ class Dielectric : public Material {
             bool cannot_refract = ri * sin_theta > 1.0;
             Vec3 direction;
 
-            if (cannot_refract ||
-                reflectance(cos_theta, ri) > random_double()) {
+            // Drawn either way so later bounces keep their dimensions
+            auto choice = sample_1d();
+            if (cannot_refract || reflectance(cos_theta, ri) > choice) {
                 // Total internal reflection
                 direction = reflect(unit_direction, rec.normal);
             } else {
                 direction = refract(unit_direction, rec.normal, ri);
             }
 
-            scattered = Ray(rec.p, direction);
+            scattered = rec.spawn_ray(r_in, direction);
             return true;
         }
 
-    private:
-        // https://en.wikipedia.org/wiki/Refractive_index
-        double refraction_index;
-
         // Schlick's approximation for reflectance
         static double reflectance(double cosine, double refraction_index) {
             auto r0 = (1 - refraction_index) / (1 + refraction_index);
@@ -103,4 +147,26 @@ class Dielectric : public Material {
         }
 };
 
+class Lambertian : public Material {
+    public:
+        Lambertian(const Color &albedo)
+            : Material(MaterialKind::lambertian, albedo, 0) {
+        }
+};
+
+class Metal : public Material {
+    public:
+        Metal(const Color &albedo, double fuzz)
+            : Material(MaterialKind::metal, albedo, fuzz < 1 ? fuzz : 1) {
+        }
+};
+
+class Dielectric : public Material {
+    public:
+        Dielectric(double refraction_index)
+            : Material(MaterialKind::dielectric, Color(1.0, 1.0, 1.0),
+                       refraction_index) {
+        }
+};
+
 #endif
@@ -0,0 +1,154 @@
+#ifndef OBJ_FILE_H
+#define OBJ_FILE_H
+
+#include "common.hpp"
+#include "mapped_file.hpp"
+#include "material.hpp"
+#include "triangle_mesh.hpp"
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Wavefront OBJ geometry: `v x y z` vertices and `f` faces, whose corners
+ * may carry /texture/normal references after the vertex number. Negative
+ * numbers count back from the latest vertex, and polygons are split into
+ * triangle fans. Everything else (normals, texture coordinates, groups,
+ * materials) is skipped. The file is mapped and parsed in one pass
+ * without copying lines.
+ */
+namespace obj_format {
+
+class Parser {
+    public:
+        Parser(const std::string &path, const char *begin, const char *end)
+            : path(path), pos(begin), end(end) {
+        }
+
+        void parse(std::vector<Point3> &vertices,
+                   std::vector<std::uint32_t> &indices) {
+            std::vector<std::uint32_t> face;
+
+            while (pos < end) {
+                skip_spaces();
+                if (pos + 1 < end && pos[0] == 'v' && is_space(pos[1])) {
+                    pos++;
+                    auto x = number(), y = number(), z = number();
+                    vertices.emplace_back(x, y, z);
+                } else if (pos + 1 < end && pos[0] == 'f' &&
+                           is_space(pos[1])) {
+                    pos++;
+                    face.clear();
+                    while (true) {
+                        skip_spaces();
+                        if (pos == end || *pos == '\n' || *pos == '#') break;
+                        face.push_back(corner(vertices.size()));
+                    }
+                    if (face.size() < 3) fail("face with under 3 vertices");
+                    for (size_t k = 1; k + 1 < face.size(); k++) {
+                        indices.insert(indices.end(),
+                                       {face[0], face[k], face[k + 1]});
+                    }
+                }
+                next_line();
+            }
+        }
+
+    private:
+        const std::string &path;
+        const char *pos;
+        const char *end;
+        int line = 1;
+
+        static bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        void skip_spaces() {
+            while (pos < end && is_space(*pos)) pos++;
+        }
+
+        // Skips whatever is left of the line, including its newline
+        void next_line() {
+            while (pos < end && *pos != '\n') pos++;
+            if (pos < end) {
+                pos++;
+                line++;
+            }
+        }
+
+        double number() {
+            skip_spaces();
+            double value = 0;
+            auto [next, error] = std::from_chars(pos, end, value);
+            if (error != std::errc()) fail("expected a number");
+            pos = next;
+            return value;
+        }
+
+        // Vertex number of a face corner, made zero-based
+        std::uint32_t corner(size_t vertex_count) {
+            long value = 0;
+            auto [next, error] = std::from_chars(pos, end, value);
+            if (error != std::errc()) fail("expected a vertex number");
+            pos = next;
+            while (pos < end && !is_space(*pos) && *pos != '\n') pos++;
+
+            long index = value < 0 ? long(vertex_count) + value : value - 1;
+            if (value == 0 || index < 0 || size_t(index) >= vertex_count) {
+                fail("vertex number out of range");
+            }
+            return std::uint32_t(index);
+        }
+
+        [[noreturn]] void fail(const std::string &what) const {
+            throw std::runtime_error(path + ":" + std::to_string(line) + ": " +
+                                     what);
+        }
+};
+
+} // namespace obj_format
+
+// Reads the triangles of an OBJ file; throws std::runtime_error on bad
+// input
+inline shared_ptr<TriangleMesh> load_obj(const std::string &path,
+                                         shared_ptr<Material> mat) {
+    std::vector<Point3> vertices;
+    std::vector<std::uint32_t> indices;
+    {
+        auto file = MappedFile::open_read_only(path);
+        obj_format::Parser(path, file.data(), file.data() + file.size())
+            .parse(vertices, indices);
+    }
+    vertices.shrink_to_fit();
+    return make_shared<TriangleMesh>(std::move(vertices), std::move(indices),
+                                     mat);
+}
+
+// Writes the vertices and triangles of mesh as OBJ
+inline void save_obj(const std::string &path, const TriangleMesh &mesh) {
+    std::FILE *out = std::fopen(path.c_str(), "w");
+    if (!out) {
+        throw std::runtime_error("cannot open " + path + " for writing");
+    }
+
+    for (const auto &v : mesh.vertex_array()) {
+        std::fprintf(out, "v %.17g %.17g %.17g\n", double(v.x()), double(v.y()),
+                     double(v.z()));
+    }
+    const auto &indices = mesh.index_array();
+    for (size_t k = 0; k < indices.size(); k += 3) {
+        std::fprintf(out, "f %u %u %u\n", indices[k] + 1, indices[k + 1] + 1,
+                     indices[k + 2] + 1);
+    }
+
+    if (std::fclose(out) != 0) {
+        throw std::runtime_error("error writing " + path);
+    }
+}
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "tile_scheduler.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Per-phase timers for the render loop, compiled in only when
+ * PALETTE_PROFILE is defined; otherwise the PALETTE_PROFILE_* macros
+ * expand to nothing.
+ *
+ * A scope reads the time stamp counter on entry and exit and charges the
+ * difference to its phase. Scopes nest: a phase's self time excludes the
+ * phases opened inside it, so the self times of one thread add up to its
+ * busy time. Each thread writes only to its own buffer, which it registers
+ * on first use; the buffers are read after the render's threads have
+ * joined, so the hot path takes no locks and shares no cache lines.
+ *
+ * Besides the totals, every tile leaves one event with its time span and
+ * per-phase self times, which write_chrome_trace turns into a timeline
+ * that chrome://tracing and Perfetto can open.
+ */
+enum class ProfilePhase {
+    tile,       // Camera::render_tile, minus the phases below
+    camera_ray, // get_ray and defocus_disk_sample
+    intersect,  // the scene's hit
+    scatter,    // Material::scatter
+    denoise,    // Denoiser::denoise
+    output,     // encoding and writing the image
+};
+
+constexpr int profile_phase_count = 6;
+
+inline const char *phase_name(ProfilePhase phase) {
+    switch (phase) {
+    case ProfilePhase::tile:
+        return "tile";
+    case ProfilePhase::camera_ray:
+        return "camera_ray";
+    case ProfilePhase::intersect:
+        return "intersect";
+    case ProfilePhase::scatter:
+        return "scatter";
+    case ProfilePhase::denoise:
+        return "denoise";
+    default:
+        return "output";
+    }
+}
+
+inline std::uint64_t profile_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    using namespace std::chrono;
+    auto now = steady_clock::now().time_since_epoch();
+    return std::uint64_t(duration_cast<nanoseconds>(now).count());
+#endif
+}
+
+struct PhaseTotals {
+        std::uint64_t calls = 0;
+        std::uint64_t ticks = 0;      // including nested phases
+        std::uint64_t self_ticks = 0; // excluding them
+};
+
+struct TileEvent {
+        Tile tile;
+        std::uint64_t begin, end; // ticks
+        std::uint64_t self_ticks[profile_phase_count];
+};
+
+class ScopedPhase;
+
+// One thread's measurements
+struct ProfileThread {
+        int id = 0;
+        PhaseTotals phases[profile_phase_count];
+        std::vector<TileEvent> tiles;
+        ScopedPhase *open = nullptr; // innermost running scope
+};
+
+class Profiler {
+    public:
+        // Collected totals, in seconds
+        struct Summary {
+                double seconds[profile_phase_count] = {};
+                double self_seconds[profile_phase_count] = {};
+                std::uint64_t calls[profile_phase_count] = {};
+                int threads = 0;
+                size_t tiles = 0;
+        };
+
+        /**
+         * Discards earlier measurements. Only call while no instrumented
+         * code is running.
+         */
+        void reset() {
+            std::lock_guard<std::mutex> guard(lock);
+
+            // Buffers of threads that have exited are only held here
+            std::vector<std::shared_ptr<ProfileThread>> live;
+            for (auto &buffer : buffers) {
+                if (buffer.use_count() > 1) {
+                    int id = buffer->id;
+                    *buffer = ProfileThread();
+                    buffer->id = id;
+                    live.push_back(buffer);
+                }
+            }
+            buffers = std::move(live);
+            start_ticks = profile_ticks();
+            start_time = std::chrono::steady_clock::now();
+        }
+
+        // Reads every thread's buffer; threads must be done with the render
+        Summary summary() const {
+            std::lock_guard<std::mutex> guard(lock);
+            Summary result;
+            double scale = seconds_per_tick();
+            for (const auto &buffer : buffers) {
+                bool used = !buffer->tiles.empty();
+                for (int k = 0; k < profile_phase_count; k++) {
+                    const auto &phase = buffer->phases[k];
+                    result.seconds[k] += phase.ticks * scale;
+                    result.self_seconds[k] += phase.self_ticks * scale;
+                    result.calls[k] += phase.calls;
+                    used |= phase.calls > 0;
+                }
+                result.threads += used;
+                result.tiles += buffer->tiles.size();
+            }
+            return result;
+        }
+
+        void report(std::ostream &out) const {
+            auto totals = summary();
+            double busy = 0;
+            for (double seconds : totals.self_seconds) {
+                busy += seconds;
+            }
+
+            out << "Profile over " << totals.threads << " threads, "
+                << totals.tiles << " tiles:\n";
+            for (int k = 0; k < profile_phase_count; k++) {
+                out << "  " << phase_name(ProfilePhase(k)) << ": "
+                    << totals.self_seconds[k] << " s self, "
+                    << (busy > 0 ? 100 * totals.self_seconds[k] / busy : 0)
+                    << "%, " << totals.calls[k] << " calls\n";
+            }
+        }
+
+        /**
+         * Writes one complete event per tile, on the row of the thread that
+         * rendered it, in the Trace Event format.
+         */
+        void write_chrome_trace(const std::string &path) const {
+            std::ofstream out(path);
+            if (!out) {
+                throw std::runtime_error("cannot write " + path);
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            double us = 1e6 * seconds_per_tick();
+            bool first = true;
+
+            out << "{\"traceEvents\": [";
+            for (const auto &buffer : buffers) {
+                for (const auto &event : buffer->tiles) {
+                    out << (first ? "\n" : ",\n");
+                    first = false;
+                    out << "{\"name\": \"tile " << event.tile.x0 << ','
+                        << event.tile.y0 << "\", \"cat\": \"tile\", "
+                        << "\"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->id
+                        << ", \"ts\": "
+                        << double(event.begin - start_ticks) * us
+                        << ", \"dur\": "
+                        << double(event.end - event.begin) * us
+                        << ", \"args\": {";
+                    for (int k = 0; k < profile_phase_count; k++) {
+                        out << (k ? ", " : "") << '"'
+                            << phase_name(ProfilePhase(k))
+                            << "_us\": " << event.self_ticks[k] * us;
+                    }
+                    out << "}}";
+                }
+            }
+            out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+        }
+
+        // The calling thread's buffer, registered on first use
+        ProfileThread &thread_buffer() {
+            thread_local std::shared_ptr<ProfileThread> buffer = add_thread();
+            return *buffer;
+        }
+
+    private:
+        mutable std::mutex lock;
+        std::vector<std::shared_ptr<ProfileThread>> buffers;
+        int next_id = 0;
+        std::uint64_t start_ticks = profile_ticks();
+        std::chrono::steady_clock::time_point start_time =
+            std::chrono::steady_clock::now();
+
+        std::shared_ptr<ProfileThread> add_thread() {
+            std::lock_guard<std::mutex> guard(lock);
+            auto buffer = std::make_shared<ProfileThread>();
+            buffer->id = next_id++;
+            buffers.push_back(buffer);
+            return buffer;
+        }
+
+        // Calibrates the counter against the steady clock since reset
+        double seconds_per_tick() const {
+            auto ticks = profile_ticks() - start_ticks;
+            auto seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start_time)
+                               .count();
+            return ticks > 0 ? seconds / double(ticks) : 0;
+        }
+};
+
+inline Profiler &profiler() {
+    static Profiler instance;
+    return instance;
+}
+
+class ScopedPhase {
+    public:
+        explicit ScopedPhase(ProfilePhase phase)
+            : buffer(profiler().thread_buffer()), phase(phase),
+              parent(buffer.open), begin(profile_ticks()) {
+            buffer.open = this;
+        }
+
+        ~ScopedPhase() {
+            auto elapsed = profile_ticks() - begin;
+            auto &totals = buffer.phases[int(phase)];
+            totals.calls++;
+            totals.ticks += elapsed;
+            totals.self_ticks += elapsed - nested;
+            if (parent) parent->nested += elapsed;
+            buffer.open = parent;
+        }
+
+        ScopedPhase(const ScopedPhase &) = delete;
+        ScopedPhase &operator=(const ScopedPhase &) = delete;
+
+    protected:
+        ProfileThread &buffer;
+        ProfilePhase phase;
+        ScopedPhase *parent;
+        std::uint64_t begin;
+        std::uint64_t nested = 0; // ticks spent in scopes opened inside
+};
+
+// Times a tile as a whole and records its event for the trace
+class ScopedTile : public ScopedPhase {
+    public:
+        explicit ScopedTile(const Tile &tile)
+            : ScopedPhase(ProfilePhase::tile), tile(tile) {
+            for (int k = 0; k < profile_phase_count; k++) {
+                self_before[k] = buffer.phases[k].self_ticks;
+            }
+        }
+
+        ~ScopedTile() {
+            TileEvent event{tile, begin, profile_ticks(), {}};
+            for (int k = 0; k < profile_phase_count; k++) {
+                event.self_ticks[k] =
+                    buffer.phases[k].self_ticks - self_before[k];
+            }
+            // Not yet charged by ~ScopedPhase, which runs after this
+            event.self_ticks[int(ProfilePhase::tile)] +=
+                event.end - begin - nested;
+            buffer.tiles.push_back(event);
+        }
+
+    private:
+        Tile tile;
+        std::uint64_t self_before[profile_phase_count];
+};
+
+#ifdef PALETTE_PROFILE
+constexpr bool profiling_enabled = true;
+#define PALETTE_PROFILE_CONCAT2(a, b) a##b
+#define PALETTE_PROFILE_CONCAT(a, b) PALETTE_PROFILE_CONCAT2(a, b)
+#define PALETTE_PROFILE_SCOPE(phase)                                         \
+    ScopedPhase PALETTE_PROFILE_CONCAT(profile_scope_, __LINE__)(            \
+        ProfilePhase::phase)
+#define PALETTE_PROFILE_TILE(tile)                                           \
+    ScopedTile PALETTE_PROFILE_CONCAT(profile_tile_, __LINE__)(tile)
+#else
+constexpr bool profiling_enabled = false;
+#define PALETTE_PROFILE_SCOPE(phase) ((void)0)
+#define PALETTE_PROFILE_TILE(tile) ((void)0)
+#endif
+
+#endif
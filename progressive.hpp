@@ -0,0 +1,203 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "image_writer.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Renders in passes of a few samples per pixel, accumulating into a float
+ * buffer that survives between passes.
+ *
+ * With a checkpoint path the sums are kept in a memory-mapped file holding
+ * two slots. A checkpoint writes the inactive slot, syncs it, and only then
+ * flips the header to point at it, so a job killed at any moment leaves a
+ * consistent checkpoint behind. Because every sample is seeded from
+ * (seed, pixel, sample index), the random state is fully described by the
+ * sample count, and a resumed render matches an uninterrupted one exactly.
+ */
+class ProgressiveRenderer {
+    public:
+        int samples_per_pass = 8;
+        int passes_per_checkpoint = 1;
+        std::string checkpoint_path; // empty disables checkpoints
+        std::string preview_path;    // empty disables previews
+
+        // Mixed into the checkpoint so one scene never resumes another's
+        std::uint64_t scene_key = 0;
+
+        // Throws before the first pass if preview_path has no known format.
+        // A preview that cannot be written is reported and rendering goes on.
+        Framebuffer render(Camera &cam, const Hittable &world) {
+            if (!preview_path.empty()) format_from_path(preview_path);
+            cam.initialize();
+            width = cam.image_width;
+            height = cam.height();
+            target = cam.samples_per_pixel;
+
+            sums.assign(size_t(width) * height * 3, 0.0f);
+            int done = 0;
+            int pass_size = std::max(samples_per_pass, 1);
+
+            MappedFile file;
+            if (!checkpoint_path.empty()) {
+                file = MappedFile(checkpoint_path, file_size());
+                done = restore(file, cam, pass_size);
+                if (done > 0) {
+                    std::clog << "Resuming at " << done << " of " << target
+                              << " samples per pixel\n";
+                }
+            }
+
+            std::future<void> preview;
+            auto finish_preview = [&] {
+                if (!preview.valid()) return;
+                try {
+                    preview.get();
+                } catch (const std::exception &error) {
+                    std::clog << "Preview not written: " << error.what()
+                              << '\n';
+                }
+            };
+            int passes = 0;
+            while (done < target) {
+                int end = std::min(done + pass_size, target);
+
+                cam.for_each_tile([&](const Tile &tile) {
+                    for (int j = tile.y0; j < tile.y1; j++) {
+                        for (int i = tile.x0; i < tile.x1; i++) {
+                            auto sum = cam.sample_pixel(world, i, j, done, end);
+                            float *pixel = &sums[(size_t(j) * width + i) * 3];
+                            pixel[0] += float(sum.x());
+                            pixel[1] += float(sum.y());
+                            pixel[2] += float(sum.z());
+                        }
+                    }
+                });
+
+                done = end;
+                passes++;
+                std::clog << "\rPass done: " << done << '/' << target
+                          << " samples per pixel\n";
+
+                if (file.size() > 0 &&
+                    (passes % passes_per_checkpoint == 0 || done == target)) {
+                    commit(file, done);
+                }
+
+                if (!preview_path.empty()) {
+                    finish_preview();
+                    preview = save_image_async(preview_path, resolve(done));
+                }
+            }
+
+            finish_preview();
+            return resolve(target);
+        }
+
+    private:
+        struct Header {
+                char magic[8];
+                std::uint32_t version;
+                std::int32_t width, height;
+                std::int32_t samples_target;
+                std::int32_t samples_per_pass;
+                std::uint32_t sampler; // SamplerKind
+                // samples_done << 1 | slot holding those sums, in one word
+                // so a checkpoint is published by a single aligned store
+                std::uint64_t progress;
+                std::uint64_t seed;
+                std::uint64_t scene_key;
+        };
+
+        static constexpr char magic[8] = "PALCKPT";
+        static constexpr std::uint32_t version = 2;
+
+        int width = 0, height = 0, target = 0;
+        std::vector<float> sums;
+
+        size_t slot_bytes() const {
+            return sums.size() * sizeof(float);
+        }
+
+        size_t file_size() const {
+            return sizeof(Header) + 2 * slot_bytes();
+        }
+
+        float *slot(const MappedFile &file, std::uint32_t k) const {
+            return reinterpret_cast<float *>(file.data() + sizeof(Header) +
+                                             k * slot_bytes());
+        }
+
+        // Loads a matching checkpoint and returns its sample count, or
+        // initializes a fresh one and returns 0
+        int restore(MappedFile &file, const Camera &cam, int &pass_size) {
+            auto &header = *reinterpret_cast<Header *>(file.data());
+
+            bool matches = file.reused() &&
+                           std::memcmp(header.magic, magic, 8) == 0 &&
+                           header.version == version &&
+                           header.width == width && header.height == height &&
+                           header.samples_target == target &&
+                           header.seed == cam.seed &&
+                           header.sampler == std::uint32_t(cam.sampler) &&
+                           header.scene_key == scene_key;
+            if (matches) {
+                // Pass boundaries decide the float rounding of the sums, so
+                // a resumed run keeps the pass size it started with
+                pass_size = header.samples_per_pass;
+                std::memcpy(sums.data(), slot(file, header.progress & 1),
+                            slot_bytes());
+                return int(header.progress >> 1);
+            }
+
+            Header fresh{};
+            std::memcpy(fresh.magic, magic, 8);
+            fresh.version = version;
+            fresh.width = width;
+            fresh.height = height;
+            fresh.samples_target = target;
+            fresh.samples_per_pass = pass_size;
+            fresh.progress = 0;
+            fresh.seed = cam.seed;
+            fresh.sampler = std::uint32_t(cam.sampler);
+            fresh.scene_key = scene_key;
+            header = fresh;
+            std::memset(slot(file, 0), 0, slot_bytes());
+            file.sync();
+            return 0;
+        }
+
+        void commit(const MappedFile &file, int done) const {
+            auto &header = *reinterpret_cast<Header *>(file.data());
+            std::uint32_t next = 1 - (header.progress & 1);
+
+            std::memcpy(slot(file, next), sums.data(), slot_bytes());
+            file.sync(sizeof(Header) + next * slot_bytes(), slot_bytes());
+
+            header.progress = (std::uint64_t(done) << 1) | next;
+            file.sync(0, sizeof(Header));
+        }
+
+        Framebuffer resolve(int samples) const {
+            Framebuffer image(width, height);
+            float scale = 1.0f / float(samples);
+            for (size_t k = 0; k < sums.size(); k++) {
+                image.data()[k] = sums[k] * scale;
+            }
+            return image;
+        }
+};
+
+#endif
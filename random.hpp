@@ -0,0 +1,119 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// SplitMix64 finalizer, used to turn structured keys into well mixed seeds
+inline std::uint64_t mix_seed(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * PCG32 (XSH-RR variant). Small state, 32 random bits per step.
+ * https://www.pcg-random.org/
+ */
+class Pcg32 {
+    public:
+        Pcg32() {
+            seed(0);
+        }
+
+        void seed(std::uint64_t s) {
+            state = 0;
+            inc = (mix_seed(s ^ 0xda3e39cb94b95bdbull) << 1) | 1;
+            next_u32();
+            state += mix_seed(s);
+            next_u32();
+        }
+
+        std::uint32_t next_u32() {
+            std::uint64_t old = state;
+            state = old * 6364136223846793005ull + inc;
+            auto xorshifted = std::uint32_t(((old >> 18) ^ old) >> 27);
+            auto rot = std::uint32_t(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        // Uniform in [0, 1) with 53 bits of precision
+        double next_double() {
+            std::uint64_t hi = next_u32();
+            std::uint64_t lo = next_u32();
+            return double(((hi << 32) | lo) >> 11) * 0x1.0p-53;
+        }
+
+    private:
+        std::uint64_t state;
+        std::uint64_t inc;
+};
+
+/**
+ * xoshiro256+ by Blackman and Vigna. The weak low bits are discarded when
+ * producing doubles, which is exactly the use it is designed for.
+ * https://prng.di.unimi.it/
+ */
+class Xoshiro256Plus {
+    public:
+        Xoshiro256Plus() {
+            seed(0);
+        }
+
+        void seed(std::uint64_t x) {
+            for (auto &word : s) {
+                x += 0x9e3779b97f4a7c15ull;
+                word = mix_seed(x);
+            }
+        }
+
+        std::uint64_t next_u64() {
+            std::uint64_t result = s[0] + s[3];
+            std::uint64_t t = s[1] << 17;
+
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = (s[3] << 45) | (s[3] >> 19);
+
+            return result;
+        }
+
+        double next_double() {
+            return double(next_u64() >> 11) * 0x1.0p-53;
+        }
+
+    private:
+        std::uint64_t s[4];
+};
+
+// Compile-time choice of generator used by random_double()
+#ifdef PALETTE_RNG_PCG32
+using Rng = Pcg32;
+#else
+using Rng = Xoshiro256Plus;
+#endif
+
+// Each thread owns its generator so render workers never share state
+inline Rng &thread_rng() {
+    thread_local Rng rng;
+    return rng;
+}
+
+inline void seed_random(std::uint64_t seed) {
+    thread_rng().seed(seed);
+}
+
+/**
+ * Seeds the calling thread's generator for one sample of one pixel. The
+ * stream depends only on (seed, pixel, sample), so renders come out the
+ * same no matter how pixels and samples are spread across threads.
+ */
+inline void seed_random(std::uint64_t seed, std::uint64_t pixel,
+                        std::uint64_t sample) {
+    seed_random(mix_seed(mix_seed(mix_seed(seed) + pixel) + sample));
+}
+
+#endif
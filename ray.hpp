@@ -3,32 +3,78 @@
 
 #include "vec3.hpp"
 
-class Ray {
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+template <typename T>
+class RayT {
     public:
-        Ray() {
+        RayT() {
         }
 
-        Ray(const Point3 &origin, const Vec3 &direction)
-            : orig(origin), dir(direction) {
+        RayT(const Vec3T<T> &origin, const Vec3T<T> &direction, T time = 0)
+            : orig(origin), dir(direction), tm(time) {
         }
 
-        const Point3 &origin() const {
+        const Vec3T<T> &origin() const {
             return orig;
         }
-        const Vec3 &direction() const {
+        const Vec3T<T> &direction() const {
             return dir;
         }
 
+        // Moment the ray samples, for scenes that move
+        T time() const {
+            return tm;
+        }
+
         /**
          * Returns the 3d point the ray points to for a given t
          */
-        Point3 at(double t) const {
+        Vec3T<T> at(T t) const {
             return orig + (t * dir);
         }
 
     private:
-        Point3 orig;
-        Vec3 dir;
+        Vec3T<T> orig;
+        Vec3T<T> dir;
+        T tm = 0;
 };
 
+using Ray = RayT<Real>;
+
+/**
+ * Moves p, a point on a surface, off the surface in the direction of n by
+ * a fixed number of units in the last place of each coordinate. Rounding
+ * in the hit point then cannot put a new ray's origin behind the surface
+ * it leaves, at any distance from the origin and in either precision.
+ * Close to zero, where the ulps get tiny, a fixed offset takes over.
+ * (Waechter and Binder, "A Fast and Robust Method for Avoiding
+ * Self-Intersection", Ray Tracing Gems.)
+ */
+template <typename T>
+Vec3T<T> offset_ray_origin(const Vec3T<T> &p, const Vec3T<T> &n) {
+    using Bits =
+        std::conditional_t<sizeof(T) == 4, std::int32_t, std::int64_t>;
+    constexpr T origin = T(1) / 32;
+    constexpr T float_scale = T(1) / 65536;
+    constexpr T int_scale = 256;
+
+    Vec3T<T> result;
+    for (int axis = 0; axis < 3; axis++) {
+        if (std::fabs(p[axis]) < origin) {
+            result[axis] = p[axis] + float_scale * n[axis];
+            continue;
+        }
+
+        auto steps = Bits(int_scale * n[axis]);
+        Bits bits;
+        std::memcpy(&bits, &p[axis], sizeof bits);
+        bits += p[axis] < 0 ? -steps : steps;
+        std::memcpy(&result[axis], &bits, sizeof bits);
+    }
+    return result;
+}
+
 #endif
@@ -0,0 +1,509 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "camera.hpp"
+#include "compiled_scene.hpp"
+#include "framebuffer.hpp"
+#include "sampler.hpp"
+#include "scene_file.hpp"
+#include "scenes.hpp"
+#include "socket_io.hpp"
+#include "tile_scheduler.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Camera settings a job overrides; the rest keep the scene's values
+struct CameraChanges {
+        std::optional<Point3> lookfrom, lookat;
+        std::optional<Vec3> vup;
+        std::optional<double> vfov, aspect_ratio, defocus_angle, focus_dist;
+        std::optional<int> image_width, samples_per_pixel, max_depth;
+        std::optional<std::uint64_t> seed;
+        std::optional<SamplerKind> sampler;
+
+        void apply(Camera &cam) const {
+            if (lookfrom) cam.lookfrom = *lookfrom;
+            if (lookat) cam.lookat = *lookat;
+            if (vup) cam.vup = *vup;
+            if (vfov) cam.vfov = *vfov;
+            if (aspect_ratio) cam.aspect_ratio = *aspect_ratio;
+            if (defocus_angle) cam.defocus_angle = *defocus_angle;
+            if (focus_dist) cam.focus_dist = *focus_dist;
+            if (image_width) cam.image_width = *image_width;
+            if (samples_per_pixel) cam.samples_per_pixel = *samples_per_pixel;
+            if (max_depth) cam.max_depth = *max_depth;
+            if (seed) cam.seed = *seed;
+            if (sampler) cam.sampler = *sampler;
+        }
+};
+
+// A scene file as the server sees it, or "" for the book's final scene,
+// and what to change about its camera
+struct RenderJob {
+        std::string scene;
+        CameraChanges camera;
+};
+
+/**
+ * Wire format between RenderClient and RenderServer, in host byte order
+ * since both ends are on one machine. A connection carries any number of
+ * jobs, one after another:
+ *
+ *   client: Job, then scene_length bytes of scene path
+ *   server: JobReply, then error_length bytes of message if the job
+ *           failed, or else tile_count times a TileReply followed by the
+ *           tile's pixels, row by row, as rgb floats, in the order the
+ *           tiles finish
+ */
+namespace render_protocol {
+
+constexpr char magic[4] = {'P', 'J', 'O', 'B'};
+constexpr std::uint32_t max_scene_length = 4096;
+
+// Bits of Job::fields, one per CameraChanges member
+enum : std::uint32_t {
+    has_lookfrom = 1 << 0,
+    has_lookat = 1 << 1,
+    has_vup = 1 << 2,
+    has_vfov = 1 << 3,
+    has_aspect_ratio = 1 << 4,
+    has_defocus_angle = 1 << 5,
+    has_focus_dist = 1 << 6,
+    has_image_width = 1 << 7,
+    has_samples_per_pixel = 1 << 8,
+    has_max_depth = 1 << 9,
+    has_seed = 1 << 10,
+    has_sampler = 1 << 11,
+};
+
+struct Job {
+        char magic[4];
+        std::uint32_t scene_length;
+        std::uint32_t fields;
+        std::int32_t image_width, samples_per_pixel, max_depth;
+        std::uint32_t sampler;
+        std::uint32_t reserved;
+        std::uint64_t seed;
+        double lookfrom[3], lookat[3], vup[3];
+        double vfov, aspect_ratio, defocus_angle, focus_dist;
+};
+
+struct JobReply {
+        std::int32_t width, height;
+        std::int32_t tile_count;
+        std::uint32_t error_length;
+};
+
+struct TileReply {
+        std::int32_t x0, y0, x1, y1;
+};
+
+static_assert(sizeof(Job) == 144, "job layout changed");
+
+inline Job encode(const RenderJob &job) {
+    const auto &changes = job.camera;
+    Job message{};
+    std::memcpy(message.magic, magic, 4);
+    message.scene_length = std::uint32_t(job.scene.size());
+
+    auto put = [&](const auto &field, std::uint32_t bit, auto &slot) {
+        if (field) {
+            message.fields |= bit;
+            slot = *field;
+        }
+    };
+    auto put_vector = [&](const auto &field, std::uint32_t bit,
+                          double (&slot)[3]) {
+        if (field) {
+            message.fields |= bit;
+            for (int axis = 0; axis < 3; axis++) {
+                slot[axis] = (*field)[axis];
+            }
+        }
+    };
+
+    put_vector(changes.lookfrom, has_lookfrom, message.lookfrom);
+    put_vector(changes.lookat, has_lookat, message.lookat);
+    put_vector(changes.vup, has_vup, message.vup);
+    put(changes.vfov, has_vfov, message.vfov);
+    put(changes.aspect_ratio, has_aspect_ratio, message.aspect_ratio);
+    put(changes.defocus_angle, has_defocus_angle, message.defocus_angle);
+    put(changes.focus_dist, has_focus_dist, message.focus_dist);
+    put(changes.image_width, has_image_width, message.image_width);
+    put(changes.samples_per_pixel, has_samples_per_pixel,
+        message.samples_per_pixel);
+    put(changes.max_depth, has_max_depth, message.max_depth);
+    put(changes.seed, has_seed, message.seed);
+    if (changes.sampler) {
+        message.fields |= has_sampler;
+        message.sampler = std::uint32_t(*changes.sampler);
+    }
+    return message;
+}
+
+inline CameraChanges decode(const Job &message) {
+    CameraChanges changes;
+    auto has = [&](std::uint32_t bit) { return (message.fields & bit) != 0; };
+    auto vector = [](const double (&v)[3]) { return Vec3(v[0], v[1], v[2]); };
+
+    if (has(has_lookfrom)) changes.lookfrom = vector(message.lookfrom);
+    if (has(has_lookat)) changes.lookat = vector(message.lookat);
+    if (has(has_vup)) changes.vup = vector(message.vup);
+    if (has(has_vfov)) changes.vfov = message.vfov;
+    if (has(has_aspect_ratio)) changes.aspect_ratio = message.aspect_ratio;
+    if (has(has_defocus_angle)) changes.defocus_angle = message.defocus_angle;
+    if (has(has_focus_dist)) changes.focus_dist = message.focus_dist;
+    if (has(has_image_width)) changes.image_width = message.image_width;
+    if (has(has_samples_per_pixel)) {
+        changes.samples_per_pixel = message.samples_per_pixel;
+    }
+    if (has(has_max_depth)) changes.max_depth = message.max_depth;
+    if (has(has_seed)) changes.seed = message.seed;
+    if (has(has_sampler)) {
+        if (message.sampler > std::uint32_t(SamplerKind::sobol)) {
+            throw std::invalid_argument("unknown sampler");
+        }
+        changes.sampler = SamplerKind(message.sampler);
+    }
+    return changes;
+}
+
+inline sockaddr_un socket_address(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof address.sun_path) {
+        throw std::invalid_argument("bad socket path: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+} // namespace render_protocol
+
+/**
+ * Render daemon on a Unix socket. Scenes stay loaded, compiled and with
+ * their hierarchies built between jobs, so a job that only moves the
+ * camera or changes its settings starts tracing right away. A scene file
+ * is reloaded when its size or modification time changes; relative paths
+ * are resolved against the server's working directory.
+ *
+ * Connections are served one at a time, each job with every render thread;
+ * tiles are sent back as they finish. A job that cannot be run gets an
+ * error reply and leaves the connection open.
+ */
+class RenderServer {
+    public:
+        // Render threads per job, as Camera::thread_count
+        int thread_count = 0;
+
+        explicit RenderServer(std::string socket_path)
+            : socket_path(std::move(socket_path)) {
+        }
+
+        RenderServer(const RenderServer &) = delete;
+        RenderServer &operator=(const RenderServer &) = delete;
+
+        /**
+         * Listens until stop() is called, then removes the socket. A socket
+         * left at the path by a server that is gone is replaced; anything
+         * else there is an error.
+         */
+        void serve() {
+            auto address = render_protocol::socket_address(socket_path);
+            remove_stale_socket(address);
+            int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener < 0) {
+                throw std::runtime_error("socket failed");
+            }
+            if (::bind(listener, reinterpret_cast<sockaddr *>(&address),
+                       sizeof address) != 0 ||
+                ::listen(listener, 16) != 0) {
+                ::close(listener);
+                throw std::runtime_error("cannot listen on " + socket_path);
+            }
+            listening = true;
+
+            while (wait_readable(listener)) {
+                int fd = ::accept(listener, nullptr, nullptr);
+                if (fd < 0) continue;
+                while (wait_readable(fd) && run_job(fd)) {
+                }
+                ::close(fd);
+            }
+
+            ::close(listener);
+            ::unlink(socket_path.c_str());
+            listening = false;
+        }
+
+        // Makes serve() return; safe to call from any thread
+        void stop() {
+            stopping = true;
+        }
+
+        // Whether serve() is accepting connections
+        bool ready() const {
+            return listening;
+        }
+
+        size_t scene_count() const {
+            return scenes.size();
+        }
+
+    private:
+        struct WarmScene {
+                Camera camera;
+                std::unique_ptr<CompiledScene> world;
+                off_t size = 0;
+                std::int64_t modified = 0; // nanoseconds
+        };
+
+        std::string socket_path;
+        std::unordered_map<std::string, WarmScene> scenes;
+        std::atomic<bool> stopping{false};
+        std::atomic<bool> listening{false};
+
+        // Unlinks the socket at socket_path if no server answers on it.
+        // A file that is not a socket, or a live server, is left alone.
+        void remove_stale_socket(const sockaddr_un &address) const {
+            struct stat info;
+            if (::lstat(socket_path.c_str(), &info) != 0) return;
+            if (!S_ISSOCK(info.st_mode)) {
+                throw std::runtime_error("cannot listen on " + socket_path +
+                                         ": not a socket");
+            }
+
+            int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (probe < 0) {
+                throw std::runtime_error("socket failed");
+            }
+            bool stale =
+                ::connect(probe, reinterpret_cast<const sockaddr *>(&address),
+                          sizeof address) != 0 &&
+                errno == ECONNREFUSED;
+            ::close(probe);
+            if (!stale) {
+                throw std::runtime_error("cannot listen on " + socket_path +
+                                         ": socket in use");
+            }
+            ::unlink(socket_path.c_str());
+        }
+
+        // Waits until fd can be read; false once stop() has been called
+        bool wait_readable(int fd) const {
+            pollfd poller{fd, POLLIN, 0};
+            while (!stopping) {
+                if (::poll(&poller, 1, 100) > 0) return true;
+            }
+            return false;
+        }
+
+        // The loaded scene at path, reading it if it is new or changed
+        const WarmScene &warm(const std::string &path) {
+            auto found = scenes.find(path);
+            if (path.empty()) {
+                if (found == scenes.end()) {
+                    WarmScene scene;
+                    scene.camera = random_spheres_camera();
+                    scene.world = std::make_unique<CompiledScene>(
+                        random_spheres_scene());
+                    found = scenes.emplace(path, std::move(scene)).first;
+                }
+                return found->second;
+            }
+
+            struct stat info;
+            if (::stat(path.c_str(), &info) != 0) {
+                throw std::runtime_error("cannot open " + path);
+            }
+            auto modified = std::int64_t(info.st_mtim.tv_sec) * 1'000'000'000 +
+                            info.st_mtim.tv_nsec;
+            if (found != scenes.end() && found->second.size == info.st_size &&
+                found->second.modified == modified) {
+                return found->second;
+            }
+
+            auto loaded = load_scene(path);
+            WarmScene scene;
+            scene.camera = loaded.camera;
+            scene.world = std::make_unique<CompiledScene>(loaded.world);
+            scene.size = info.st_size;
+            scene.modified = modified;
+            return scenes[path] = std::move(scene);
+        }
+
+        static bool send_error(int fd, const std::string &message) {
+            render_protocol::JobReply reply{0, 0, 0,
+                                            std::uint32_t(message.size())};
+            return write_all(fd, &reply, sizeof reply) &&
+                   write_all(fd, message.data(), message.size());
+        }
+
+        // Reads and renders one job; false if the connection should close
+        bool run_job(int fd) {
+            render_protocol::Job job;
+            if (!read_all(fd, &job, sizeof job) ||
+                std::memcmp(job.magic, render_protocol::magic, 4) != 0 ||
+                job.scene_length > render_protocol::max_scene_length) {
+                return false;
+            }
+            std::string path(job.scene_length, '\0');
+            if (!read_all(fd, path.data(), path.size())) return false;
+
+            // Anything the job asks for that fails, down to allocating its
+            // image, fails only the job and not the server
+            Camera cam;
+            const Hittable *world = nullptr;
+            Framebuffer image;
+            size_t tile_count = 0;
+            try {
+                const auto &scene = warm(path);
+                cam = scene.camera;
+                world = scene.world.get();
+                render_protocol::decode(job).apply(cam);
+                std::string why;
+                if (auto setting = cam.invalid_setting(why)) {
+                    throw std::invalid_argument(setting + why);
+                }
+
+                cam.thread_count = thread_count;
+                cam.initialize();
+                tile_count = image_tiles(cam.image_width, cam.height(),
+                                         cam.tile_size)
+                                 .size();
+                image = Framebuffer(cam.image_width, cam.height());
+            } catch (const std::exception &error) {
+                return send_error(fd, error.what());
+            }
+
+            render_protocol::JobReply reply{cam.image_width, cam.height(),
+                                            std::int32_t(tile_count), 0};
+            if (!write_all(fd, &reply, sizeof reply)) return false;
+
+            std::mutex send_lock;
+            std::atomic<bool> connected{true};
+            cam.for_each_tile([&](const Tile &tile) {
+                // Nobody is left to send the rest to
+                if (!connected) return;
+                cam.render_tile(*world, tile, image);
+
+                std::vector<float> pixels;
+                pixels.reserve(size_t(tile.width()) * tile.height() * 3);
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    size_t first = size_t(j) * image.width() + tile.x0;
+                    const float *row = image.data() + first * 3;
+                    pixels.insert(pixels.end(), row, row + tile.width() * 3);
+                }
+
+                render_protocol::TileReply header{tile.x0, tile.y0, tile.x1,
+                                                  tile.y1};
+                std::lock_guard<std::mutex> guard(send_lock);
+                if (!write_all(fd, &header, sizeof header) ||
+                    !write_all(fd, pixels.data(),
+                               pixels.size() * sizeof(float))) {
+                    connected = false;
+                }
+            });
+            return connected;
+        }
+};
+
+// Connection to a RenderServer; jobs on it run one after another
+class RenderClient {
+    public:
+        explicit RenderClient(const std::string &socket_path) {
+            auto address = render_protocol::socket_address(socket_path);
+            fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0 ||
+                ::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                          sizeof address) != 0) {
+                if (fd >= 0) ::close(fd);
+                throw std::runtime_error("cannot connect to " + socket_path);
+            }
+        }
+
+        ~RenderClient() {
+            ::close(fd);
+        }
+
+        RenderClient(const RenderClient &) = delete;
+        RenderClient &operator=(const RenderClient &) = delete;
+
+        /**
+         * Runs job on the server and returns its image. on_tile(tile,
+         * image) is called as each tile arrives, with its pixels already
+         * in place. Throws std::runtime_error if the server rejects the job
+         * or the connection breaks.
+         */
+        template <typename TileFn>
+        Framebuffer render(const RenderJob &job, TileFn &&on_tile) {
+            if (job.scene.size() > render_protocol::max_scene_length) {
+                throw std::invalid_argument("scene path too long");
+            }
+            auto message = render_protocol::encode(job);
+            if (!write_all(fd, &message, sizeof message) ||
+                !write_all(fd, job.scene.data(), job.scene.size())) {
+                throw std::runtime_error("render server went away");
+            }
+
+            render_protocol::JobReply reply;
+            receive(&reply, sizeof reply);
+            if (reply.error_length > 0) {
+                std::string error(reply.error_length, '\0');
+                receive(error.data(), error.size());
+                throw std::runtime_error("render server: " + error);
+            }
+
+            Framebuffer image(reply.width, reply.height);
+            for (int k = 0; k < reply.tile_count; k++) {
+                render_protocol::TileReply header;
+                receive(&header, sizeof header);
+                Tile tile{header.x0, header.y0, header.x1, header.y1};
+                if (tile.x0 < 0 || tile.y0 < 0 || tile.x1 > reply.width ||
+                    tile.y1 > reply.height || tile.x0 >= tile.x1 ||
+                    tile.y0 >= tile.y1) {
+                    throw std::runtime_error("render server sent a bad tile");
+                }
+
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    size_t first = size_t(j) * image.width() + tile.x0;
+                    receive(image.data() + first * 3,
+                            size_t(tile.width()) * 3 * sizeof(float));
+                }
+                on_tile(tile, image);
+            }
+            return image;
+        }
+
+        Framebuffer render(const RenderJob &job) {
+            return render(job, [](const Tile &, const Framebuffer &) {});
+        }
+
+    private:
+        int fd = -1;
+
+        void receive(void *buffer, size_t size) {
+            if (!read_all(fd, buffer, size)) {
+                throw std::runtime_error("render server went away");
+            }
+        }
+};
+
+#endif
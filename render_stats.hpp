@@ -0,0 +1,60 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include "material.hpp"
+
+#include <cstdint>
+
+/**
+ * Counters of the work done while rendering, compiled in only when
+ * PALETTE_STATS is defined. Without it PALETTE_COUNT expands to nothing,
+ * so the hit and scatter paths are exactly as fast as before.
+ *
+ * Each thread counts into its own RenderStats; Camera::render_image sums
+ * them per tile into last_render_stats().
+ */
+struct RenderStats {
+        std::uint64_t rays = 0;            // calls to the scene's hit
+        std::uint64_t nodes_visited = 0;   // BVH nodes whose box was tested
+        std::uint64_t primitive_tests = 0; // ray-primitive intersections
+        std::uint64_t scatters[material_kind_count] = {};
+        std::uint64_t absorbed = 0; // hits whose material scattered nothing
+
+        RenderStats &operator+=(const RenderStats &other) {
+            rays += other.rays;
+            nodes_visited += other.nodes_visited;
+            primitive_tests += other.primitive_tests;
+            for (int k = 0; k < material_kind_count; k++) {
+                scatters[k] += other.scatters[k];
+            }
+            absorbed += other.absorbed;
+            return *this;
+        }
+
+        RenderStats operator-(const RenderStats &other) const {
+            RenderStats diff = *this;
+            diff.rays -= other.rays;
+            diff.nodes_visited -= other.nodes_visited;
+            diff.primitive_tests -= other.primitive_tests;
+            for (int k = 0; k < material_kind_count; k++) {
+                diff.scatters[k] -= other.scatters[k];
+            }
+            diff.absorbed -= other.absorbed;
+            return diff;
+        }
+};
+
+inline RenderStats &render_stats() {
+    thread_local RenderStats stats;
+    return stats;
+}
+
+#ifdef PALETTE_STATS
+constexpr bool render_stats_enabled = true;
+#define PALETTE_COUNT(counter, n) (render_stats().counter += (n))
+#else
+constexpr bool render_stats_enabled = false;
+#define PALETTE_COUNT(counter, n) ((void)0)
+#endif
+
+#endif
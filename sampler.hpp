@@ -0,0 +1,224 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "random.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Samplers hand out the random numbers of one camera sample dimension by
+ * dimension: the pixel position first, then the lens, then two or three
+ * per bounce. Every value is a function of (seed, pixel, sample index,
+ * dimension) alone, so renders stay deterministic under any threading.
+ *
+ *   independent  uniform numbers from the thread's generator
+ *   stratified   each dimension's samples land in distinct cells of a
+ *                jittered grid, cells shuffled per pixel and dimension
+ *   sobol        the first two Sobol dimensions with hash-based Owen
+ *                scrambling, reshuffled per pixel and dimension ("padded"
+ *                as in Burley, Practical Hash-based Owen Scrambling,
+ *                JCGT 2020). Errors fall faster with the sample count and
+ *                are spread like blue noise between pixels.
+ *
+ * Halton is left out: padded Sobol gives the same low-discrepancy points
+ * per dimension pair without a table of prime bases.
+ */
+enum class SamplerKind { independent, stratified, sobol };
+
+inline const char *sampler_name(SamplerKind kind) {
+    switch (kind) {
+    case SamplerKind::stratified:
+        return "stratified";
+    case SamplerKind::sobol:
+        return "sobol";
+    default:
+        return "independent";
+    }
+}
+
+// Inverse of sampler_name; false if name is not a sampler
+inline bool sampler_from_name(std::string_view name, SamplerKind &kind) {
+    for (auto candidate : {SamplerKind::independent, SamplerKind::stratified,
+                           SamplerKind::sobol}) {
+        if (name == sampler_name(candidate)) {
+            kind = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Where the calling thread is within its current camera sample. Batch
+// renderers save and restore it along with thread_rng() per path.
+struct SampleStream {
+        SamplerKind kind = SamplerKind::independent;
+        std::uint64_t key = 0;        // from the seed and pixel
+        std::uint32_t index = 0;      // sample number within the pixel
+        std::uint32_t count = 1;      // samples the stratified grid plans
+        std::uint32_t dimension = 0;  // next dimension to hand out
+};
+
+inline SampleStream &thread_sample_stream() {
+    thread_local SampleStream stream;
+    return stream;
+}
+
+namespace sampling {
+
+inline std::uint32_t reverse_bits(std::uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling of the bits of x, the highest bit first (Burley 2020)
+inline std::uint32_t owen_scramble(std::uint32_t x, std::uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Second Sobol dimension; the first is reverse_bits(index)
+inline std::uint32_t sobol_second(std::uint32_t index) {
+    std::uint32_t result = 0;
+    for (std::uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) result ^= v;
+    }
+    return result;
+}
+
+// Element i of a pseudorandom permutation of [0, length) chosen by seed
+// (Kensler, Correlated Multi-Jittered Sampling, 2013)
+inline std::uint32_t permute(std::uint32_t i, std::uint32_t length,
+                             std::uint32_t seed) {
+    std::uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + seed) % length;
+}
+
+inline double to_unit(std::uint32_t bits) {
+    return bits * 0x1.0p-32;
+}
+
+inline double hash_unit(std::uint64_t key) {
+    return double(mix_seed(key) >> 11) * 0x1.0p-53;
+}
+
+// Seed of one dimension of the current pixel
+inline std::uint64_t dimension_key(const SampleStream &s) {
+    return mix_seed(s.key + 0x632be59bd9b4e019ull * (s.dimension + 1));
+}
+
+// Cell of sample `index` in a grid of `cells`, shuffled per dimension.
+// Past the grid, each further round of samples gets a new shuffle.
+inline std::uint32_t stratum(const SampleStream &s, std::uint64_t key,
+                             std::uint32_t cells) {
+    std::uint32_t round = s.index / cells;
+    return permute(s.index % cells, cells,
+                   std::uint32_t(mix_seed(key + round)));
+}
+
+} // namespace sampling
+
+/**
+ * Starts sample `sample` of `pixel`: seeds the thread's generator as
+ * seed_random does and rewinds the sampler to dimension 0. `count` is the
+ * sample count the stratified grid is laid out for.
+ */
+inline void start_sample(SamplerKind kind, std::uint64_t seed,
+                         std::uint64_t pixel, std::uint32_t sample,
+                         std::uint32_t count) {
+    seed_random(seed, pixel, sample);
+    auto &s = thread_sample_stream();
+    s.kind = kind;
+    s.key = mix_seed(mix_seed(seed) + pixel);
+    s.index = sample;
+    s.count = count > 0 ? count : 1;
+    s.dimension = 0;
+}
+
+// The current sample's next dimension, in [0, 1)
+inline double sample_1d() {
+    using namespace sampling;
+    auto &s = thread_sample_stream();
+    if (s.kind == SamplerKind::independent) {
+        return thread_rng().next_double();
+    }
+
+    auto key = dimension_key(s);
+    s.dimension++;
+    if (s.kind == SamplerKind::stratified) {
+        auto cell = stratum(s, key, s.count);
+        return (cell + hash_unit(key ^ s.index)) / s.count;
+    }
+
+    auto index = owen_scramble(s.index, std::uint32_t(key));
+    return to_unit(owen_scramble(reverse_bits(index),
+                                 std::uint32_t(key >> 32)));
+}
+
+struct Sample2D {
+        double u, v;
+};
+
+// The current sample's next two dimensions, as a point of [0, 1)^2
+inline Sample2D sample_2d() {
+    using namespace sampling;
+    auto &s = thread_sample_stream();
+    if (s.kind == SamplerKind::independent) {
+        double u = thread_rng().next_double();
+        return {u, thread_rng().next_double()};
+    }
+
+    auto key = dimension_key(s);
+    s.dimension++;
+    if (s.kind == SamplerKind::stratified) {
+        auto nx = std::uint32_t(std::ceil(std::sqrt(double(s.count))));
+        auto ny = (s.count + nx - 1) / nx;
+        auto cell = stratum(s, key, nx * ny);
+        return {(cell % nx + hash_unit(key ^ s.index)) / nx,
+                (cell / nx + hash_unit(~key ^ s.index)) / ny};
+    }
+
+    auto index = owen_scramble(s.index, std::uint32_t(key));
+    auto scramble = mix_seed(key);
+    return {to_unit(owen_scramble(reverse_bits(index),
+                                  std::uint32_t(key >> 32))),
+            to_unit(owen_scramble(sobol_second(index),
+                                  std::uint32_t(scramble)))};
+}
+
+#endif
@@ -0,0 +1,493 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "common.hpp"
+#include "camera.hpp"
+#include "hittable_list.hpp"
+#include "mapped_file.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Scene files describe the camera, the materials and the spheres.
+ *
+ * The text form (.scene) has one directive per line, and '#' starts a
+ * comment. Camera settings use the names of the Camera fields:
+ *
+ *   image_width 1200        aspect_ratio 1.7778     samples_per_pixel 500
+ *   max_depth 50            vfov 20                 lookfrom 13 2 3
+ *   lookat 0 0 0            vup 0 1 0               defocus_angle 0.6
+ *   focus_dist 10
+ *
+ * Materials are numbered from 0 in the order they appear:
+ *
+ *   lambertian r g b
+ *   metal r g b fuzz
+ *   dielectric refraction_index
+ *
+ * and a sphere gives its center, radius and material number:
+ *
+ *   sphere x y z radius material
+ *
+ * The binary form (.bscene) holds the same data as fixed-size little
+ * endian records behind a header, in the layout of the structs below.
+ *
+ * Both are read from a memory-mapped file. The text parser works on the
+ * mapped bytes directly with std::from_chars, so it makes no allocation
+ * per line.
+ */
+struct SceneFile {
+        Camera camera;
+        HittableList world;
+        // Hash of the file contents, for ProgressiveRenderer::scene_key
+        std::uint64_t key = 0;
+};
+
+namespace scene_format {
+
+struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t material_count;
+        std::uint64_t sphere_count;
+        double aspect_ratio, vfov, defocus_angle, focus_dist;
+        double lookfrom[3], lookat[3], vup[3];
+        std::int32_t image_width, samples_per_pixel, max_depth;
+        std::uint32_t reserved;
+};
+
+struct MaterialRecord {
+        std::uint32_t kind; // MaterialKind
+        std::uint32_t reserved;
+        double albedo[3];
+        double parameter;
+};
+
+struct SphereRecord {
+        double center[3];
+        double radius;
+        std::uint32_t material;
+        std::uint32_t reserved;
+};
+
+static_assert(sizeof(Header) == 144, "scene header layout changed");
+static_assert(sizeof(MaterialRecord) == 40, "material layout changed");
+static_assert(sizeof(SphereRecord) == 40, "sphere layout changed");
+
+constexpr char magic[8] = "PALSCN";
+constexpr std::uint32_t version = 1;
+
+inline bool ends_with(const std::string &path, const char *suffix) {
+    auto n = std::strlen(suffix);
+    return path.size() >= n && path.compare(path.size() - n, n, suffix) == 0;
+}
+
+inline std::uint64_t hash_bytes(const char *bytes, size_t size) {
+    std::uint64_t hash = mix_seed(size);
+    size_t k = 0;
+    for (; k + 8 <= size; k += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes + k, 8);
+        hash = mix_seed(hash ^ word);
+    }
+    std::uint64_t tail = 0;
+    if (k < size) std::memcpy(&tail, bytes + k, size - k);
+    return mix_seed(hash ^ tail);
+}
+
+inline shared_ptr<Material> make_material(MaterialKind kind,
+                                          const Color &albedo,
+                                          double parameter) {
+    switch (kind) {
+    case MaterialKind::lambertian:
+        return make_shared<Lambertian>(albedo);
+    case MaterialKind::metal:
+        return make_shared<Metal>(albedo, parameter);
+    default:
+        return make_shared<Dielectric>(parameter);
+    }
+}
+
+// Cursor over the text form; errors name the file and line
+class TextParser {
+    public:
+        TextParser(const std::string &path, const char *begin, const char *end)
+            : path(path), pos(begin), end(end) {
+        }
+
+        void parse(SceneFile &scene) {
+            std::vector<shared_ptr<Material>> materials;
+
+            while (skip_blank_lines()) {
+                auto word = next_word();
+
+                if (word == "sphere") {
+                    auto x = number(), y = number(), z = number();
+                    auto radius = number();
+                    auto index = integer();
+                    if (index < 0 || size_t(index) >= materials.size()) {
+                        fail("undefined material number");
+                    }
+                    scene.world.add(make_shared<Sphere>(
+                        Point3(x, y, z), radius, materials[index]));
+                } else if (word == "lambertian") {
+                    materials.push_back(make_shared<Lambertian>(color()));
+                } else if (word == "metal") {
+                    auto albedo = color();
+                    materials.push_back(make_shared<Metal>(albedo, number()));
+                } else if (word == "dielectric") {
+                    materials.push_back(make_shared<Dielectric>(number()));
+                } else {
+                    camera_setting(word, scene.camera);
+                    setting_lines[word] = line;
+                }
+
+                end_of_line();
+            }
+
+            // Settings are checked together, as the height depends on two
+            // of them, and blamed on the line that set the bad one
+            std::string why;
+            if (auto setting = scene.camera.invalid_setting(why)) {
+                for (auto name : {std::string_view(setting),
+                                  std::string_view("image_width")}) {
+                    auto found = setting_lines.find(name);
+                    if (found != setting_lines.end()) {
+                        line = found->second;
+                        break;
+                    }
+                }
+                fail(setting + why);
+            }
+        }
+
+    private:
+        const std::string &path;
+        const char *pos;
+        const char *end;
+        int line = 1;
+        std::unordered_map<std::string_view, int> setting_lines;
+
+        static bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        // Moves to the next directive; false at the end of the file
+        bool skip_blank_lines() {
+            while (pos < end) {
+                if (is_space(*pos)) {
+                    pos++;
+                } else if (*pos == '\n') {
+                    pos++;
+                    line++;
+                } else if (*pos == '#') {
+                    while (pos < end && *pos != '\n') pos++;
+                } else {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void skip_spaces() {
+            while (pos < end && is_space(*pos)) pos++;
+        }
+
+        std::string_view next_word() {
+            skip_spaces();
+            auto start = pos;
+            while (pos < end && !is_space(*pos) && *pos != '\n' &&
+                   *pos != '#') {
+                pos++;
+            }
+            return std::string_view(start, size_t(pos - start));
+        }
+
+        double number() {
+            skip_spaces();
+            double value = 0;
+            auto [next, error] = std::from_chars(pos, end, value);
+            if (error != std::errc()) fail("expected a number");
+            pos = next;
+            return value;
+        }
+
+        long integer() {
+            skip_spaces();
+            long value = 0;
+            auto [next, error] = std::from_chars(pos, end, value);
+            if (error != std::errc()) fail("expected an integer");
+            pos = next;
+            return value;
+        }
+
+        int small_integer() {
+            auto value = integer();
+            if (value < INT_MIN || value > INT_MAX) fail("integer too large");
+            return int(value);
+        }
+
+        Vec3 vector() {
+            auto x = number(), y = number(), z = number();
+            return Vec3(x, y, z);
+        }
+
+        Color color() {
+            return vector();
+        }
+
+        void end_of_line() {
+            skip_spaces();
+            if (pos < end && *pos != '\n' && *pos != '#') {
+                fail("unexpected text after directive");
+            }
+        }
+
+        void camera_setting(std::string_view word, Camera &cam) {
+            if (word == "image_width") {
+                cam.image_width = small_integer();
+            } else if (word == "aspect_ratio") {
+                cam.aspect_ratio = number();
+            } else if (word == "samples_per_pixel") {
+                cam.samples_per_pixel = small_integer();
+            } else if (word == "max_depth") {
+                cam.max_depth = small_integer();
+            } else if (word == "vfov") {
+                cam.vfov = number();
+            } else if (word == "lookfrom") {
+                cam.lookfrom = vector();
+            } else if (word == "lookat") {
+                cam.lookat = vector();
+            } else if (word == "vup") {
+                cam.vup = vector();
+            } else if (word == "defocus_angle") {
+                cam.defocus_angle = number();
+            } else if (word == "focus_dist") {
+                cam.focus_dist = number();
+            } else {
+                fail("unknown directive '" + std::string(word) + "'");
+            }
+        }
+
+        [[noreturn]] void fail(const std::string &what) const {
+            throw std::runtime_error(path + ":" + std::to_string(line) + ": " +
+                                     what);
+        }
+};
+
+inline void parse_binary(const std::string &path, const char *bytes,
+                         size_t size, SceneFile &scene) {
+    auto fail = [&](const char *what) {
+        throw std::runtime_error(path + ": " + what);
+    };
+
+    Header header;
+    if (size < sizeof header) fail("truncated header");
+    std::memcpy(&header, bytes, sizeof header);
+    if (std::memcmp(header.magic, magic, 8) != 0) fail("not a scene file");
+    if (header.version != version) fail("unsupported version");
+
+    if (header.sphere_count > size / sizeof(SphereRecord)) {
+        fail("size does not match the header");
+    }
+    auto expected = sizeof header +
+                    header.material_count * sizeof(MaterialRecord) +
+                    header.sphere_count * sizeof(SphereRecord);
+    if (size != expected) fail("size does not match the header");
+
+    Camera &cam = scene.camera;
+    cam.aspect_ratio = header.aspect_ratio;
+    cam.vfov = header.vfov;
+    cam.defocus_angle = header.defocus_angle;
+    cam.focus_dist = header.focus_dist;
+    cam.lookfrom = Point3(header.lookfrom[0], header.lookfrom[1],
+                          header.lookfrom[2]);
+    cam.lookat = Point3(header.lookat[0], header.lookat[1], header.lookat[2]);
+    cam.vup = Vec3(header.vup[0], header.vup[1], header.vup[2]);
+    cam.image_width = header.image_width;
+    cam.samples_per_pixel = header.samples_per_pixel;
+    cam.max_depth = header.max_depth;
+    std::string why;
+    if (auto setting = cam.invalid_setting(why)) {
+        throw std::runtime_error(path + ": " + setting + why);
+    }
+
+    const char *cursor = bytes + sizeof header;
+    std::vector<shared_ptr<Material>> materials;
+    materials.reserve(header.material_count);
+    for (std::uint32_t k = 0; k < header.material_count; k++) {
+        MaterialRecord record;
+        std::memcpy(&record, cursor, sizeof record);
+        cursor += sizeof record;
+
+        if (record.kind > std::uint32_t(MaterialKind::dielectric)) {
+            fail("unknown material kind");
+        }
+        materials.push_back(make_material(
+            MaterialKind(record.kind),
+            Color(record.albedo[0], record.albedo[1], record.albedo[2]),
+            record.parameter));
+    }
+
+    scene.world.objects.reserve(header.sphere_count);
+    for (std::uint64_t k = 0; k < header.sphere_count; k++) {
+        SphereRecord record;
+        std::memcpy(&record, cursor, sizeof record);
+        cursor += sizeof record;
+
+        if (record.material >= materials.size()) {
+            fail("undefined material number");
+        }
+        scene.world.add(make_shared<Sphere>(
+            Point3(record.center[0], record.center[1], record.center[2]),
+            record.radius, materials[record.material]));
+    }
+}
+
+} // namespace scene_format
+
+inline bool is_scene_path(const std::string &path) {
+    return scene_format::ends_with(path, ".scene") ||
+           scene_format::ends_with(path, ".bscene");
+}
+
+// Reads a .scene or .bscene file; throws std::runtime_error on bad input
+inline SceneFile load_scene(const std::string &path) {
+    auto file = MappedFile::open_read_only(path);
+    const char *bytes = file.data();
+
+    SceneFile scene;
+    scene.key = scene_format::hash_bytes(bytes, file.size());
+    if (scene_format::ends_with(path, ".bscene")) {
+        scene_format::parse_binary(path, bytes, file.size(), scene);
+    } else {
+        scene_format::TextParser(path, bytes, bytes + file.size())
+            .parse(scene);
+    }
+    return scene;
+}
+
+/**
+ * Writes cam and the spheres of world in the format the extension names.
+ * Materials shared between spheres are written once. Throws
+ * std::invalid_argument if world holds anything but spheres.
+ */
+inline void save_scene(const std::string &path, const Camera &cam,
+                       const HittableList &world) {
+    using namespace scene_format;
+
+    std::vector<const Sphere *> spheres;
+    std::vector<const Material *> materials;
+    std::vector<std::uint32_t> material_of;
+    std::unordered_map<const Material *, std::uint32_t> slots;
+    for (const auto &object : world.objects) {
+        auto sphere = dynamic_cast<const Sphere *>(object.get());
+        if (!sphere) {
+            throw std::invalid_argument("save_scene: non-sphere object");
+        }
+        auto [slot, inserted] = slots.try_emplace(
+            sphere->material().get(), std::uint32_t(materials.size()));
+        if (inserted) materials.push_back(sphere->material().get());
+        spheres.push_back(sphere);
+        material_of.push_back(slot->second);
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("cannot open " + path + " for writing");
+    }
+
+    if (ends_with(path, ".bscene")) {
+        Header header{};
+        std::memcpy(header.magic, magic, 8);
+        header.version = version;
+        header.material_count = std::uint32_t(materials.size());
+        header.sphere_count = spheres.size();
+        header.aspect_ratio = cam.aspect_ratio;
+        header.vfov = cam.vfov;
+        header.defocus_angle = cam.defocus_angle;
+        header.focus_dist = cam.focus_dist;
+        for (int axis = 0; axis < 3; axis++) {
+            header.lookfrom[axis] = cam.lookfrom[axis];
+            header.lookat[axis] = cam.lookat[axis];
+            header.vup[axis] = cam.vup[axis];
+        }
+        header.image_width = cam.image_width;
+        header.samples_per_pixel = cam.samples_per_pixel;
+        header.max_depth = cam.max_depth;
+        out.write(reinterpret_cast<const char *>(&header), sizeof header);
+
+        for (const auto *mat : materials) {
+            MaterialRecord record{};
+            record.kind = std::uint32_t(mat->kind());
+            for (int c = 0; c < 3; c++) {
+                record.albedo[c] = mat->albedo()[c];
+            }
+            record.parameter = mat->parameter();
+            out.write(reinterpret_cast<const char *>(&record), sizeof record);
+        }
+
+        for (size_t k = 0; k < spheres.size(); k++) {
+            SphereRecord record{};
+            for (int axis = 0; axis < 3; axis++) {
+                record.center[axis] = spheres[k]->center()[axis];
+            }
+            record.radius = spheres[k]->radius();
+            record.material = material_of[k];
+            out.write(reinterpret_cast<const char *>(&record), sizeof record);
+        }
+        return;
+    }
+
+    // 17 significant digits, so a text scene reloads exactly
+    out.precision(17);
+    out << "image_width " << cam.image_width << '\n'
+        << "aspect_ratio " << cam.aspect_ratio << '\n'
+        << "samples_per_pixel " << cam.samples_per_pixel << '\n'
+        << "max_depth " << cam.max_depth << '\n'
+        << "vfov " << cam.vfov << '\n'
+        << "lookfrom " << cam.lookfrom << '\n'
+        << "lookat " << cam.lookat << '\n'
+        << "vup " << cam.vup << '\n'
+        << "defocus_angle " << cam.defocus_angle << '\n'
+        << "focus_dist " << cam.focus_dist << '\n';
+
+    for (const auto *mat : materials) {
+        switch (mat->kind()) {
+        case MaterialKind::lambertian:
+            out << "lambertian " << mat->albedo() << '\n';
+            break;
+        case MaterialKind::metal:
+            out << "metal " << mat->albedo() << ' ' << mat->parameter()
+                << '\n';
+            break;
+        default:
+            out << "dielectric " << mat->parameter() << '\n';
+        }
+    }
+
+    char buffer[160];
+    for (size_t k = 0; k < spheres.size(); k++) {
+        const auto &center = spheres[k]->center();
+        auto n = std::snprintf(buffer, sizeof buffer,
+                               "sphere %.17g %.17g %.17g %.17g %u\n",
+                               double(center[0]), double(center[1]),
+                               double(center[2]),
+                               double(spheres[k]->radius()), material_of[k]);
+        out.write(buffer, n);
+    }
+}
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "common.hpp"
+#include "animation.hpp"
+#include "camera.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+#include "triangle_mesh.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Final scene of "Ray Tracing in One Weekend": a grid of small random
+// spheres around three large ones. The layout is fixed by `seed`.
+inline HittableList random_spheres_scene(std::uint64_t seed = 0) {
+    seed_random(seed);
+
+    HittableList world;
+
+    auto ground_material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            Point3 center(a + 0.9 * random_double(), 0.2,
+                          b + 0.9 * random_double());
+
+            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<Material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = Color::random() * Color::random();
+                    sphere_material = make_shared<Lambertian>(albedo);
+                    world.add(
+                        make_shared<Sphere>(center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // Metal
+                    auto albedo = Color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = make_shared<Metal>(albedo, fuzz);
+                    world.add(
+                        make_shared<Sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = make_shared<Dielectric>(1.5);
+                    world.add(
+                        make_shared<Sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = make_shared<Dielectric>(1.5);
+    world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
+    world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+// The final scene in motion over scene times 0 to 2: the small diffuse
+// spheres bounce, the metal ones slide along the ground and the rest keep
+// still. The layout is fixed by `seed`.
+inline shared_ptr<AnimatedSpheres> bouncing_spheres_scene(
+    std::uint64_t seed = 0) {
+    seed_random(seed);
+
+    auto world = make_shared<AnimatedSpheres>();
+    const Vec3 still(0, 0, 0);
+
+    auto ground_material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    world->add_moving(Point3(0, -1000, 0), still, 1000, ground_material);
+
+    // Eight keys per bounce, which is a rectified sine
+    std::vector<double> times;
+    for (int key = 0; key <= 16; key++) {
+        times.push_back(key / 8.0);
+    }
+    std::vector<Point3> centers(times.size());
+
+    auto glass = make_shared<Dielectric>(1.5);
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            Point3 center(a + 0.9 * random_double(), 0.2,
+                          b + 0.9 * random_double());
+            if ((center - Point3(4, 0.2, 0)).length() <= 0.9) continue;
+
+            if (choose_mat < 0.8) {
+                auto albedo = Color::random() * Color::random();
+                auto height = random_double(0.2, 0.8);
+                auto phase = random_double();
+                for (size_t key = 0; key < times.size(); key++) {
+                    auto lift = std::fabs(std::sin(pi * (times[key] + phase)));
+                    centers[key] = center + Vec3(0, height * lift, 0);
+                }
+                world->add_keyframed(times, centers, 0.2,
+                                     make_shared<Lambertian>(albedo));
+            } else if (choose_mat < 0.95) {
+                auto albedo = Color::random(0.5, 1);
+                auto fuzz = random_double(0, 0.5);
+                auto velocity = Vec3(random_double(-0.5, 0.5), 0,
+                                     random_double(-0.5, 0.5));
+                world->add_moving(center, velocity, 0.2,
+                                  make_shared<Metal>(albedo, fuzz));
+            } else {
+                world->add_moving(center, still, 0.2, glass);
+            }
+        }
+    }
+
+    world->add_moving(Point3(0, 1, 0), still, 1.0, glass);
+    world->add_moving(Point3(-4, 1, 0), still, 1.0,
+                      make_shared<Lambertian>(Color(0.4, 0.2, 0.1)));
+    world->add_moving(Point3(4, 1, 0), still, 1.0,
+                      make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0));
+    return world;
+}
+
+// n small spheres scattered through a cube that grows with n, so the
+// density stays constant. Used to stress acceleration structures.
+inline HittableList many_spheres_scene(size_t n, std::uint64_t seed = 0) {
+    seed_random(seed);
+
+    HittableList world;
+    world.objects.reserve(n);
+
+    auto half = 0.5 * std::cbrt(double(n));
+    auto diffuse = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    for (size_t k = 0; k < n; k++) {
+        auto center = Point3::random(-half, half);
+        world.add(make_shared<Sphere>(center, 0.2, diffuse));
+    }
+
+    return world;
+}
+
+// The main.cpp layout with every small sphere made of glass, so paths
+// bounce around for a long time
+inline HittableList glass_spheres_scene(std::uint64_t seed = 0) {
+    seed_random(seed);
+
+    HittableList world;
+
+    auto ground_material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
+
+    auto glass = make_shared<Dielectric>(1.5);
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            Point3 center(a + 0.9 * random_double(), 0.2,
+                          b + 0.9 * random_double());
+            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
+                world.add(make_shared<Sphere>(center, 0.2, glass));
+            }
+        }
+    }
+
+    world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, glass));
+    world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, glass));
+    world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, glass));
+
+    return world;
+}
+
+// Closed sphere of unit radius at the origin with bumps on it, made of
+// 4 * rings * (rings - 1) triangles. Every edge is shared by exactly two
+// triangles, so rays from inside must always hit.
+inline shared_ptr<TriangleMesh> bumpy_sphere_mesh(std::uint32_t rings,
+                                                  shared_ptr<Material> mat) {
+    std::uint32_t segments = 2 * rings;
+
+    std::vector<Point3> vertices;
+    vertices.emplace_back(0, 1, 0);
+    for (std::uint32_t ring = 1; ring < rings; ring++) {
+        auto theta = pi * ring / rings;
+        for (std::uint32_t segment = 0; segment < segments; segment++) {
+            auto phi = 2 * pi * segment / segments;
+            auto r = 1 + 0.05 * std::sin(8 * theta) * std::sin(8 * phi);
+            vertices.emplace_back(r * std::sin(theta) * std::cos(phi),
+                                  r * std::cos(theta),
+                                  r * std::sin(theta) * std::sin(phi));
+        }
+    }
+    vertices.emplace_back(0, -1, 0);
+    std::uint32_t bottom = std::uint32_t(vertices.size() - 1);
+
+    // Vertex of ring (1 to rings - 1) and segment, wrapping around
+    auto at = [&](std::uint32_t ring, std::uint32_t segment) {
+        return 1 + (ring - 1) * segments + segment % segments;
+    };
+
+    std::vector<std::uint32_t> indices;
+    for (std::uint32_t segment = 0; segment < segments; segment++) {
+        indices.insert(indices.end(),
+                       {0, at(1, segment + 1), at(1, segment)});
+        for (std::uint32_t ring = 1; ring + 1 < rings; ring++) {
+            indices.insert(indices.end(),
+                           {at(ring, segment), at(ring, segment + 1),
+                            at(ring + 1, segment + 1)});
+            indices.insert(indices.end(),
+                           {at(ring, segment), at(ring + 1, segment + 1),
+                            at(ring + 1, segment)});
+        }
+        indices.insert(indices.end(), {at(rings - 1, segment),
+                                       at(rings - 1, segment + 1), bottom});
+    }
+
+    return make_shared<TriangleMesh>(std::move(vertices), std::move(indices),
+                                     mat);
+}
+
+inline Camera random_spheres_camera() {
+    Camera cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 1200;
+    cam.samples_per_pixel = 500;
+    cam.max_depth = 50;
+
+    cam.vfov = 20;
+    cam.lookfrom = Point3(13, 2, 3);
+    cam.lookat = Point3(0, 0, 0);
+    cam.vup = Vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    return cam;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef SOCKET_IO_H
+#define SOCKET_IO_H
+
+#include <cerrno>
+#include <cstddef>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Blocking reads and writes of whole messages on a stream socket. Both
+// return false once the other side has gone away.
+
+inline bool read_all(int fd, void *buffer, size_t size) {
+    auto *bytes = static_cast<char *>(buffer);
+    while (size > 0) {
+        auto n = ::read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// Never raises SIGPIPE
+inline bool write_all(int fd, const void *buffer, size_t size) {
+    auto *bytes = static_cast<const char *>(buffer);
+    while (size > 0) {
+        auto n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+#endif
@@ -2,54 +2,101 @@
 #define SPHERE_H
 
 #include "hittable.hpp"
+#include "material.hpp"
 #include "vec3.hpp"
 #include "interval.hpp"
+#include "render_stats.hpp"
 
 bool in_range(double root, double min, double max) {
     return min < root && root < max;
 }
 
-class Sphere : public Hittable {
+// Distance to the nearest crossing of r with a sphere inside ray_t.
+// The quadratic is solved in double whatever Real is. For a large sphere
+// such as the ground, c cancels so badly in float that the surface moves
+// further than offset_ray_origin steps off it.
+inline bool sphere_hit_distance(const Ray &r, const Point3 &center,
+                                Real radius, Interval ray_t, Real &root) {
+    PALETTE_COUNT(primitive_tests, 1);
+    using Wide = Vec3T<double>;
+    Wide dir(r.direction());
+    Wide origin_center = Wide(center) - Wide(r.origin());
+    auto a = dir.length_squared();
+    auto h = dot(dir, origin_center);
+    auto c = origin_center.length_squared() - (double(radius) * radius);
+
+    auto discriminant = h * h - a * c;
+    if (discriminant < 0) {
+        return false;
+    }
+
+    auto sqrtd = std::sqrt(discriminant);
+
+    root = Real((h - sqrtd) / a);
+    if (!ray_t.surrounds(root)) {
+        root = Real((h + sqrtd) / a);
+        if (!ray_t.surrounds(root)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class Sphere final : public Hittable {
     private:
-        Point3 center;
-        double radius;
+        Point3 ctr;
+        Real rad;
         shared_ptr<Material> mat;
+        Aabb bbox;
 
     public:
         // Ensures non-negative radius
         Sphere(const Vec3 &center, double radius, shared_ptr<Material> mat)
-            : center(center), radius(std::fmax(0, radius)), mat(mat) {
+            : ctr(center), rad(std::fmax(0, radius)), mat(mat) {
+            auto rvec = Vec3(rad, rad, rad);
+            bbox = Aabb(center - rvec, center + rvec);
         }
 
-        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
-            Vec3 origin_center = center - r.origin();
-            auto a = r.direction().length_squared();
-            auto h = dot(r.direction(), origin_center);
-            auto c = origin_center.length_squared() - (radius * radius);
+        const Point3 &center() const {
+            return ctr;
+        }
+        Real radius() const {
+            return rad;
+        }
+        const shared_ptr<Material> &material() const {
+            return mat;
+        }
+
+        Aabb bounding_box() const override {
+            return bbox;
+        }
 
-            auto discriminant = h * h - a * c;
-            if (discriminant < 0) {
+        unsigned material_kinds() const override {
+            return material_bit(mat->kind());
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            Real root;
+            if (!hit_distance(r, ray_t, root)) {
                 return false;
             }
 
-            auto sqrtd = std::sqrt(discriminant);
+            fill_record(r, root, rec);
+            return true;
+        }
 
-            auto root = (h - sqrtd) / a;
-            if (!ray_t.surrounds(root)) {
-                root = (h + sqrtd) / a;
-                if (!ray_t.surrounds(root)) {
-                    return false;
-                }
-            }
+        // The intersection test alone; aggregates call fill_record only for
+        // the closest of the spheres they test
+        bool hit_distance(const Ray &r, Interval ray_t, Real &root) const {
+            return sphere_hit_distance(r, ctr, rad, ray_t, root);
+        }
 
-            rec.p = r.at(root);
-            rec.normal = (rec.p - center) / radius;
+        void fill_record(const Ray &r, Real root, hit_record &rec) const {
             rec.t = root;
-            Vec3 outward_normal = (rec.p - center) / radius;
+            rec.p = r.at(root);
+            Vec3 outward_normal = (rec.p - ctr) / rad;
             rec.set_face_normal(r, outward_normal);
-            rec.mat = mat;
-
-            return true;
+            rec.mat = mat.get();
         }
 };
 
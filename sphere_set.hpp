@@ -0,0 +1,526 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "common.hpp"
+#include "flat_bvh.hpp"
+#include "hittable.hpp"
+#include "hittable_list.hpp"
+#include "material.hpp"
+#include "render_stats.hpp"
+#include "sphere.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+// The vector kernels are written for doubles; float builds (PALETTE_FLOAT)
+// run the scalar loop
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(PALETTE_FLOAT)
+#define PALETTE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Minimal allocator handing out storage aligned for vector loads
+template <typename T, std::size_t Align>
+struct AlignedAllocator {
+        using value_type = T;
+
+        template <typename U>
+        struct rebind {
+                using other = AlignedAllocator<U, Align>;
+        };
+
+        AlignedAllocator() = default;
+        template <typename U>
+        AlignedAllocator(const AlignedAllocator<U, Align> &) {
+        }
+
+        T *allocate(std::size_t n) {
+            return static_cast<T *>(
+                ::operator new(n * sizeof(T), std::align_val_t(Align)));
+        }
+
+        void deallocate(T *p, std::size_t) {
+            ::operator delete(p, std::align_val_t(Align));
+        }
+
+        template <typename U>
+        bool operator==(const AlignedAllocator<U, Align> &) const {
+            return true;
+        }
+        template <typename U>
+        bool operator!=(const AlignedAllocator<U, Align> &) const {
+            return false;
+        }
+};
+
+enum class SphereKernel { scalar, sse2, avx2 };
+
+inline const char *kernel_name(SphereKernel kernel) {
+    switch (kernel) {
+    case SphereKernel::sse2:
+        return "sse2";
+    case SphereKernel::avx2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+inline bool kernel_supported(SphereKernel kernel) {
+#ifdef PALETTE_X86_SIMD
+    if (kernel == SphereKernel::avx2) return __builtin_cpu_supports("avx2");
+    return true;
+#else
+    return kernel == SphereKernel::scalar;
+#endif
+}
+
+// Widest kernel the running CPU can execute
+inline SphereKernel best_sphere_kernel() {
+    if (kernel_supported(SphereKernel::avx2)) return SphereKernel::avx2;
+    if (kernel_supported(SphereKernel::sse2)) return SphereKernel::sse2;
+    return SphereKernel::scalar;
+}
+
+/**
+ * Spheres in structure-of-arrays form. One ray is tested against several
+ * spheres per instruction. Every kernel evaluates exactly the expressions
+ * of Sphere::hit, in the same order, so all of them pick the same closest
+ * sphere and distance as a HittableList of the same spheres.
+ */
+class SphereSet : public Hittable {
+    public:
+        // Lanes of the widest kernel; arrays are padded by this much
+        static constexpr int max_lanes = 4;
+
+        SphereKernel kernel = best_sphere_kernel();
+
+        SphereSet() {
+            pad();
+        }
+
+        explicit SphereSet(const std::vector<Sphere> &spheres) {
+            for (const auto &sphere : spheres) {
+                add(sphere);
+            }
+        }
+
+        // Throws std::invalid_argument if the list holds anything but spheres
+        explicit SphereSet(const HittableList &list) {
+            for (const auto &object : list.objects) {
+                auto sphere = dynamic_cast<const Sphere *>(object.get());
+                if (!sphere) {
+                    throw std::invalid_argument(
+                        "SphereSet: list holds a non-sphere object");
+                }
+                add(*sphere);
+            }
+        }
+
+        void add(const Sphere &sphere) {
+            unpad();
+
+            cx.push_back(sphere.center().x());
+            cy.push_back(sphere.center().y());
+            cz.push_back(sphere.center().z());
+            radius.push_back(sphere.radius());
+            material.push_back(material_slot(sphere.material()));
+            bbox = Aabb(bbox, sphere.bounding_box());
+            count++;
+
+            pad();
+        }
+
+        std::uint32_t size() const {
+            return count;
+        }
+
+        void reserve(std::uint32_t capacity) {
+            for (auto *array : {&cx, &cy, &cz, &radius}) {
+                array->reserve(capacity + max_lanes);
+            }
+            material.reserve(capacity);
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            return hit_range(r, ray_t, 0, count, rec);
+        }
+
+        bool hit_range(const Ray &r, Interval ray_t, std::uint32_t first,
+                       std::uint32_t last, hit_record &rec) const {
+            Candidate best{ray_t.max, no_hit};
+            closest(r, ray_t, first, last, best);
+            if (best.index == no_hit) return false;
+
+            fill_record(r, best, rec);
+            return true;
+        }
+
+        Aabb bounding_box() const override {
+            return bbox;
+        }
+
+        unsigned material_kinds() const override {
+            unsigned kinds = 0;
+            for (const auto &material : materials) {
+                kinds |= material_bit(material.kind());
+            }
+            return kinds;
+        }
+
+        // Nearest sphere found so far; index is no_hit until one is found
+        struct Candidate {
+                Real t;
+                std::uint32_t index;
+        };
+
+        static constexpr std::uint32_t no_hit = UINT32_MAX;
+
+        /**
+         * Tests spheres [first, last) and replaces best with any sphere hit
+         * strictly closer than best.t (the earliest index wins ties).
+         */
+        void closest(const Ray &r, const Interval &ray_t, std::uint32_t first,
+                     std::uint32_t last, Candidate &best) const {
+            PALETTE_COUNT(primitive_tests, last - first);
+            switch (kernel) {
+#ifdef PALETTE_X86_SIMD
+            case SphereKernel::avx2:
+                closest_avx2(r, ray_t, first, last, best);
+                return;
+            case SphereKernel::sse2:
+                closest_sse2(r, ray_t, first, last, best);
+                return;
+#endif
+            default:
+                closest_scalar(r, ray_t, first, last, best);
+            }
+        }
+
+        void fill_record(const Ray &r, const Candidate &best,
+                         hit_record &rec) const {
+            auto k = best.index;
+            Point3 center(cx[k], cy[k], cz[k]);
+
+            rec.t = best.t;
+            rec.p = r.at(best.t);
+            Vec3 outward_normal = (rec.p - center) / radius[k];
+            rec.set_face_normal(r, outward_normal);
+            rec.mat = &materials[material[k]];
+        }
+
+    private:
+        using RealArray = std::vector<Real, AlignedAllocator<Real, 32>>;
+
+        RealArray cx, cy, cz, radius;
+        std::vector<std::uint32_t, AlignedAllocator<std::uint32_t, 32>>
+            material;
+        std::vector<Material> materials; // copies, one per distinct source
+        std::unordered_map<const Material *, std::uint32_t> material_slots;
+        std::uint32_t count = 0;
+        Aabb bbox;
+
+        std::uint32_t material_slot(const shared_ptr<Material> &mat) {
+            auto [slot, inserted] = material_slots.try_emplace(
+                mat.get(), std::uint32_t(materials.size()));
+            if (inserted) {
+                materials.push_back(*mat);
+            }
+            return slot->second;
+        }
+
+        // NaN padding lets kernels load whole vectors past the last
+        // sphere: every comparison against a padded lane is false
+        void pad() {
+            auto nan = std::numeric_limits<Real>::quiet_NaN();
+            for (auto *array : {&cx, &cy, &cz, &radius}) {
+                array->resize(count + max_lanes, nan);
+            }
+        }
+
+        void unpad() {
+            for (auto *array : {&cx, &cy, &cz, &radius}) {
+                array->resize(count);
+            }
+        }
+
+        void closest_scalar(const Ray &r, const Interval &ray_t,
+                            std::uint32_t first, std::uint32_t last,
+                            Candidate &best) const {
+            // In double like Sphere::hit_distance, whatever Real is
+            using Wide = Vec3T<double>;
+            const Wide orig(r.origin());
+            const Wide dir(r.direction());
+            auto a = dir.length_squared();
+
+            for (auto k = first; k < last; k++) {
+                Wide origin_center = Wide(cx[k], cy[k], cz[k]) - orig;
+                auto h = dot(dir, origin_center);
+                auto c = origin_center.length_squared() -
+                         (double(radius[k]) * radius[k]);
+
+                auto discriminant = h * h - a * c;
+                if (discriminant < 0) continue;
+
+                auto sqrtd = std::sqrt(discriminant);
+                auto root = Real((h - sqrtd) / a);
+                if (!ray_t.surrounds(root)) {
+                    root = Real((h + sqrtd) / a);
+                    if (!ray_t.surrounds(root)) continue;
+                }
+
+                if (root < best.t) {
+                    best = {root, k};
+                }
+            }
+        }
+
+#ifdef PALETTE_X86_SIMD
+        // Merges per-lane winners, preferring the lowest index on ties.
+        // Lanes only hold spheres strictly closer than the incoming best.
+        static void reduce_lanes(const double *t, const double *index,
+                                 int lanes, Candidate &best) {
+            bool found = false;
+            for (int lane = 0; lane < lanes; lane++) {
+                if (index[lane] < 0) continue;
+                auto k = std::uint32_t(index[lane]);
+                if (!found || t[lane] < best.t ||
+                    (t[lane] == best.t && k < best.index)) {
+                    best = {t[lane], k};
+                    found = true;
+                }
+            }
+        }
+
+        __attribute__((target("avx2"))) void
+        closest_avx2(const Ray &r, const Interval &ray_t, std::uint32_t first,
+                     std::uint32_t last, Candidate &best) const {
+            const Point3 &orig = r.origin();
+            const Vec3 &dir = r.direction();
+
+            const __m256d ox = _mm256_set1_pd(orig.x());
+            const __m256d oy = _mm256_set1_pd(orig.y());
+            const __m256d oz = _mm256_set1_pd(orig.z());
+            const __m256d dx = _mm256_set1_pd(dir.x());
+            const __m256d dy = _mm256_set1_pd(dir.y());
+            const __m256d dz = _mm256_set1_pd(dir.z());
+            const __m256d a = _mm256_set1_pd(dir.length_squared());
+            const __m256d t_min = _mm256_set1_pd(ray_t.min);
+            const __m256d t_max = _mm256_set1_pd(ray_t.max);
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256d end = _mm256_set1_pd(double(last));
+            const __m256d lane_offset = _mm256_set_pd(3, 2, 1, 0);
+
+            __m256d best_t = _mm256_set1_pd(best.t);
+            __m256d best_index = _mm256_set1_pd(-1);
+
+            for (auto k = first; k < last; k += 4) {
+                __m256d ocx = _mm256_sub_pd(_mm256_loadu_pd(&cx[k]), ox);
+                __m256d ocy = _mm256_sub_pd(_mm256_loadu_pd(&cy[k]), oy);
+                __m256d ocz = _mm256_sub_pd(_mm256_loadu_pd(&cz[k]), oz);
+                __m256d rad = _mm256_loadu_pd(&radius[k]);
+
+                __m256d h = _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(dx, ocx),
+                                  _mm256_mul_pd(dy, ocy)),
+                    _mm256_mul_pd(dz, ocz));
+                __m256d len_sq = _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(ocx, ocx),
+                                  _mm256_mul_pd(ocy, ocy)),
+                    _mm256_mul_pd(ocz, ocz));
+                __m256d c = _mm256_sub_pd(len_sq, _mm256_mul_pd(rad, rad));
+                __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h),
+                                                     _mm256_mul_pd(a, c));
+
+                __m256d valid =
+                    _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+                // Most rays miss most spheres: skip the sqrt and divides
+                if (_mm256_movemask_pd(valid) == 0) continue;
+
+                __m256d sqrtd = _mm256_sqrt_pd(discriminant);
+                __m256d near = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+                __m256d far = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+
+                __m256d near_ok =
+                    _mm256_and_pd(_mm256_cmp_pd(near, t_min, _CMP_GT_OQ),
+                                  _mm256_cmp_pd(near, t_max, _CMP_LT_OQ));
+                __m256d far_ok =
+                    _mm256_and_pd(_mm256_cmp_pd(far, t_min, _CMP_GT_OQ),
+                                  _mm256_cmp_pd(far, t_max, _CMP_LT_OQ));
+                __m256d root = _mm256_blendv_pd(far, near, near_ok);
+
+                __m256d index =
+                    _mm256_add_pd(_mm256_set1_pd(double(k)), lane_offset);
+                __m256d take = _mm256_and_pd(
+                    _mm256_and_pd(valid, _mm256_or_pd(near_ok, far_ok)),
+                    _mm256_cmp_pd(index, end, _CMP_LT_OQ));
+                take = _mm256_and_pd(take,
+                                     _mm256_cmp_pd(root, best_t, _CMP_LT_OQ));
+
+                best_t = _mm256_blendv_pd(best_t, root, take);
+                best_index = _mm256_blendv_pd(best_index, index, take);
+            }
+
+            alignas(32) double t[4], index[4];
+            _mm256_store_pd(t, best_t);
+            _mm256_store_pd(index, best_index);
+            reduce_lanes(t, index, 4, best);
+        }
+
+        void closest_sse2(const Ray &r, const Interval &ray_t,
+                          std::uint32_t first, std::uint32_t last,
+                          Candidate &best) const {
+            const Point3 &orig = r.origin();
+            const Vec3 &dir = r.direction();
+
+            const __m128d ox = _mm_set1_pd(orig.x());
+            const __m128d oy = _mm_set1_pd(orig.y());
+            const __m128d oz = _mm_set1_pd(orig.z());
+            const __m128d dx = _mm_set1_pd(dir.x());
+            const __m128d dy = _mm_set1_pd(dir.y());
+            const __m128d dz = _mm_set1_pd(dir.z());
+            const __m128d a = _mm_set1_pd(dir.length_squared());
+            const __m128d t_min = _mm_set1_pd(ray_t.min);
+            const __m128d t_max = _mm_set1_pd(ray_t.max);
+            const __m128d zero = _mm_setzero_pd();
+            const __m128d end = _mm_set1_pd(double(last));
+            const __m128d lane_offset = _mm_set_pd(1, 0);
+
+            // SSE2 has no blendv, so select with and/andnot/or
+            auto select = [](__m128d mask, __m128d yes, __m128d no) {
+                return _mm_or_pd(_mm_and_pd(mask, yes),
+                                 _mm_andnot_pd(mask, no));
+            };
+
+            __m128d best_t = _mm_set1_pd(best.t);
+            __m128d best_index = _mm_set1_pd(-1);
+
+            for (auto k = first; k < last; k += 2) {
+                __m128d ocx = _mm_sub_pd(_mm_loadu_pd(&cx[k]), ox);
+                __m128d ocy = _mm_sub_pd(_mm_loadu_pd(&cy[k]), oy);
+                __m128d ocz = _mm_sub_pd(_mm_loadu_pd(&cz[k]), oz);
+                __m128d rad = _mm_loadu_pd(&radius[k]);
+
+                __m128d h = _mm_add_pd(
+                    _mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)),
+                    _mm_mul_pd(dz, ocz));
+                __m128d len_sq = _mm_add_pd(
+                    _mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)),
+                    _mm_mul_pd(ocz, ocz));
+                __m128d c = _mm_sub_pd(len_sq, _mm_mul_pd(rad, rad));
+                __m128d discriminant =
+                    _mm_sub_pd(_mm_mul_pd(h, h), _mm_mul_pd(a, c));
+
+                __m128d valid = _mm_cmpge_pd(discriminant, zero);
+                if (_mm_movemask_pd(valid) == 0) continue;
+
+                __m128d sqrtd = _mm_sqrt_pd(discriminant);
+                __m128d near = _mm_div_pd(_mm_sub_pd(h, sqrtd), a);
+                __m128d far = _mm_div_pd(_mm_add_pd(h, sqrtd), a);
+
+                __m128d near_ok = _mm_and_pd(_mm_cmpgt_pd(near, t_min),
+                                             _mm_cmplt_pd(near, t_max));
+                __m128d far_ok = _mm_and_pd(_mm_cmpgt_pd(far, t_min),
+                                            _mm_cmplt_pd(far, t_max));
+                __m128d root = select(near_ok, near, far);
+
+                __m128d index =
+                    _mm_add_pd(_mm_set1_pd(double(k)), lane_offset);
+                __m128d take =
+                    _mm_and_pd(_mm_and_pd(valid, _mm_or_pd(near_ok, far_ok)),
+                               _mm_cmplt_pd(index, end));
+                take = _mm_and_pd(take, _mm_cmplt_pd(root, best_t));
+
+                best_t = select(take, root, best_t);
+                best_index = select(take, index, best_index);
+            }
+
+            alignas(16) double t[2], index[2];
+            _mm_store_pd(t, best_t);
+            _mm_store_pd(index, best_index);
+            reduce_lanes(t, index, 2, best);
+        }
+#endif
+};
+
+/**
+ * FlatBvh whose leaves are ranges of a SphereSet stored in leaf order.
+ * Leaves only track the nearest sphere; the hit record is filled once,
+ * for the final winner.
+ */
+class SphereBvh : public Hittable {
+    public:
+        explicit SphereBvh(const std::vector<const Sphere *> &input) {
+            std::vector<Aabb> boxes;
+            boxes.reserve(input.size());
+            for (const auto *sphere : input) {
+                boxes.push_back(sphere->bounding_box());
+            }
+            bvh.build(boxes);
+
+            spheres.reserve(std::uint32_t(input.size()));
+            for (auto k : bvh.primitive_order()) {
+                spheres.add(*input[k]);
+            }
+        }
+
+        explicit SphereBvh(const HittableList &list)
+            : SphereBvh(collect(list)) {
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            SphereSet::Candidate best{ray_t.max, SphereSet::no_hit};
+
+            bvh.intersect(r, ray_t,
+                          [&](std::uint32_t first, std::uint32_t count,
+                              Interval &t) {
+                              auto before = best.index;
+                              spheres.closest(r, t, first, first + count,
+                                              best);
+                              if (best.index == before) return false;
+                              t.max = best.t;
+                              return true;
+                          });
+
+            if (best.index == SphereSet::no_hit) return false;
+            spheres.fill_record(r, best, rec);
+            return true;
+        }
+
+        Aabb bounding_box() const override {
+            return bvh.bounding_box();
+        }
+
+        unsigned material_kinds() const override {
+            return spheres.material_kinds();
+        }
+
+        SphereSet &sphere_set() {
+            return spheres;
+        }
+
+    private:
+        FlatBvh bvh;
+        SphereSet spheres;
+
+        static std::vector<const Sphere *> collect(const HittableList &list) {
+            std::vector<const Sphere *> input;
+            input.reserve(list.objects.size());
+            for (const auto &object : list.objects) {
+                auto sphere = dynamic_cast<const Sphere *>(object.get());
+                if (!sphere) {
+                    throw std::invalid_argument(
+                        "SphereBvh: list holds a non-sphere object");
+                }
+                input.push_back(sphere);
+            }
+            return input;
+        }
+};
+
+#endif
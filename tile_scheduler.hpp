@@ -0,0 +1,106 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1)
+struct Tile {
+        int x0, y0, x1, y1;
+
+        int width() const {
+            return x1 - x0;
+        }
+        int height() const {
+            return y1 - y0;
+        }
+};
+
+// The tiles covering an image, row by row
+inline std::vector<Tile> image_tiles(int image_width, int image_height,
+                                     int tile_size) {
+    tile_size = std::max(tile_size, 1);
+
+    std::vector<Tile> tiles;
+    for (int y = 0; y < image_height; y += tile_size) {
+        for (int x = 0; x < image_width; x += tile_size) {
+            tiles.push_back({x, y, std::min(x + tile_size, image_width),
+                             std::min(y + tile_size, image_height)});
+        }
+    }
+    return tiles;
+}
+
+/**
+ * Hands out image tiles to a fixed set of workers. Every worker owns a
+ * deque that is seeded round-robin so expensive regions get spread out.
+ * Workers pop from the front of their own deque and, once it runs dry,
+ * steal from the back of someone else's.
+ */
+class TileScheduler {
+    public:
+        TileScheduler(int image_width, int image_height, int tile_size,
+                      int worker_count)
+            : queues(std::max(worker_count, 1)) {
+            for (auto &queue : queues) {
+                queue = std::make_unique<Queue>();
+            }
+
+            int next = 0;
+            for (const auto &tile :
+                 image_tiles(image_width, image_height, tile_size)) {
+                queues[next]->tiles.push_back(tile);
+                next = (next + 1) % int(queues.size());
+                total++;
+            }
+        }
+
+        int tile_count() const {
+            return total;
+        }
+
+        // Returns false once every queue is empty
+        bool next(int worker, Tile &tile) {
+            if (pop_front(*queues[worker], tile)) {
+                return true;
+            }
+
+            int n = int(queues.size());
+            for (int k = 1; k < n; k++) {
+                if (pop_back(*queues[(worker + k) % n], tile)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        struct Queue {
+                std::mutex lock;
+                std::deque<Tile> tiles;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        int total = 0;
+
+        static bool pop_front(Queue &queue, Tile &tile) {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tiles.empty()) return false;
+            tile = queue.tiles.front();
+            queue.tiles.pop_front();
+            return true;
+        }
+
+        static bool pop_back(Queue &queue, Tile &tile) {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tiles.empty()) return false;
+            tile = queue.tiles.back();
+            queue.tiles.pop_back();
+            return true;
+        }
+};
+
+#endif
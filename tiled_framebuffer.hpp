@@ -0,0 +1,156 @@
+#ifndef TILED_FRAMEBUFFER_H
+#define TILED_FRAMEBUFFER_H
+
+#include "color.hpp"
+#include "image_writer.hpp"
+#include "mapped_file.hpp"
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Linear RGB image kept out of core, in a memory-mapped file of square
+ * tiles. Each tile is a page-aligned run of floats, row-major within the
+ * tile, so a worker rendering a tile touches only that tile's pages, and
+ * release() drops them from memory once it is done; the data stays in the
+ * file. A render then holds only the tiles in flight, one per worker,
+ * however large the image.
+ *
+ * The writers read it back through rows(), a band of tiles at a time.
+ */
+class TiledFramebuffer {
+    public:
+        // Creates path, or reuses it if it has the right size
+        TiledFramebuffer(const std::string &path, int width, int height,
+                         int tile_size)
+            : w(width), h(height), size(std::max(tile_size, 1)),
+              tiles_across((width + size - 1) / size),
+              tile_bytes(page_multiple(size_t(size) * size * 3 *
+                                       sizeof(float))) {
+            if (width <= 0 || height <= 0) {
+                throw std::invalid_argument("TiledFramebuffer: empty image");
+            }
+            auto tiles_down = size_t(height + size - 1) / size;
+            file = MappedFile(path, tiles_across * tiles_down * tile_bytes);
+        }
+
+        int width() const {
+            return w;
+        }
+        int height() const {
+            return h;
+        }
+        int tile_size() const {
+            return size;
+        }
+
+        // Bytes of the backing file
+        size_t file_size() const {
+            return file.size();
+        }
+
+        Color pixel(int i, int j) const {
+            const float *rgb = at(i, j);
+            return Color(rgb[0], rgb[1], rgb[2]);
+        }
+
+        void set_pixel(int i, int j, const Color &c) {
+            float *rgb = at(i, j);
+            rgb[0] = float(c.x());
+            rgb[1] = float(c.y());
+            rgb[2] = float(c.z());
+        }
+
+        // Drops the pages of the tile holding the top left pixel of `tile`
+        // from memory. They are read back from the file if touched again.
+        void release(const Tile &tile) const {
+            release_tile(tile.x0 / size, tile.y0 / size);
+        }
+
+        /**
+         * The image's rows for ImageWriter::write_rows. The tiles of a band
+         * are copied into a buffer of width * tile_size pixels and released
+         * as it is loaded, so reading holds one band, not the image.
+         */
+        class Rows : public ImageRows {
+            public:
+                explicit Rows(const TiledFramebuffer &image)
+                    : image(image),
+                      band(size_t(image.w) * image.size * 3) {
+                }
+
+                int width() const override {
+                    return image.w;
+                }
+                int height() const override {
+                    return image.h;
+                }
+
+                const float *row(int j) override {
+                    if (j / image.size != loaded) load(j / image.size);
+                    return band.data() +
+                           size_t(j % image.size) * image.w * 3;
+                }
+
+            private:
+                const TiledFramebuffer &image;
+                std::vector<float> band;
+                int loaded = -1;
+
+                void load(int ty) {
+                    int rows = std::min(image.size, image.h - ty * image.size);
+                    for (size_t tx = 0; tx < image.tiles_across; tx++) {
+                        auto x0 = tx * image.size;
+                        auto columns = std::min(size_t(image.size),
+                                                size_t(image.w) - x0);
+                        const float *tile = image.tile_data(tx, ty);
+                        for (int r = 0; r < rows; r++) {
+                            std::memcpy(&band[(size_t(r) * image.w + x0) * 3],
+                                        tile + size_t(r) * image.size * 3,
+                                        columns * 3 * sizeof(float));
+                        }
+                        image.release_tile(tx, ty);
+                    }
+                    loaded = ty;
+                }
+        };
+
+        Rows rows() const {
+            return Rows(*this);
+        }
+
+    private:
+        MappedFile file;
+        int w, h;
+        int size;
+        size_t tiles_across;
+        size_t tile_bytes; // whole pages
+
+        static size_t page_multiple(size_t bytes) {
+            auto page = size_t(::sysconf(_SC_PAGESIZE));
+            return (bytes + page - 1) / page * page;
+        }
+
+        float *tile_data(size_t tx, size_t ty) const {
+            return reinterpret_cast<float *>(
+                file.data() + (ty * tiles_across + tx) * tile_bytes);
+        }
+
+        float *at(int i, int j) const {
+            return tile_data(size_t(i / size), size_t(j / size)) +
+                   (size_t(j % size) * size + i % size) * 3;
+        }
+
+        void release_tile(size_t tx, size_t ty) const {
+            ::madvise(tile_data(tx, ty), tile_bytes, MADV_DONTNEED);
+        }
+};
+
+#endif
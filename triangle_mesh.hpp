@@ -0,0 +1,228 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "common.hpp"
+#include "aabb.hpp"
+#include "flat_bvh.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "render_stats.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * Ray set up for the watertight triangle test of Woop, Benthin and Wald
+ * (JCGT 2013). The ray is sheared so that it runs along +z; each triangle
+ * is then tested in 2D with edge functions that are evaluated the same way
+ * for both triangles sharing an edge, so a ray through an edge or a vertex
+ * hits at least one of them and never slips between.
+ */
+struct WatertightRay {
+        Point3 origin;
+        int kx, ky, kz;
+        Real sx, sy, sz;
+
+        explicit WatertightRay(const Ray &r) : origin(r.origin()) {
+            const Vec3 &dir = r.direction();
+
+            // z is the largest component, x and y keep the winding
+            kz = 0;
+            for (int axis = 1; axis < 3; axis++) {
+                if (std::fabs(dir[axis]) > std::fabs(dir[kz])) kz = axis;
+            }
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            if (dir[kz] < 0) std::swap(kx, ky);
+
+            sx = dir[kx] / dir[kz];
+            sy = dir[ky] / dir[kz];
+            sz = 1 / dir[kz];
+        }
+};
+
+/**
+ * Shared vertex and index buffers with a FlatBvh over the triangles. A
+ * triangle is three indices into the vertex array, so a million faces
+ * cost 12 bytes each plus their vertices and tree nodes instead of a
+ * heap object apiece. Shading uses the geometric normal.
+ */
+class TriangleMesh : public Hittable {
+    public:
+        // indices holds three vertex numbers per triangle, counterclockwise
+        // seen from the front
+        TriangleMesh(std::vector<Point3> vertices,
+                     std::vector<std::uint32_t> indices,
+                     shared_ptr<Material> mat)
+            : vertices(std::move(vertices)), mat(mat) {
+            if (indices.size() % 3 != 0) {
+                throw std::invalid_argument(
+                    "TriangleMesh: index count is not a multiple of 3");
+            }
+            for (auto index : indices) {
+                if (index >= this->vertices.size()) {
+                    throw std::invalid_argument(
+                        "TriangleMesh: vertex index out of range");
+                }
+            }
+
+            size_t count = indices.size() / 3;
+            std::vector<Aabb> boxes;
+            boxes.reserve(count);
+            for (size_t k = 0; k < count; k++) {
+                const auto &a = this->vertices[indices[3 * k]];
+                const auto &b = this->vertices[indices[3 * k + 1]];
+                const auto &c = this->vertices[indices[3 * k + 2]];
+                boxes.push_back(Aabb(Aabb(a, b), Aabb(c, c)));
+            }
+            bvh.build(boxes);
+
+            // Triangles in leaf order, so a leaf reads one run of indices
+            triangles.reserve(indices.size());
+            for (auto k : bvh.primitive_order()) {
+                triangles.insert(triangles.end(), &indices[3 * k],
+                                 &indices[3 * k] + 3);
+            }
+        }
+
+        bool hit(const Ray &r, Interval ray_t, hit_record &rec) const override {
+            WatertightRay ray(r);
+            std::uint32_t closest = no_hit;
+            Real closest_t = 0, b1 = 0, b2 = 0;
+
+            bvh.intersect(r, ray_t,
+                          [&](std::uint32_t first, std::uint32_t count,
+                              Interval &t) {
+                              PALETTE_COUNT(primitive_tests, count);
+                              bool hit_anything = false;
+                              for (auto k = first; k < first + count; k++) {
+                                  Real u, v, w, root;
+                                  if (intersect(ray, k, t, root, u, v, w)) {
+                                      hit_anything = true;
+                                      closest = k;
+                                      closest_t = root;
+                                      b1 = v;
+                                      b2 = w;
+                                      t.max = root;
+                                  }
+                              }
+                              return hit_anything;
+                          });
+            if (closest == no_hit) return false;
+
+            const auto &a = vertex(closest, 0);
+            const auto &b = vertex(closest, 1);
+            const auto &c = vertex(closest, 2);
+
+            rec.t = closest_t;
+            // From the barycentrics the point lies on the triangle itself
+            rec.p = (1 - b1 - b2) * a + b1 * b + b2 * c;
+            rec.set_face_normal(r, unit_vector(cross(b - a, c - a)));
+            rec.mat = mat.get();
+            return true;
+        }
+
+        Aabb bounding_box() const override {
+            return bvh.bounding_box();
+        }
+
+        unsigned material_kinds() const override {
+            return material_bit(mat->kind());
+        }
+
+        size_t triangle_count() const {
+            return triangles.size() / 3;
+        }
+
+        size_t vertex_count() const {
+            return vertices.size();
+        }
+
+        const std::vector<Point3> &vertex_array() const {
+            return vertices;
+        }
+
+        // Three vertex numbers per triangle, in leaf order
+        const std::vector<std::uint32_t> &index_array() const {
+            return triangles;
+        }
+
+        // Bytes held by the vertices, indices and tree
+        size_t memory_bytes() const {
+            return vertices.capacity() * sizeof(Point3) +
+                   triangles.capacity() * sizeof(std::uint32_t) +
+                   bvh.node_array().capacity() * sizeof(FlatBvhNode) +
+                   bvh.primitive_order().capacity() * sizeof(std::uint32_t);
+        }
+
+    private:
+        static constexpr std::uint32_t no_hit = UINT32_MAX;
+
+        std::vector<Point3> vertices;
+        std::vector<std::uint32_t> triangles;
+        shared_ptr<Material> mat;
+        FlatBvh bvh;
+
+        const Point3 &vertex(std::uint32_t triangle, int corner) const {
+            return vertices[triangles[3 * triangle + corner]];
+        }
+
+        /**
+         * Tests one triangle. On a hit inside ray_t, sets t and the
+         * barycentric weights u, v, w of the first, second and third
+         * vertex. Both sides count as hits.
+         */
+        bool intersect(const WatertightRay &ray, std::uint32_t k,
+                       const Interval &ray_t, Real &t, Real &u, Real &v,
+                       Real &w) const {
+            Vec3 pa = vertex(k, 0) - ray.origin;
+            Vec3 pb = vertex(k, 1) - ray.origin;
+            Vec3 pc = vertex(k, 2) - ray.origin;
+
+            // Shear so the ray runs along +z
+            Real ax = pa[ray.kx] - ray.sx * pa[ray.kz];
+            Real ay = pa[ray.ky] - ray.sy * pa[ray.kz];
+            Real bx = pb[ray.kx] - ray.sx * pb[ray.kz];
+            Real by = pb[ray.ky] - ray.sy * pb[ray.kz];
+            Real cx = pc[ray.kx] - ray.sx * pc[ray.kz];
+            Real cy = pc[ray.ky] - ray.sy * pc[ray.kz];
+
+            // Twice the signed areas of the sub-triangles opposite each
+            // vertex, as seen down the ray
+            Real eu = cx * by - cy * bx;
+            Real ev = ax * cy - ay * cx;
+            Real ew = bx * ay - by * ax;
+
+            // A zero is where float rounding decides on which side of an
+            // edge the ray passes; double settles it consistently
+            if constexpr (sizeof(Real) < sizeof(double)) {
+                if (eu == 0 || ev == 0 || ew == 0) {
+                    eu = Real(double(cx) * by - double(cy) * bx);
+                    ev = Real(double(ax) * cy - double(ay) * cx);
+                    ew = Real(double(bx) * ay - double(by) * ax);
+                }
+            }
+
+            if ((eu < 0 || ev < 0 || ew < 0) && (eu > 0 || ev > 0 || ew > 0)) {
+                return false;
+            }
+            Real det = eu + ev + ew;
+            if (det == 0) return false;
+
+            Real az = ray.sz * pa[ray.kz];
+            Real bz = ray.sz * pb[ray.kz];
+            Real cz = ray.sz * pc[ray.kz];
+            t = (eu * az + ev * bz + ew * cz) / det;
+            if (!ray_t.surrounds(t)) return false;
+
+            u = eu / det;
+            v = ev / det;
+            w = ew / det;
+            return true;
+        }
+};
+
+#endif
@@ -4,143 +4,177 @@
 #include "common.hpp"
 #include <cmath>
 #include <iostream>
-
-class Vec3 {
+#include <limits>
+
+/**
+ * Three component vector over scalar type T. The renderer uses Vec3, whose
+ * scalar is Real; the scalar argument of the mixed operators is not
+ * deduced, so double literals work with either precision.
+ */
+template <typename T>
+class Vec3T {
     public:
-        double e[3];
+        using scalar = T;
+
+        T e[3];
 
-        Vec3() : e{0, 0, 0} {
+        Vec3T() : e{0, 0, 0} {
+        }
+        Vec3T(T e0, T e1, T e2) : e{e0, e1, e2} {
         }
-        Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {
+
+        // Changing precision has to be asked for
+        template <typename U>
+        explicit Vec3T(const Vec3T<U> &v) : e{T(v[0]), T(v[1]), T(v[2])} {
         }
 
-        double x() const {
+        T x() const {
             return e[0];
         }
-        double y() const {
+        T y() const {
             return e[1];
         }
-        double z() const {
+        T z() const {
             return e[2];
         }
 
-        Vec3 operator-() const {
-            return Vec3(-e[0], -e[1], -e[2]);
+        Vec3T operator-() const {
+            return Vec3T(-e[0], -e[1], -e[2]);
         }
 
-        const double &operator[](int i) const {
+        const T &operator[](int i) const {
             return e[i];
         }
 
-        double &operator[](int i) {
+        T &operator[](int i) {
             return e[i];
         }
 
-        Vec3 &operator+=(const Vec3 &v) {
+        Vec3T &operator+=(const Vec3T &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
             return *this;
         }
 
-        Vec3 &operator*=(double t) {
+        Vec3T &operator*=(T t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        Vec3 &operator/=(double t) {
+        Vec3T &operator/=(T t) {
             return *this *= 1 / t;
         }
 
-        double length() const {
+        T length() const {
             return std::sqrt(length_squared());
         }
 
-        double length_squared() const {
+        T length_squared() const {
             return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
         }
 
         // returns true if the vector is close to zero in all dimensions
         bool near_zero() const {
-            auto s = 1e-8;
+            auto s = T(1e-8);
             return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) &&
                    (std::fabs(e[2]) < s);
         }
 
-        static Vec3 random() {
-            return Vec3(random_double(), random_double(), random_double());
+        static Vec3T random() {
+            return Vec3T(random_double(), random_double(), random_double());
         }
 
-        static Vec3 random(double min, double max) {
-            return Vec3(random_double(min, max), random_double(min, max),
-                        random_double(min, max));
+        static Vec3T random(double min, double max) {
+            return Vec3T(random_double(min, max), random_double(min, max),
+                         random_double(min, max));
         }
 };
 
+using Vec3 = Vec3T<Real>;
 using Point3 = Vec3;
 
 // Vector utility functions
 
-inline std::ostream &operator<<(std::ostream &out, const Vec3 &v) {
+template <typename T>
+inline std::ostream &operator<<(std::ostream &out, const Vec3T<T> &v) {
     return out << v[0] << ' ' << v[1] << ' ' << v[2];
 }
 
-inline Vec3 operator+(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u[0] + v[0], u[1] + v[1], u[2] + v[2]);
+template <typename T>
+inline Vec3T<T> operator+(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u[0] + v[0], u[1] + v[1], u[2] + v[2]);
 }
 
-inline Vec3 operator-(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u[0] - v[0], u[1] - v[1], u[2] - v[2]);
+template <typename T>
+inline Vec3T<T> operator-(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u[0] - v[0], u[1] - v[1], u[2] - v[2]);
 }
 
-inline Vec3 operator*(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u[0] * v[0], u[1] * v[1], u[2] * v[2]);
+template <typename T>
+inline Vec3T<T> operator*(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u[0] * v[0], u[1] * v[1], u[2] * v[2]);
 }
 
-inline Vec3 operator*(const double t, const Vec3 &u) {
-    return Vec3(t * u[0], t * u[1], t * u[2]);
+template <typename T>
+inline Vec3T<T> operator*(typename Vec3T<T>::scalar t, const Vec3T<T> &u) {
+    return Vec3T<T>(t * u[0], t * u[1], t * u[2]);
 }
 
-inline Vec3 operator*(const Vec3 &u, const double t) {
+template <typename T>
+inline Vec3T<T> operator*(const Vec3T<T> &u, typename Vec3T<T>::scalar t) {
     return t * u;
 }
 
-inline Vec3 operator/(const Vec3 &v, double t) {
+template <typename T>
+inline Vec3T<T> operator/(const Vec3T<T> &v, typename Vec3T<T>::scalar t) {
     return (1 / t) * v;
 }
 
-inline double dot(const Vec3 &u, const Vec3 &v) {
+template <typename T>
+inline T dot(const Vec3T<T> &u, const Vec3T<T> &v) {
     return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
 }
 
-inline Vec3 cross(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2],
-                u[0] * v[1] - u[1] * v[0]);
+template <typename T>
+inline Vec3T<T> cross(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2],
+                    u[0] * v[1] - u[1] * v[0]);
 }
 
-inline Vec3 unit_vector(const Vec3 &v) {
+template <typename T>
+inline Vec3T<T> unit_vector(const Vec3T<T> &v) {
     return v / v.length();
 }
 
+// Concentric map of the sampler's next point onto the unit disk (Shirley
+// and Chiu), which keeps strata of the square as strata of the disk
 inline Vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = Vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1) return p;
+    auto [u, v] = sample_2d();
+    double a = 2 * u - 1, b = 2 * v - 1;
+    if (a == 0 && b == 0) return Vec3(0, 0, 0);
+
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        phi = pi / 4 * (b / a);
+    } else {
+        r = b;
+        phi = pi / 2 - pi / 4 * (a / b);
     }
+    return Vec3(r * std::cos(phi), r * std::sin(phi), 0);
 }
 
+// Uniform direction from the sampler's next point: z is uniform on [-1, 1]
+// by Archimedes' hat-box theorem, and the azimuth is uniform
 inline Vec3 random_unit_vector() {
-    while (true) {
-        auto p = Vec3::random(-1, 1);
-        auto len_sq = p.length_squared();
-        // filter out any values that may cause floating point
-        // precision errors or are outside the circle
-        if (1e-160 < len_sq && len_sq <= 1) {
-            return p / sqrt(len_sq);
-        }
-    }
+    auto [u, v] = sample_2d();
+    double z = 1 - 2 * u;
+    double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * v;
+    return Vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 inline Vec3 random_on_hemisphere(const Vec3 &normal) {
@@ -156,11 +190,11 @@ inline Vec3 reflect(const Vec3 &v, const Vec3 &n) {
     return v - (2 * dot(v, n) * n);
 }
 
-inline Vec3 refract(const Vec3 &uv, const Vec3 &n, double eta_ratio) {
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+inline Vec3 refract(const Vec3 &uv, const Vec3 &n, Real eta_ratio) {
+    auto cos_theta = std::fmin(dot(-uv, n), Real(1));
     Vec3 r_out_perp = eta_ratio * (uv + cos_theta * n);
     Vec3 r_out_parallel =
-        -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+        -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
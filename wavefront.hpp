@@ -0,0 +1,174 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "camera.hpp"
+#include "framebuffer.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "profile.hpp"
+#include "render_stats.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Breadth-first path tracer. Instead of following one path to the end,
+ * each worker keeps a wavefront of paths in flight and advances all of
+ * them one bounce per stage:
+ *
+ *   1. regenerate: top the wavefront up with fresh camera paths
+ *   2. intersect:  trace every path; misses add the sky and finish
+ *   3. shade:      bucket hits by material kind, then run each kind's
+ *                  scatter over its whole queue
+ *   4. compact:    drop finished paths
+ *
+ * Each path carries its own generator and sampler position, so it draws
+ * exactly the numbers the depth-first Camera::ray_color would. Only the
+ * order in which samples are summed into a pixel differs, which can change
+ * the last bits.
+ *
+ * Every pixel takes samples_per_pixel; adaptive sampling and AOVs are
+ * left to Camera::render_image.
+ */
+class WavefrontRenderer {
+    public:
+        // Paths in flight per worker thread
+        size_t wavefront_size = 4096;
+
+        Framebuffer render(Camera &cam, const Hittable &world) const {
+            if (cam.adaptive_sampling) {
+                throw std::invalid_argument(
+                    "WavefrontRenderer: adaptive sampling is not supported");
+            }
+            if (cam.render_aovs) {
+                throw std::invalid_argument(
+                    "WavefrontRenderer: AOVs are not supported");
+            }
+            cam.initialize();
+
+            Framebuffer image(cam.image_width, cam.height());
+            cam.for_each_tile([&](const Tile &tile) {
+                render_tile(cam, world, tile, image);
+            });
+
+            std::clog << "\rDone.                 \n";
+            return image;
+        }
+
+    private:
+        struct Path {
+                Ray ray;
+                Color throughput;
+                Rng rng;
+                SampleStream stream;
+                std::uint32_t pixel; // index within the tile
+                int bounce;
+                bool alive;
+        };
+
+        void render_tile(const Camera &cam, const Hittable &world,
+                         const Tile &tile, Framebuffer &image) const {
+            PALETTE_PROFILE_TILE(tile);
+            const int spp = cam.samples_per_pixel;
+            const auto pixels = std::uint64_t(tile.width()) * tile.height();
+            // Like Camera::ray_color, a path allowed no bounce is black
+            const auto total = cam.max_depth > 0 ? pixels * spp : 0;
+
+            std::vector<Color> sums(pixels);
+            std::vector<Path> paths;
+            std::vector<hit_record> hits;
+            std::vector<std::uint32_t> queues[material_kind_count];
+            paths.reserve(std::max<size_t>(wavefront_size, 1));
+
+            auto &counters = path_counters();
+            Rng &rng = thread_rng();
+            SampleStream &stream = thread_sample_stream();
+            std::uint64_t next = 0; // next (pixel, sample) pair to start
+
+            while (true) {
+                while (paths.size() < std::max<size_t>(wavefront_size, 1) &&
+                       next < total) {
+                    auto local = std::uint32_t(next / spp);
+                    auto sample = int(next % spp);
+                    next++;
+
+                    int i = tile.x0 + int(local % tile.width());
+                    int j = tile.y0 + int(local / tile.width());
+                    cam.start_sample(std::uint64_t(j) * cam.image_width + i,
+                                     sample);
+
+                    Path path;
+                    path.ray = cam.sample_ray(i, j);
+                    path.throughput = Color(1, 1, 1);
+                    path.rng = rng;
+                    path.stream = stream;
+                    path.pixel = local;
+                    path.bounce = 0;
+                    path.alive = true;
+                    paths.push_back(path);
+                }
+                if (paths.empty()) break;
+
+                hits.resize(paths.size());
+                for (auto &queue : queues) {
+                    queue.clear();
+                }
+
+                for (std::uint32_t k = 0; k < paths.size(); k++) {
+                    auto &path = paths[k];
+                    if (Camera::trace(world, path.ray, hits[k])) {
+                        queues[int(hits[k].mat->kind())].push_back(k);
+                    } else {
+                        sums[path.pixel] +=
+                            path.throughput * Camera::sky_color(path.ray);
+                        path.alive = false;
+                    }
+                }
+
+                for (const auto &queue : queues) {
+                    for (auto k : queue) {
+                        auto &path = paths[k];
+                        rng = path.rng;
+                        stream = path.stream;
+
+                        Ray scattered;
+                        Color attenuation;
+                        if (!hits[k].mat->scatter(path.ray, hits[k],
+                                                  attenuation, scattered)) {
+                            PALETTE_COUNT(absorbed, 1);
+                            path.alive = false;
+                            continue;
+                        }
+                        counters.bounces++;
+                        PALETTE_COUNT(scatters[int(hits[k].mat->kind())], 1);
+
+                        path.throughput = path.throughput * attenuation;
+                        path.ray = scattered;
+                        path.alive =
+                            cam.survives_roulette(path.throughput,
+                                                  path.bounce) &&
+                            ++path.bounce < cam.max_depth;
+                        path.rng = rng;
+                        path.stream = stream;
+                    }
+                }
+
+                paths.erase(std::remove_if(paths.begin(), paths.end(),
+                                           [](const Path &path) {
+                                               return !path.alive;
+                                           }),
+                            paths.end());
+            }
+
+            auto scale = 1.0 / spp;
+            for (std::uint32_t local = 0; local < pixels; local++) {
+                image.set_pixel(tile.x0 + int(local % tile.width()),
+                                tile.y0 + int(local / tile.width()),
+                                scale * sums[local]);
+            }
+        }
+};
+
+#endif